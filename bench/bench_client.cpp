@@ -0,0 +1,198 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <chrono>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+// Measures the server over TCP or a Unix socket:
+//   ./bench_client 12345 20000            ping-pong and chat over TCP
+//   ./bench_client /tmp/chat.sock 20000   the same over the Unix socket
+// The count is the number of /ping round trips; five times as many 32-byte
+// chat messages then go from one client to another in the same channel.
+// Start the server with high --session-rate and --channel-rate so the
+// rate limits don't cut the chat run short.
+
+const int DEFAULT_ROUND_TRIPS = 20000;
+const int CHAT_MESSAGES_PER_ROUND_TRIP = 5;
+const size_t CHAT_MESSAGE_BYTES = 32;
+const size_t READ_CHUNK = 65536;
+
+std::string serverTarget;  // a port, or a socket path (anything with a '/')
+
+int connectToServer() {
+    if (serverTarget.find('/') != std::string::npos) {
+        sockaddr_un serverAddress{};
+        serverAddress.sun_family = AF_UNIX;
+        strncpy(serverAddress.sun_path, serverTarget.c_str(), sizeof(serverAddress.sun_path) - 1);
+        int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (serverSocket != -1 && connect(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+            close(serverSocket);
+            return -1;
+        }
+        return serverSocket;
+    }
+
+    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == -1) {
+        return -1;
+    }
+    sockaddr_in serverAddress{};
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(std::atoi(serverTarget.c_str()));
+    inet_pton(AF_INET, "127.0.0.1", &serverAddress.sin_addr);
+    if (connect(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        close(serverSocket);
+        return -1;
+    }
+    int noDelay = 1;
+    setsockopt(serverSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    return serverSocket;
+}
+
+bool sendMessage(int socket, const std::string& message) {
+    int messageLength = message.size();
+    std::string frame(sizeof(messageLength) + message.size(), '\0');
+    memcpy(&frame[0], &messageLength, sizeof(messageLength));
+    memcpy(&frame[sizeof(messageLength)], message.data(), message.size());
+    size_t sent = 0;
+    while (sent < frame.size()) {
+        ssize_t count = send(socket, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+        if (count <= 0) {
+            return false;
+        }
+        sent += count;
+    }
+    return true;
+}
+
+// Buffered frame reader; one read() usually brings many frames
+struct FrameReader {
+    explicit FrameReader(int socket) : socket(socket) {}
+
+    int socket;
+    std::string buffer;
+    size_t offset = 0;
+
+    bool next(std::string& message) {
+        while (true) {
+            int messageLength;
+            if (buffer.size() - offset >= sizeof(messageLength)) {
+                memcpy(&messageLength, &buffer[offset], sizeof(messageLength));
+                if (buffer.size() - offset >= sizeof(messageLength) + messageLength) {
+                    message = buffer.substr(offset + sizeof(messageLength), messageLength);
+                    offset += sizeof(messageLength) + messageLength;
+                    if (offset >= READ_CHUNK) {
+                        buffer.erase(0, offset);
+                        offset = 0;
+                    }
+                    return true;
+                }
+            }
+            char chunk[READ_CHUNK];
+            ssize_t count = read(socket, chunk, sizeof(chunk));
+            if (count <= 0) {
+                return false;
+            }
+            buffer.append(chunk, count);
+        }
+    }
+
+    // Skips frames until one contains text
+    bool waitFor(const std::string& text) {
+        std::string message;
+        while (next(message)) {
+            if (message.find(text) != std::string::npos) {
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <port|socket path> [round trips]" << std::endl;
+        return 1;
+    }
+    serverTarget = argv[1];
+    int roundTrips = argc > 2 ? std::max(1, std::atoi(argv[2])) : DEFAULT_ROUND_TRIPS;
+
+    int sender = connectToServer();
+    int reader = connectToServer();
+    if (sender == -1 || reader == -1) {
+        std::cerr << "Could not connect to " << serverTarget << "." << std::endl;
+        return 1;
+    }
+    FrameReader senderFrames{sender};
+    FrameReader readerFrames{reader};
+    std::string message;
+    senderFrames.next(message);  // welcome
+    readerFrames.next(message);
+
+    // Latency: one round trip at a time
+    std::vector<double> latenciesUs;
+    latenciesUs.reserve(roundTrips);
+    for (int i = 0; i < roundTrips; i++) {
+        auto started = std::chrono::steady_clock::now();
+        sendMessage(sender, "/ping");
+        if (!senderFrames.waitFor("pong")) {
+            std::cerr << "The server closed the connection." << std::endl;
+            return 1;
+        }
+        latenciesUs.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count());
+    }
+    std::sort(latenciesUs.begin(), latenciesUs.end());
+    double totalUs = std::accumulate(latenciesUs.begin(), latenciesUs.end(), 0.0);
+    printf("ping-pong: p50 %.1f us, p99 %.1f us, %.0f round trips/s\n", latenciesUs[roundTrips / 2],
+           latenciesUs[(size_t)roundTrips * 99 / 100], roundTrips / (totalUs / 1e6));
+
+    // Throughput: chat from one client to another through a channel
+    sendMessage(sender, "/register benchsender #bench");
+    sendMessage(reader, "/register benchreader #bench");
+    sendMessage(sender, "/ping");
+    sendMessage(reader, "/ping");
+    senderFrames.waitFor("pong");
+    readerFrames.waitFor("pong");
+
+    int chatMessages = roundTrips * CHAT_MESSAGES_PER_ROUND_TRIP;
+    int received = 0;
+    std::thread readerThread([&readerFrames, &received, chatMessages]() {
+        std::string frame;
+        while (received < chatMessages && readerFrames.next(frame)) {
+            if (frame.find("benchsender: ") != std::string::npos) {
+                received++;
+            }
+        }
+    });
+    // The sender's own copies are read and thrown away so its socket never fills
+    std::thread drainThread([&senderFrames]() {
+        std::string frame;
+        while (senderFrames.next(frame)) {
+        }
+    });
+
+    std::string text(CHAT_MESSAGE_BYTES, 'x');
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < chatMessages; i++) {
+        sendMessage(sender, text);
+    }
+    readerThread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    printf("chat one-way: %d of %d messages in %.3f s, %.0f messages/s\n", received, chatMessages, seconds, received / seconds);
+
+    shutdown(sender, SHUT_RDWR);
+    drainThread.join();
+    close(sender);
+    close(reader);
+    return received == chatMessages ? 0 : 1;
+}
@@ -1,8 +1,15 @@
 #include <iostream>
 #include <string>
+#include <map>
 #include <cstring>
+#include <cstdlib>
 #include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <random>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <signal.h>
@@ -13,20 +20,80 @@ bool isMute = false;
 const std::string QUIT_COMMAND = "/quit";
 const std::string PING_COMMAND = "/ping";
 const std::string PONG_MESSAGE = "pong";
+const std::string HEARTBEAT_COMMAND = "/heartbeat";
+const std::string RESUME_COMMAND = "/resume";
+const std::string TOKEN_PREFIX = "/token ";
+const std::string SEQUENCE_PREFIX = "/seq ";
+const std::string MESSAGE_ID_PREFIX = "/id ";
+const std::string ACK_PREFIX = "/ack ";
+const std::string RETRY_PREFIX = "/retry ";  // the server turned the message away for now
+const int ACK_TIMEOUT_MS = 2000;  // chat not acknowledged by then is sent again
+const int MAX_SEND_ATTEMPTS = 5;
+const int RECONNECT_ATTEMPTS = 5;
+const int RECONNECT_DELAY_MS = 500;  // doubled after every failed attempt
 
 const std::string NICKNAME_COMMAND = "/nickname";
 const std::string JOIN_COMMAND = "/join";
+const std::string CONNECT_COMMAND = "/connect";
+const std::string REGISTER_COMMAND = "/register";
+const size_t MAX_NICKNAME_LENGTH = 50;
+
+
+// The receive thread answers heartbeats while the main thread sends input
+std::mutex sendMutex;
+
+// Replaced by the receive thread when it reconnects
+std::atomic<int> currentSocket(-1);
+std::atomic<bool> quitting(false);
+
+// Receive thread only: what /resume needs after a reconnect
+std::string resumeToken;
+uint64_t lastSeq = 0;
+bool haveSeq = false;
+
+int serverPort = 12345;  // another server of a federation can be given on the command line
+std::string serverPath;  // or the server's Unix socket, for a server on this host
+
+int connectToServer() {
+    if (!serverPath.empty()) {
+        sockaddr_un serverAddress{};
+        serverAddress.sun_family = AF_UNIX;
+        strncpy(serverAddress.sun_path, serverPath.c_str(), sizeof(serverAddress.sun_path) - 1);
+        int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (serverSocket != -1 && connect(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+            close(serverSocket);
+            return -1;
+        }
+        return serverSocket;
+    }
+
+    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverSocket == -1) {
+        return -1;
+    }
 
+    // Set up server address
+    sockaddr_in serverAddress;
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(serverPort);
+    inet_pton(AF_INET, "127.0.0.1", &(serverAddress.sin_addr));
+    if (connect(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+        close(serverSocket);
+        return -1;
+    }
+    return serverSocket;
+}
 
 void sendMessage(int socket, const std::string& message) {
+    std::lock_guard<std::mutex> lock(sendMutex);
     int messageLength = message.length();
-    send(socket, &messageLength, sizeof(messageLength), 0);
+    send(socket, &messageLength, sizeof(messageLength), MSG_NOSIGNAL);
 
     int bytesSent = 0;
     while (bytesSent < messageLength) {
         int remainingBytes = messageLength - bytesSent;
         int bytesToSend = std::min(remainingBytes, BUFFER_SIZE);
-        send(socket, message.c_str() + bytesSent, bytesToSend, 0);
+        send(socket, message.c_str() + bytesSent, bytesToSend, MSG_NOSIGNAL);
         bytesSent += bytesToSend;
     }
 }
@@ -55,16 +122,155 @@ std::string receiveMessage(int socket) {
     return message;
 }
 
-void receiveThread(int serverSocket) {
+// Chat sent but not acknowledged yet, by message ID. The server drops
+// repeats of an ID, so sending one again is always safe.
+struct PendingMessage {
+    std::string text;
+    std::chrono::steady_clock::time_point sentAt;
+    int attempts;
+};
+std::mutex pendingMutex;
+std::map<uint64_t, PendingMessage> pendingMessages;
+uint64_t nextMessageId = 1;
+
+void sendChat(const std::string& text) {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    uint64_t id = nextMessageId++;
+    pendingMessages[id] = {text, std::chrono::steady_clock::now(), 1};
+    sendMessage(currentSocket, MESSAGE_ID_PREFIX + std::to_string(id) + " " + text);
+}
+
+// Sends again what wasn't acknowledged in time, or everything after a reconnect
+void resendPending(bool all) {
+    std::lock_guard<std::mutex> lock(pendingMutex);
+    auto now = std::chrono::steady_clock::now();
+    for (auto it = pendingMessages.begin(); it != pendingMessages.end();) {
+        PendingMessage& pending = it->second;
+        if (!all && now - pending.sentAt < std::chrono::milliseconds(ACK_TIMEOUT_MS)) {
+            ++it;
+            continue;
+        }
+        if (pending.attempts == MAX_SEND_ATTEMPTS) {
+            std::cout << "Could not deliver: " << pending.text << std::endl;
+            it = pendingMessages.erase(it);
+            continue;
+        }
+        pending.attempts++;
+        pending.sentAt = now;
+        sendMessage(currentSocket, MESSAGE_ID_PREFIX + std::to_string(it->first) + " " + pending.text);
+        ++it;
+    }
+}
+
+void retryThread() {
+    while (!quitting) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(ACK_TIMEOUT_MS / 4));
+        resendPending(false);
+    }
+}
+
+bool isValidChannelName(const std::string& channelName) {
+    return (channelName.rfind("&", 0) == 0 || channelName.rfind("#", 0) == 0) && channelName.find(' ') == std::string::npos;
+}
+
+// Gets back into the same session after the connection dropped, asking
+// only for the chat after the last sequence number we saw. The random part
+// of the delay keeps clients that lost the server together from all coming
+// back at the same moment.
+bool reconnect() {
+    close(currentSocket);
+    std::minstd_rand random(std::random_device{}());
+    for (int attempt = 0; attempt < RECONNECT_ATTEMPTS && !quitting; attempt++) {
+        int delayMs = (RECONNECT_DELAY_MS << attempt) + random() % RECONNECT_DELAY_MS;
+        std::this_thread::sleep_for(std::chrono::milliseconds(delayMs));
+        int serverSocket = connectToServer();
+        if (serverSocket == -1) {
+            continue;
+        }
+        // Sent before the welcome arrives so the resume costs no extra round trip
+        sendMessage(serverSocket, RESUME_COMMAND + " " + resumeToken + " " + std::to_string(haveSeq ? lastSeq : 0));
+        receiveMessage(serverSocket);  // a new welcome message
+        currentSocket = serverSocket;
+        std::cout << "Reconnected to the server." << std::endl;
+        resendPending(true);
+        return true;
+    }
+    return false;
+}
+
+void receiveThread() {
     while (true) {
-        std::string receivedMessage = receiveMessage(serverSocket);
+        std::string receivedMessage = receiveMessage(currentSocket);
         if (receivedMessage.empty()) {
-            std::cout << "Disconnected from the server." << std::endl;
-            break;
+            if (quitting || resumeToken.empty()) {
+                std::cout << "Disconnected from the server." << std::endl;
+                break;
+            }
+            std::cout << "Lost the connection to the server, reconnecting..." << std::endl;
+            if (!reconnect()) {
+                std::cout << "Disconnected from the server." << std::endl;
+                break;
+            }
+            continue;
+        }
+
+        // Answer the server's keepalive without showing it
+        if (receivedMessage == HEARTBEAT_COMMAND) {
+            sendMessage(currentSocket, HEARTBEAT_COMMAND);
+            continue;
+        }
+
+        if (receivedMessage.rfind(ACK_PREFIX, 0) == 0) {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            pendingMessages.erase(std::stoull(receivedMessage.substr(ACK_PREFIX.size())));
+            continue;
+        }
+
+        // Left pending, so the retry thread sends it again after ACK_TIMEOUT_MS
+        if (receivedMessage.rfind(RETRY_PREFIX, 0) == 0) {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            auto it = pendingMessages.find(std::stoull(receivedMessage.substr(RETRY_PREFIX.size())));
+            if (it != pendingMessages.end()) {
+                it->second.sentAt = std::chrono::steady_clock::now();
+            }
+            continue;
+        }
+
+        // Kept for reconnecting, not shown
+        if (receivedMessage.rfind(TOKEN_PREFIX, 0) == 0) {
+            resumeToken = receivedMessage.substr(TOKEN_PREFIX.size());
+            continue;
+        }
+
+        // Chat carries the channel's sequence number; a jump means we missed some
+        if (receivedMessage.rfind(SEQUENCE_PREFIX, 0) == 0) {
+            size_t end = receivedMessage.find(' ', SEQUENCE_PREFIX.size());
+            uint64_t seq = std::stoull(receivedMessage.substr(SEQUENCE_PREFIX.size(), end - SEQUENCE_PREFIX.size()));
+            if (haveSeq && seq > lastSeq + 1) {
+                std::cout << "(" << seq - lastSeq - 1 << " messages missed, see /history)" << std::endl;
+            }
+            if (!haveSeq || seq > lastSeq) {
+                lastSeq = seq;
+                haveSeq = true;
+            }
+            receivedMessage = end == std::string::npos ? std::string() : receivedMessage.substr(end + 1);
         }
 
         std::cout << receivedMessage << std::endl;
 
+        // Another channel counts from its own numbers
+        if (receivedMessage.rfind("Connected to the channel", 0) == 0 ||
+            (receivedMessage.rfind("Channel ", 0) == 0 && receivedMessage.find(" created") != std::string::npos) ||
+            receivedMessage.find("earlier messages are no longer kept") != std::string::npos) {
+            haveSeq = false;
+        }
+
+        if (receivedMessage.rfind("This session can no longer be resumed", 0) == 0) {
+            resumeToken.clear();
+            haveSeq = false;
+            joinedChannel = false;
+        }
+
         if(receivedMessage.rfind("You were kicked", 0) == 0){
             joinedChannel = false;
         }
@@ -79,34 +285,26 @@ void receiveThread(int serverSocket) {
     }
 }
 
-int main() {
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == -1) {
-        std::cerr << "Failed to create socket." << std::endl;
-        return 1;
-    }
-
-    // Set up server address
-    sockaddr_in serverAddress;
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(12345);  // Use the same port number as the server
-    if (inet_pton(AF_INET, "127.0.0.1", &(serverAddress.sin_addr)) <= 0) {
-        std::cerr << "Invalid address or address not supported." << std::endl;
-        return 1;
+int main(int argc, char* argv[]) {
+    // A port, or a path to the server's Unix socket
+    if (argc > 1 && strchr(argv[1], '/') != nullptr) {
+        serverPath = argv[1];
+    } else if (argc > 1) {
+        serverPort = atoi(argv[1]);
     }
 
     // Connect to the server
-    if (connect(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+    int serverSocket = connectToServer();
+    if (serverSocket == -1) {
         std::cerr << "Connection failed." << std::endl;
         return 1;
     }
+    currentSocket = serverSocket;
 
-    // Receive the welcome message from the server
-    std::string welcomeMessage = receiveMessage(serverSocket);
-    std::cout << welcomeMessage << std::endl;
-
-    // Create receive thread
-    std::thread receiveThreadObj(receiveThread, serverSocket);
+    // Create receive thread; it prints the welcome message, so the user can
+    // type ahead while it is on its way
+    std::thread receiveThreadObj(receiveThread);
+    std::thread retryThreadObj(retryThread);
 
     bool connected = true;
     bool sentConnectCommand = false;
@@ -120,13 +318,37 @@ int main() {
 
         // Check if the user is connected and has sent the connect command
         if (!sentConnectCommand) {
-            if (userInput == "/connect") {
+            // "/connect <nickname> <channel>" registers and joins in one round trip
+            if (userInput.rfind(CONNECT_COMMAND + " ", 0) == 0) {
+                std::string arguments = userInput.substr(CONNECT_COMMAND.size() + 1);
+                size_t space = arguments.rfind(' ');
+                if (space == std::string::npos || space == 0) {
+                    std::cout << "Usage: /connect <nickname> <channel>" << std::endl;
+                    continue;
+                }
+                std::string nickname = arguments.substr(0, space);
+                std::string channelName = arguments.substr(space + 1);
+                if (nickname.length() > MAX_NICKNAME_LENGTH) {
+                    std::cout << "The nickname is too long, maximum of 50 characters." << std::endl;
+                    continue;
+                }
+                if (!isValidChannelName(channelName)) {
+                    std::cout << "Invalid channel name. Start with & or #" << std::endl;
+                    continue;
+                }
+                sentConnectCommand = true;
+                sentNicknameCommand = true;
+                joinedChannel = true;
+                sendMessage(currentSocket, REGISTER_COMMAND + " " + nickname + " " + channelName);
+                continue;
+            }
+            if (userInput == CONNECT_COMMAND) {
                 sentConnectCommand = true;
-                sendMessage(serverSocket, userInput);
+                sendMessage(currentSocket, userInput);
                 std::cout << "Connected to the server. You can now register choosing a nickname with /nickname." << std::endl;
                 continue;
             } else {
-                std::cout << "Please enter the /connect command to establish the connection." << std::endl;
+                std::cout << "Please enter the /connect command to establish the connection, or /connect <nickname> <channel> to join right away." << std::endl;
                 continue;
             }
         }
@@ -137,11 +359,11 @@ int main() {
             if(userInput.rfind(NICKNAME_COMMAND, 0) == 0){
                 std::string newNickname = userInput.substr(10);
                 
-                if(newNickname.length() <= 50)
+                if(newNickname.length() <= MAX_NICKNAME_LENGTH)
                 {
                 sentNicknameCommand = true; 
                 std::cout << "Nickname changed, you can now join a channel with /join" << std::endl;
-                sendMessage(serverSocket, userInput);
+                sendMessage(currentSocket, userInput);
                 continue;
                 }else{
                     std::cout << "The nickname is too long, maximum of 50 characters." << std::endl;
@@ -159,10 +381,10 @@ int main() {
             if(userInput.rfind(JOIN_COMMAND, 0) == 0){
 
                 std::string channelName = userInput.substr(6);
-                if((channelName.rfind("&", 0) == 0 || channelName.rfind("#", 0) == 0) && channelName.rfind(" ") == -1 && channelName.find(","))
+                if(isValidChannelName(channelName))
                 {
                 joinedChannel = true; 
-                sendMessage(serverSocket, userInput);
+                sendMessage(currentSocket, userInput);
                 continue;
                 }else{
                     std::cout << "Invalid channel name. Start with & or #" << std::endl;
@@ -179,28 +401,32 @@ int main() {
         // Check if the user wants to quit
         if (userInput == QUIT_COMMAND) {
             std::cout << "Disconnecting from the server..." << std::endl;
-            sendMessage(serverSocket, userInput);
+            quitting = true;
+            sendMessage(currentSocket, userInput);
             break;
         }
 
         // Check if the user wants to ping the server
         if (userInput == PING_COMMAND) {
             std::cout << "Pinging the server..." << std::endl;
-            sendMessage(serverSocket, userInput);
+            sendMessage(currentSocket, userInput);
             continue;
         }
 
 
 
         // Send the user's message to the server
-        if(joinedChannel && sentNicknameCommand && sentConnectCommand && !isMute) sendMessage(serverSocket, userInput);
+        if(joinedChannel && sentNicknameCommand && sentConnectCommand && !isMute) sendChat(userInput);
     }
 
-    // Close the server socket
-    close(serverSocket);
+    // Close the server socket; shutting it down first wakes the receive thread
+    shutdown(currentSocket, SHUT_RDWR);
 
     // Wait for the receive thread to finish
     receiveThreadObj.join();
+    quitting = true;
+    retryThreadObj.join();
+    close(currentSocket);
 
     return 0;
 }
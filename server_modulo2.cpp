@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <functional>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -15,10 +17,124 @@ const std::string QUIT_COMMAND = "/quit";
 const std::string PING_COMMAND = "/ping";
 const std::string PONG_MESSAGE = "pong";
 
-std::vector<int> connectedClients;
-std::vector<std::string> clientNames;
+struct ConnectedClient {
+    int socket;
+    std::string name;
+};
+
+// Immutable snapshot of the connected clients. Broadcasts iterate a snapshot
+// without locks; connects and disconnects publish a new copy.
+using ClientList = std::vector<ConnectedClient>;
+
+std::atomic<const ClientList*> connectedClients(new ClientList());
+std::mutex connectedClientsWriteMutex;
 std::atomic<bool> exitServer(false);
 
+// Epoch-based reclamation: a reader announces the global epoch while it holds
+// a snapshot, and a replaced snapshot is only freed once the global epoch has
+// moved two steps past the epoch it was retired in.
+struct EpochRecord {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> inUse{false};
+    EpochRecord* next = nullptr;
+};
+
+struct RetiredSnapshot {
+    uint64_t epoch;
+    std::function<void()> release;
+};
+
+std::atomic<uint64_t> globalEpoch(1);
+std::atomic<EpochRecord*> epochRecords(nullptr);
+std::mutex retiredSnapshotsMutex;
+std::vector<RetiredSnapshot> retiredSnapshots;
+
+EpochRecord* acquireEpochRecord() {
+    for (EpochRecord* record = epochRecords.load(); record != nullptr; record = record->next) {
+        bool expected = false;
+        if (!record->inUse.load() && record->inUse.compare_exchange_strong(expected, true)) {
+            return record;
+        }
+    }
+
+    EpochRecord* record = new EpochRecord();
+    record->inUse = true;
+    record->next = epochRecords.load();
+    while (!epochRecords.compare_exchange_weak(record->next, record)) {
+    }
+    return record;
+}
+
+struct ThreadEpochRecord {
+    EpochRecord* record = acquireEpochRecord();
+    ~ThreadEpochRecord() {
+        record->epoch = 0;
+        record->inUse = false;
+    }
+};
+
+EpochRecord* threadEpochRecord() {
+    thread_local ThreadEpochRecord threadRecord;
+    return threadRecord.record;
+}
+
+// Keeps every snapshot loaded while it is alive from being freed.
+class EpochGuard {
+public:
+    EpochGuard() : record(threadEpochRecord()), nested(record->epoch.load() != 0) {
+        if (!nested) {
+            record->epoch = globalEpoch.load();
+        }
+    }
+    ~EpochGuard() {
+        if (!nested) {
+            record->epoch = 0;
+        }
+    }
+
+private:
+    EpochRecord* record;
+    bool nested;
+};
+
+bool tryAdvanceEpoch() {
+    uint64_t epoch = globalEpoch.load();
+    for (EpochRecord* record = epochRecords.load(); record != nullptr; record = record->next) {
+        uint64_t readerEpoch = record->epoch.load();
+        if (readerEpoch != 0 && readerEpoch != epoch) {
+            return false;
+        }
+    }
+    return globalEpoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+template <typename T>
+void retireSnapshot(const T* snapshot) {
+    std::vector<RetiredSnapshot> freed;
+    {
+        std::lock_guard<std::mutex> lock(retiredSnapshotsMutex);
+        retiredSnapshots.push_back({globalEpoch.load(), [snapshot]() { delete snapshot; }});
+        tryAdvanceEpoch();
+
+        uint64_t epoch = globalEpoch.load();
+        auto firstLive = std::partition(retiredSnapshots.begin(), retiredSnapshots.end(),
+                                        [epoch](const RetiredSnapshot& retired) { return retired.epoch + 2 > epoch; });
+        std::move(firstLive, retiredSnapshots.end(), std::back_inserter(freed));
+        retiredSnapshots.erase(firstLive, retiredSnapshots.end());
+    }
+
+    for (RetiredSnapshot& retired : freed) {
+        retired.release();
+    }
+}
+
+// Swaps in a new snapshot; readers still holding the old one keep using it.
+template <typename T>
+void publishSnapshot(std::atomic<const T*>& slot, const T* snapshot) {
+    const T* previous = slot.exchange(snapshot);
+    retireSnapshot(previous);
+}
+
 void sendMessage(int socket, const std::string& message) {
     int messageLength = message.length();
     send(socket, &messageLength, sizeof(messageLength), 0);
@@ -64,9 +180,13 @@ void clientThread(int clientSocket) {
     std::string welcomeMessage = "Welcome to the chat! Your nickname is " + clientName + ".";
     sendMessage(clientSocket, welcomeMessage);
 
-    // Add client to the connected clients vector
-    connectedClients.push_back(clientSocket);
-    clientNames.push_back(clientName);
+    // Add client to the connected clients list
+    {
+        std::lock_guard<std::mutex> lock(connectedClientsWriteMutex);
+        ClientList* clients = new ClientList(*connectedClients.load());
+        clients->push_back({clientSocket, clientName});
+        publishSnapshot<ClientList>(connectedClients, clients);
+    }
 
     bool connected = true;
 
@@ -93,17 +213,21 @@ void clientThread(int clientSocket) {
         std::string fullMessage = clientName + ": " + receivedMessage;
 
         // Send the message to all connected clients
-        for (int i = 0; i < connectedClients.size(); i++) {
-            int destinationSocket = connectedClients[i];
-            sendMessage(destinationSocket, fullMessage);
+        EpochGuard guard;
+        const ClientList* clients = connectedClients.load();
+        for (const ConnectedClient& client : *clients) {
+            sendMessage(client.socket, fullMessage);
         }
     }
 
-    // Remove client from the connected clients vector
-    auto it = std::find(connectedClients.begin(), connectedClients.end(), clientSocket);
-    if (it != connectedClients.end()) {
-        connectedClients.erase(it);
-        clientNames.erase(clientNames.begin() + std::distance(connectedClients.begin(), it));
+    // Remove client from the connected clients list
+    {
+        std::lock_guard<std::mutex> lock(connectedClientsWriteMutex);
+        ClientList* clients = new ClientList(*connectedClients.load());
+        clients->erase(std::remove_if(clients->begin(), clients->end(),
+                                      [clientSocket](const ConnectedClient& client) { return client.socket == clientSocket; }),
+                       clients->end());
+        publishSnapshot<ClientList>(connectedClients, clients);
     }
 
     // Close the client socket
@@ -116,8 +240,8 @@ void signalHandler(int signum) {
         exitServer = true;
 
         // Close all client sockets
-        for (int clientSocket : connectedClients) {
-            close(clientSocket);
+        for (const ConnectedClient& client : *connectedClients.load()) {
+            close(client.socket);
         }
     }
 }
@@ -1,12 +1,46 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cctype>
+#include <cerrno>
 #include <vector>
+#include <deque>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <optional>
+#include <coroutine>
+#include <bit>
+#include <random>
+#include <chrono>
+#include <iomanip>
+#include <sstream>
 #include <algorithm>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <bitset>
+#include <limits>
+#include <filesystem>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <signal.h>
@@ -21,320 +55,7741 @@ const std::string KICK_COMMAND = "/kick";
 const std::string MUTE_COMMAND = "/mute";
 const std::string UNMUTE_COMMAND = "/unmute";
 const std::string WHOIS_COMMAND = "/whois";
+const std::string STATS_COMMAND = "/stats";
+const std::string HEARTBEAT_COMMAND = "/heartbeat";
+const std::string RATE_LIMIT_COMMAND = "/ratelimit";
+const std::string WEIGHT_COMMAND = "/weight";
+const std::string BATCH_COMMAND = "/batch";
+const std::string HISTORY_COMMAND = "/history";
+const std::string SEARCH_COMMAND = "/search";
+const std::string WATCH_COMMAND = "/watch";
+const std::string UNWATCH_COMMAND = "/unwatch";
+const std::string BLOCK_COMMAND = "/block";
+const std::string UNBLOCK_COMMAND = "/unblock";
+const std::string CONNECT_COMMAND = "/connect";
+const std::string RESUME_COMMAND = "/resume";
+const std::string REGISTER_COMMAND = "/register";  // "/register <nickname> <channel>": nickname, token and join at once
+const std::string LEAVE_COMMAND = "/leave";
+const std::string PROXY_COMMAND = "/proxy";  // "/proxy <node>": this connection relays a client of that node
+const std::string TOKEN_PREFIX = "/token ";   // resume token, sent in answer to /connect
+const std::string SEQUENCE_PREFIX = "/seq ";  // starts every chat frame, followed by the channel's sequence number
+const std::string MESSAGE_ID_PREFIX = "/id ";  // optional on client chat: "/id <n> <text>", answered with an ack
+const std::string ACK_PREFIX = "/ack ";
+const std::string RETRY_PREFIX = "/retry ";  // instead of the ack when the message was turned away for now
 
-std::vector<int> connectedClients;
-std::vector<std::string> clientNames;
-std::map<std::string, std::vector<int>> channelsNames;
+const int WORKER_THREADS = 0;  // 0 uses one worker per core
+const size_t FANOUT_CHUNK_SIZE = 32;
+const int SESSION_FRAMES_PER_TURN = 16;  // frames a session handles before letting other tasks run
+const size_t FANOUT_QUANTUM_BYTES = 64 * 1024;       // fanout bytes (frame size x members) per round at weight 1
+const size_t FANOUT_IN_FLIGHT_LIMIT = 1024 * 1024;   // fanout bytes handed out but not yet queued on connections
+const size_t MAX_CHANNEL_FANOUT_BACKLOG = 1024 * 1024;  // frame bytes a channel may have waiting for its turn
+const int MAX_CHANNEL_WEIGHT = 16;
+const int MAX_BATCH_INTERVAL_MS = 1000;
+const size_t DEFAULT_BATCH_BYTES = 16 * 1024;
+const size_t MAX_BATCH_BYTES = 256 * 1024;
+const int STATS_CHANNEL_LINES = 20;
+const size_t MAX_PENDING_PRESENCE = 256;  // distinct join/leave/rename notices queued per client
+const int MAX_FRAME_SIZE = 64 * 1024;
+const size_t READ_BUFFER_LIMIT = 2 * (MAX_FRAME_SIZE + sizeof(int));
+const size_t OUTBOUND_HIGH_WATER = 256 * 1024;    // session stops reading its client above this
+const size_t OUTBOUND_LOW_WATER = 64 * 1024;      // and resumes below this
+const size_t MAX_OUTBOUND_BYTES = 4 * 1024 * 1024;  // consumers further behind are dropped
+const int MAX_IOVECS = 64;
+const size_t HISTORY_FRAMES = MAX_IOVECS;  // chat kept per channel for /join, replayable in one write
+const size_t MAX_CHANNEL_HISTORY_BYTES = 256 * 1024;
+const size_t MAX_HISTORY_BYTES = 64 * 1024 * 1024;  // for all channels together
+const uint64_t LOG_SEGMENT_BYTES = 4 * 1024 * 1024;  // a channel's log rolls over to a new file at this size
+const uint64_t LOG_INDEX_INTERVAL_BYTES = 4096;      // one sparse index entry per this much log
+const int LOG_MAINTENANCE_INTERVAL_MS = 1000;        // retention check while no chat arrives
+const size_t DEFAULT_HISTORY_MESSAGES = 50;          // what /history sends without a count
+const size_t MAX_HISTORY_MESSAGES = 1000;
+const size_t MAX_LOG_PENDING_BYTES = 64 * 1024 * 1024;  // chat waiting for the disk; more is not logged
+const size_t MIN_TERM_LENGTH = 2;   // shorter words are not indexed for /search
+const size_t MAX_TERM_LENGTH = 32;  // and longer ones are cut to this
+const size_t MAX_SEARCH_RESULTS = 20;
+const size_t MAX_WATCHED_WORDS = 32;    // per client
+const size_t MAX_BLOCKED_WORDS = 1000;  // per channel
+const size_t MAILBOX_MEMORY_BYTES = 64 * 1024;  // missed chat kept in memory per disconnected nickname
+const size_t MAILBOX_SPILL_CHUNK_BYTES = 16 * 1024;  // then written to disk in pieces this big
+const uint64_t MAX_MAILBOX_SPILL_BYTES = 16 * 1024 * 1024;
+const int MAILBOX_LIFETIME_MS = 60 * 60 * 1000;
+const size_t MAX_MAILBOXES = 10000;
+const int RESUME_WINDOW_MS = 5 * 60 * 1000;  // how long /resume works after a disconnect
+const size_t MAX_RESUMABLE_SESSIONS = 100000;
+const size_t RESUME_TOKEN_LENGTH = 32;  // hex digits
+const size_t DEDUP_WINDOW = 1024;  // client message IDs remembered per session
+const uint64_t HANDOFF_VERSION = 3;  // layout of the state passed on a hot restart
+const int HANDOFF_FDS_PER_MESSAGE = 250;  // the kernel takes at most 253 per SCM_RIGHTS message
+const int HANDOFF_DRAIN_TIMEOUT_MS = 1000;  // for the workers to go quiet before a handoff
+const int HANDOFF_REPLY_TIMEOUT_MS = 10 * 1000;  // for the new process to confirm it has everything
+const int SOCKET_NOTSENT_LOWAT = 16 * 1024;  // unsent bytes the kernel may hold ahead of a control frame
+const int MAX_EPOLL_EVENTS = 256;
+const int TIMER_TICK_MS = 10;
+const int HEARTBEAT_INTERVAL_MS = 30 * 1000;  // idle time before the server pings the client
+const int HEARTBEAT_TIMEOUT_MS = 30 * 1000;   // time the client has to answer before it is dropped
+const int FRAME_READ_TIMEOUT_MS = 10 * 1000;  // time allowed to finish sending a started frame
+const int RATE_LIMIT_NOTICE_INTERVAL_MS = 1000;  // at most one "too fast" reply per second
+const int WORKER_DELAY_TARGET_MS = 5;         // queueing delay tolerated in the worker pool
+const int WORKER_DELAY_INTERVAL_MS = 100;     // for this long before shedding starts
+const int OUTBOUND_DELAY_TARGET_MS = 50;      // same for a client's outbound queue
+const int OUTBOUND_DELAY_INTERVAL_MS = 500;
+const int ACCEPT_RETRY_MS = 100;              // pause between accepts while overloaded
+const int LINK_BATCH_INTERVAL_MS = TIMER_TICK_MS;  // chat for a peer node is gathered this long
+const size_t LINK_BATCH_BYTES = 32 * 1024;         // or until this much is waiting
+const int LINK_RETRY_MS = 1000;                    // between attempts to reach a peer node
+const int LINK_CONNECT_TIMEOUT_MS = 1000;
+const int RING_VIRTUAL_NODES = 128;                // points per node on the channel placement ring
+const std::string LINK_HELLO = "HELLO";        // "HELLO <node> <client port>", first on every link
+const std::string LINK_INTEREST = "INTEREST";  // "INTEREST <channel> <1|0>": chat for the channel wanted or not
+const std::string LINK_CHAT = "CHAT";          // "CHAT <channel> <nickname> <text>"
+const std::string LINK_DIRECTORY_UPDATE = "DIRUPDATE";  // one change to a node's nickname table
+const std::string LINK_DIRECTORY_DIGEST = "DIGEST";     // the version of every table known
+const std::string LINK_DIRECTORY_TABLE = "DIRTABLE";    // part of a whole table
+const std::string LINK_MODERATE = "MODERATE";           // "MODERATE <command> <nickname> <channel> <seconds>"
+const int DIRECTORY_GOSSIP_INTERVAL_MS = 1000;     // between digests traded with a random peer
+const int DIRECTORY_FORGET_MS = 60 * 1000;         // a node's nicknames are kept this long after its link is lost
+const size_t DIRECTORY_TABLE_PART_BYTES = 32 * 1024;
+const int MAX_WORKER_PROCESSES = 64;               // one bit each in the shared directories
+const size_t SHARED_DIRECTORY_SLOTS = 1 << 16;     // per directory, channels and nicknames
+const size_t SHARED_DIRECTORY_PROBES = 64;         // slots tried for a name before giving up
+const size_t WORKER_RING_BYTES = 256 * 1024;       // per pair of worker processes
+const int WORKER_SUPERVISE_INTERVAL_MS = 50;
+
+// Settings that can be changed with --name=value on the command line
+struct ServerConfig {
+    double sessionMessageRate = 10;   // chat messages per second per client
+    double sessionMessageBurst = 20;
+    double channelMessageRate = 200;  // chat messages per second per channel, all members together
+    double channelMessageBurst = 400;
+    std::string logDirectory;          // durable channel history; empty keeps none
+    double logRetentionMegabytes = 64;  // per channel
+    double logRetentionHours = 24 * 7;
+    std::string takeoverPath;          // Unix socket for hot restarts; empty disables them
+    std::string snapshotPath;          // channel and session state for restarts after a crash; empty keeps none
+    double snapshotIntervalSeconds = 10;
+    int port = 12345;        // for clients
+    std::string nodeName;    // unique among the linked servers; defaults to node-<port>
+    int linkPort = 0;        // for other servers' links; 0 accepts none
+    std::string peers;       // host:port of other servers to link to, separated by commas
+    int workers = 0;         // prefork worker processes; 0 runs a single process
+    std::string unixPath;    // Unix socket for clients on this host; empty accepts none
+};
+
+ServerConfig config;
+
+uint64_t steadyMilliseconds() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Client message IDs seen lately: the highest one and a bitmap of the
+// DEDUP_WINDOW IDs up to it. IDs that fell behind the window count as seen,
+// so a very late retry is dropped rather than sent twice.
+struct DedupWindow {
+    uint64_t highest = 0;
+    std::bitset<DEDUP_WINDOW> seen;
+
+    // True the first time an ID shows up
+    bool firstTime(uint64_t id) {
+        if (id > highest) {
+            if (id - highest >= DEDUP_WINDOW) {
+                seen.reset();
+            } else {
+                for (uint64_t skipped = highest + 1; skipped < id; skipped++) {
+                    seen.reset(skipped % DEDUP_WINDOW);
+                }
+            }
+            highest = id;
+            seen.set(id % DEDUP_WINDOW);
+            return true;
+        }
+        if (highest - id >= DEDUP_WINDOW || seen.test(id % DEDUP_WINDOW)) {
+            return false;
+        }
+        seen.set(id % DEDUP_WINDOW);
+        return true;
+    }
+
+    // Lets the ID through again, for a message that was not handled after all
+    void forget(uint64_t id) {
+        if (id <= highest && highest - id < DEDUP_WINDOW) {
+            seen.reset(id % DEDUP_WINDOW);
+        }
+    }
+};
+
+// Refills at rate tokens per second up to burst; each message takes one
+struct TokenBucket {
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t lastRefillMs;
+
+    TokenBucket(double rate, double burst) : rate(rate), burst(burst), tokens(burst), lastRefillMs(steadyMilliseconds()) {}
+
+    void configure(double newRate, double newBurst) {
+        rate = newRate;
+        burst = newBurst;
+        tokens = std::min(tokens, burst);
+    }
+
+    bool tryTake(uint64_t nowMs) {
+        if (nowMs > lastRefillMs) {
+            tokens = std::min(burst, tokens + (nowMs - lastRefillMs) * rate / 1000.0);
+            lastRefillMs = nowMs;
+        }
+        if (tokens < 1) {
+            return false;
+        }
+        tokens -= 1;
+        return true;
+    }
+};
+
+// CoDel-style detector: a queue counts as overloaded once the delay of what
+// leaves it has stayed above target for a whole interval, and recovers as
+// soon as one item gets through under target.
+struct QueueDelayMonitor {
+    uint64_t firstAboveMs = 0;
+    bool overloaded = false;
+
+    // Returns true when the overloaded state changed
+    bool update(uint64_t delayMs, uint64_t nowMs, int targetMs, int intervalMs) {
+        bool wasOverloaded = overloaded;
+        if (delayMs < (uint64_t)targetMs) {
+            firstAboveMs = 0;
+            overloaded = false;
+        } else if (firstAboveMs == 0) {
+            firstAboveMs = nowMs;
+        } else if (nowMs - firstAboveMs >= (uint64_t)intervalMs) {
+            overloaded = true;
+        }
+        return overloaded != wasOverloaded;
+    }
+};
+
+// What was shed while overloaded
+std::atomic<uint64_t> chatDroppedForLaggingClients(0);
+std::atomic<int> laggingClients(0);
+std::atomic<uint64_t> acceptsDeferred(0);
+std::atomic<uint64_t> joinsRejected(0);
+std::atomic<uint64_t> chatDroppedForBusyChannels(0);
+std::atomic<uint64_t> presenceConflated(0);
+std::atomic<uint64_t> presenceSuppressed(0);
+std::atomic<size_t> historyFramesTotal(0);
+std::atomic<size_t> historyBytesTotal(0);
+std::atomic<uint64_t> mailboxMessagesKept(0);
+std::atomic<uint64_t> mailboxMessagesDelivered(0);
+std::atomic<uint64_t> mailboxMessagesLost(0);
+
+std::atomic<uint64_t> chatMessagesAccepted(0);
+std::atomic<uint64_t> chatRejectedBySession(0);
+std::atomic<uint64_t> chatRejectedByChannel(0);
+std::atomic<uint64_t> chatDuplicatesDropped(0);
+
+// Power-of-two buckets of microseconds; percentiles report the bucket's upper bound
+struct LatencyHistogram {
+    static const int BUCKETS = 32;
+    std::atomic<uint64_t> counts[BUCKETS] = {};
+
+    void record(std::chrono::steady_clock::duration latency) {
+        uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+        counts[std::min<int>(BUCKETS - 1, std::bit_width(micros))]++;
+    }
+
+    uint64_t total() const {
+        uint64_t sum = 0;
+        for (const std::atomic<uint64_t>& count : counts) {
+            sum += count.load();
+        }
+        return sum;
+    }
+
+    double percentileMs(double fraction) const {
+        uint64_t target = std::max<uint64_t>(1, total() * fraction), seen = 0;
+        for (int bucket = 0; bucket < BUCKETS; bucket++) {
+            seen += counts[bucket].load();
+            if (seen >= target) {
+                return (1ull << bucket) / 1000.0;
+            }
+        }
+        return 0;
+    }
+};
+
+// A message encoded once as [length][bytes], shared by every queue it goes to
+using Frame = std::shared_ptr<const std::string>;
+
+// A chat message waiting for its channel's turn in the fanout scheduler
+struct FanoutJob {
+    Frame frame;
+    std::chrono::steady_clock::time_point enqueued;
+    std::string presenceKey;  // set for join/leave/rename notices
+    uint64_t lastSeq = 0;     // highest chat sequence number in the frame
+};
+
+struct ClientSession;
+struct ChannelBatch;
+struct Mailbox;
+
+struct ConnectedClient {
+    std::shared_ptr<ClientSession> session;
+    std::string name;
+};
+
+// Immutable snapshots of the connected clients and of each channel's members.
+// Broadcasts iterate a snapshot without locks; joins, kicks, nickname changes
+// and disconnects build a new copy and publish it.
+using ClientList = std::vector<ConnectedClient>;
+
+struct ChannelRoster {
+    std::vector<std::shared_ptr<ClientSession>> members;
+    std::vector<std::shared_ptr<Mailbox>> mailboxes;  // nicknames that left without leaving the channel
+};
+
+// A message the fanout scheduler handed out, with the members it goes to
+struct FanoutDelivery {
+    std::shared_ptr<const std::vector<std::shared_ptr<ClientSession>>> members;
+    FanoutJob job;
+};
+
+struct Channel {
+    std::string name;
+    std::atomic<const ChannelRoster*> roster{new ChannelRoster()};
+    std::mutex writeMutex;
+
+    std::mutex rateLimitMutex;
+    TokenBucket rateLimit{config.channelMessageRate, config.channelMessageBurst};
+
+    // Deficit round robin state, guarded by the fanout scheduler's mutex
+    std::deque<FanoutJob> fanoutQueue;
+    size_t fanoutQueuedBytes = 0;
+    size_t fanoutDeficit = 0;
+    bool fanoutActive = false;
+    bool fanoutQuantumGranted = false;
+    int fanoutWeight = 1;
+    LatencyHistogram fanoutLatency;  // from queued to handed to the members' connections
+
+    // Messages handed out but not delivered yet, one at a time in order
+    std::mutex deliveryMutex;
+    std::deque<FanoutDelivery> deliveries;
+    bool delivering = false;
+
+    // Created the first time the owner uses /batch
+    std::atomic<ChannelBatch*> batch{nullptr};
+
+    // Recent chat replayed to whoever joins. A ring of shared frames, so
+    // keeping a message costs a pointer rather than a copy. The mutex also
+    // orders chat: numbering, history, log and fanout queue happen under it.
+    std::mutex historyMutex;
+    uint64_t nextSeq = 1;
+    std::vector<Frame> history{HISTORY_FRAMES};
+    std::vector<uint64_t> historySeqs{std::vector<uint64_t>(HISTORY_FRAMES)};
+    size_t historyHead = 0;  // oldest frame
+    size_t historySize = 0;
+    size_t historyBytes = 0;
+};
+
+using ChannelMap = std::map<std::string, Channel*>;
+
+std::atomic<const ClientList*> connectedClients(new ClientList());
+std::mutex connectedClientsWriteMutex;
+std::atomic<const ChannelMap*> channelsNames(new ChannelMap());
+std::mutex channelsNamesWriteMutex;
 std::atomic<bool> exitServer(false);
 
-void sendMessage(int socket, const std::string& message) {
-    int messageLength = message.length();
-    send(socket, &messageLength, sizeof(messageLength), 0);
+// Epoch-based reclamation: a reader announces the global epoch while it holds
+// a snapshot, and a replaced snapshot is only freed once the global epoch has
+// moved two steps past the epoch it was retired in.
+struct EpochRecord {
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<bool> inUse{false};
+    EpochRecord* next = nullptr;
+};
+
+struct RetiredSnapshot {
+    uint64_t epoch;
+    std::function<void()> release;
+};
+
+std::atomic<uint64_t> globalEpoch(1);
+std::atomic<EpochRecord*> epochRecords(nullptr);
+std::mutex retiredSnapshotsMutex;
+std::vector<RetiredSnapshot> retiredSnapshots;
 
-    int bytesSent = 0;
-    while (bytesSent < messageLength) {
-        int remainingBytes = messageLength - bytesSent;
-        int bytesToSend = std::min(remainingBytes, BUFFER_SIZE);
-        send(socket, message.c_str() + bytesSent, bytesToSend, 0);
-        bytesSent += bytesToSend;
+EpochRecord* acquireEpochRecord() {
+    for (EpochRecord* record = epochRecords.load(); record != nullptr; record = record->next) {
+        bool expected = false;
+        if (!record->inUse.load() && record->inUse.compare_exchange_strong(expected, true)) {
+            return record;
+        }
+    }
+
+    EpochRecord* record = new EpochRecord();
+    record->inUse = true;
+    record->next = epochRecords.load();
+    while (!epochRecords.compare_exchange_weak(record->next, record)) {
     }
+    return record;
 }
 
-std::string receiveMessage(int socket) {
-    int messageLength;
-    recv(socket, &messageLength, sizeof(messageLength), 0);
+struct ThreadEpochRecord {
+    EpochRecord* record = acquireEpochRecord();
+    ~ThreadEpochRecord() {
+        record->epoch = 0;
+        record->inUse = false;
+    }
+};
 
-    char buffer[BUFFER_SIZE];
-    std::string message;
+EpochRecord* threadEpochRecord() {
+    thread_local ThreadEpochRecord threadRecord;
+    return threadRecord.record;
+}
 
-    int bytesRead = 0;
-    while (bytesRead < messageLength) {
-        int remainingBytes = messageLength - bytesRead;
-        int bytesToReceive = std::min(remainingBytes, BUFFER_SIZE - 1);
-        int receivedBytes = recv(socket, buffer, bytesToReceive, 0);
-        if (receivedBytes <= 0) {
-            break;
+// Keeps every snapshot loaded while it is alive from being freed.
+class EpochGuard {
+public:
+    EpochGuard() : record(threadEpochRecord()), nested(record->epoch.load() != 0) {
+        if (!nested) {
+            record->epoch = globalEpoch.load();
+        }
+    }
+    ~EpochGuard() {
+        if (!nested) {
+            record->epoch = 0;
+        }
+    }
+
+private:
+    EpochRecord* record;
+    bool nested;
+};
+
+bool tryAdvanceEpoch() {
+    uint64_t epoch = globalEpoch.load();
+    for (EpochRecord* record = epochRecords.load(); record != nullptr; record = record->next) {
+        uint64_t readerEpoch = record->epoch.load();
+        if (readerEpoch != 0 && readerEpoch != epoch) {
+            return false;
+        }
+    }
+    return globalEpoch.compare_exchange_strong(epoch, epoch + 1);
+}
+
+template <typename T>
+void retireSnapshot(const T* snapshot) {
+    std::vector<RetiredSnapshot> freed;
+    {
+        std::lock_guard<std::mutex> lock(retiredSnapshotsMutex);
+        retiredSnapshots.push_back({globalEpoch.load(), [snapshot]() { delete snapshot; }});
+        tryAdvanceEpoch();
+
+        uint64_t epoch = globalEpoch.load();
+        auto firstLive = std::partition(retiredSnapshots.begin(), retiredSnapshots.end(),
+                                        [epoch](const RetiredSnapshot& retired) { return retired.epoch + 2 > epoch; });
+        std::move(firstLive, retiredSnapshots.end(), std::back_inserter(freed));
+        retiredSnapshots.erase(firstLive, retiredSnapshots.end());
+    }
+
+    for (RetiredSnapshot& retired : freed) {
+        retired.release();
+    }
+}
+
+// Swaps in a new snapshot; readers still holding the old one keep using it.
+template <typename T>
+void publishSnapshot(std::atomic<const T*>& slot, const T* snapshot) {
+    const T* previous = slot.exchange(snapshot);
+    retireSnapshot(previous);
+}
+
+
+template <typename Update>
+void updateConnectedClients(Update update) {
+    std::lock_guard<std::mutex> lock(connectedClientsWriteMutex);
+    ClientList* clients = new ClientList(*connectedClients.load());
+    update(*clients);
+    publishSnapshot<ClientList>(connectedClients, clients);
+}
+
+void channelInterestChanged(const std::string& channelName, bool wanted);
+
+template <typename Update>
+void updateRoster(Channel* channel, Update update) {
+    std::lock_guard<std::mutex> lock(channel->writeMutex);
+    const ChannelRoster* previous = channel->roster.load();
+    ChannelRoster* roster = new ChannelRoster(*previous);
+    update(*roster);
+    // Peer nodes only send us chat for channels with members or mailboxes here
+    bool wasWanted = !previous->members.empty() || !previous->mailboxes.empty();
+    bool wanted = !roster->members.empty() || !roster->mailboxes.empty();
+    publishSnapshot<ChannelRoster>(channel->roster, roster);
+    if (wanted != wasWanted) {
+        channelInterestChanged(channel->name, wanted);
+    }
+}
+
+// Channels are never removed, so the pointer stays valid after the guard ends.
+Channel* findChannel(const std::string& channelName) {
+    EpochGuard guard;
+    const ChannelMap* channels = channelsNames.load();
+    auto it = channels->find(channelName);
+    return it == channels->end() ? nullptr : it->second;
+}
+
+// Returns the channel, creating it if needed; created tells which one happened.
+Channel* findOrCreateChannel(const std::string& channelName, bool& created) {
+    created = false;
+    Channel* channel = findChannel(channelName);
+    if (channel != nullptr) {
+        return channel;
+    }
+
+    std::lock_guard<std::mutex> lock(channelsNamesWriteMutex);
+    const ChannelMap* channels = channelsNames.load();
+    auto it = channels->find(channelName);
+    if (it != channels->end()) {
+        return it->second;
+    }
+
+    channel = new Channel();
+    channel->name = channelName;
+    ChannelMap* updated = new ChannelMap(*channels);
+    (*updated)[channelName] = channel;
+    publishSnapshot<ChannelMap>(channelsNames, updated);
+    created = true;
+    return channel;
+}
+
+void removeFromChannel(Channel* channel, const ClientSession* session) {
+    updateRoster(channel, [session](ChannelRoster& roster) {
+        roster.members.erase(std::remove_if(roster.members.begin(), roster.members.end(),
+                                            [session](const std::shared_ptr<ClientSession>& member) { return member.get() == session; }),
+                             roster.members.end());
+    });
+}
+
+bool isChannelMember(Channel* channel, const ClientSession* session) {
+    EpochGuard guard;
+    for (const std::shared_ptr<ClientSession>& member : channel->roster.load()->members) {
+        if (member.get() == session) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Looks up a client by nickname; returns nullptr when nobody is using it.
+std::shared_ptr<ClientSession> findClient(const std::string& name) {
+    EpochGuard guard;
+    for (const ConnectedClient& client : *connectedClients.load()) {
+        if (client.name == name) {
+            return client.session;
+        }
+    }
+    return nullptr;
+}
+
+// Work-stealing executor for client commands and fanout chunks. Each worker
+// owns a deque: it pushes and pops its own work at the back and, when empty,
+// steals from the front of a randomly chosen victim. Work posted from outside
+// the pool is spread round-robin across the deques.
+class WorkStealingPool {
+public:
+    void start(int workerCount) {
+        if (workerCount <= 0) {
+            workerCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        startTime = std::chrono::steady_clock::now();
+        for (int i = 0; i < workerCount; i++) {
+            workers.emplace_back(new Worker());
+        }
+        for (int i = 0; i < workerCount; i++) {
+            workers[i]->thread = std::thread(&WorkStealingPool::workerLoop, this, i);
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            stopping = true;
+        }
+        idleCondition.notify_all();
+        for (std::unique_ptr<Worker>& worker : workers) {
+            worker->thread.join();
+        }
+    }
+
+    void submit(std::function<void()> task) {
+        int index = currentWorker;
+        if (index < 0) {
+            index = nextWorker.fetch_add(1) % workers.size();
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers[index]->mutex);
+            workers[index]->tasks.push_back({std::move(task), steadyMilliseconds()});
+        }
+        pendingTasks.fetch_add(1);
+        if (sleepingWorkers.load() > 0) {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            idleCondition.notify_one();
+        }
+    }
+
+    // Like submit(), but from a worker the task goes behind everything already
+    // queued there instead of running next
+    void yield(std::function<void()> task) {
+        int index = currentWorker;
+        if (index < 0) {
+            submit(std::move(task));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers[index]->mutex);
+            workers[index]->tasks.push_front({std::move(task), steadyMilliseconds()});
+        }
+        pendingTasks.fetch_add(1);
+    }
+
+    // Nothing queued and every worker waiting for work
+    bool idle() {
+        return pendingTasks.load() == 0 && sleepingWorkers.load() == (int)workers.size();
+    }
+
+    // True while any worker's queueing delay is above target (see QueueDelayMonitor)
+    bool overloaded() {
+        return overloadedWorkers.load() > 0;
+    }
+
+    std::string overloadStats() {
+        uint64_t totalMs = overloadTotalMs.load();
+        if (overloaded()) {
+            totalMs += steadyMilliseconds() - overloadStartMs.load();
+        }
+        return std::string(overloaded() ? "shedding now" : "not shedding") + ", " + std::to_string(overloadEpisodes.load()) +
+               " episodes, " + std::to_string(totalMs) + " ms shedding in total";
+    }
+
+    // One line per worker: share of wall time spent running tasks since start,
+    // tasks run and how many of them were stolen from another worker.
+    std::string stats() {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1);
+        for (size_t i = 0; i < workers.size(); i++) {
+            double busy = workers[i]->busyNanoseconds.load() / 1e9;
+            out << "Worker " << i << ": " << (elapsed > 0 ? 100.0 * busy / elapsed : 0.0) << "% busy, "
+                << workers[i]->tasksRun.load() << " tasks, " << workers[i]->tasksStolen.load() << " stolen";
+            if (i + 1 < workers.size()) {
+                out << "\n";
+            }
+        }
+        return out.str();
+    }
+
+private:
+    struct QueuedTask {
+        std::function<void()> run;
+        uint64_t enqueuedMs;
+    };
+
+    struct Worker {
+        std::thread thread;
+        std::mutex mutex;
+        std::deque<QueuedTask> tasks;
+        QueueDelayMonitor queueDelay;  // worker thread only
+        std::atomic<uint64_t> busyNanoseconds{0};
+        std::atomic<uint64_t> tasksRun{0};
+        std::atomic<uint64_t> tasksStolen{0};
+    };
+
+    bool popLocal(int index, QueuedTask& task) {
+        std::lock_guard<std::mutex> lock(workers[index]->mutex);
+        if (workers[index]->tasks.empty()) {
+            return false;
+        }
+        task = std::move(workers[index]->tasks.back());
+        workers[index]->tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int thief, QueuedTask& task, std::minstd_rand& random) {
+        size_t count = workers.size();
+        size_t first = random() % count;
+        for (size_t i = 0; i < count; i++) {
+            size_t victim = (first + i) % count;
+            if ((int)victim == thief) {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+            if (!workers[victim]->tasks.empty()) {
+                task = std::move(workers[victim]->tasks.front());
+                workers[victim]->tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(int index) {
+        currentWorker = index;
+        std::minstd_rand random(index + 1);
+        Worker& worker = *workers[index];
+
+        while (!stopping) {
+            QueuedTask task;
+            bool stolen = false;
+            if (!popLocal(index, task)) {
+                stolen = steal(index, task, random);
+            }
+
+            if (task.run) {
+                pendingTasks.fetch_sub(1);
+                uint64_t nowMs = steadyMilliseconds();
+                trackQueueDelay(worker, nowMs - task.enqueuedMs, nowMs);
+                auto begin = std::chrono::steady_clock::now();
+                task.run();
+                auto spent = std::chrono::steady_clock::now() - begin;
+                worker.busyNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(spent).count();
+                worker.tasksRun++;
+                if (stolen) {
+                    worker.tasksStolen++;
+                }
+                continue;
+            }
+
+            // An idle worker has no queue to speak of
+            trackQueueDelay(worker, 0, steadyMilliseconds());
+
+            std::unique_lock<std::mutex> lock(idleMutex);
+            sleepingWorkers.fetch_add(1);
+            idleCondition.wait(lock, [this]() { return pendingTasks.load() > 0 || stopping; });
+            sleepingWorkers.fetch_sub(1);
+        }
+    }
+
+    void trackQueueDelay(Worker& worker, uint64_t delayMs, uint64_t nowMs) {
+        if (!worker.queueDelay.update(delayMs, nowMs, WORKER_DELAY_TARGET_MS, WORKER_DELAY_INTERVAL_MS)) {
+            return;
+        }
+        if (worker.queueDelay.overloaded) {
+            if (overloadedWorkers.fetch_add(1) == 0) {
+                overloadStartMs = nowMs;
+                overloadEpisodes++;
+                std::cout << "Overloaded: tasks wait " << delayMs << " ms for a worker, shedding low-priority work." << std::endl;
+            }
+        } else if (overloadedWorkers.fetch_sub(1) == 1) {
+            uint64_t durationMs = nowMs - overloadStartMs.load();
+            overloadTotalMs += durationMs;
+            std::cout << "Overload cleared after " << durationMs << " ms." << std::endl;
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<int> overloadedWorkers{0};
+    std::atomic<uint64_t> overloadStartMs{0};
+    std::atomic<uint64_t> overloadEpisodes{0};
+    std::atomic<uint64_t> overloadTotalMs{0};
+    std::atomic<unsigned> nextWorker{0};
+    std::atomic<int> pendingTasks{0};
+    std::atomic<int> sleepingWorkers{0};
+    std::atomic<bool> stopping{false};
+    std::mutex idleMutex;
+    std::condition_variable idleCondition;
+    std::chrono::steady_clock::time_point startTime;
+    static thread_local int currentWorker;
+};
+
+thread_local int WorkStealingPool::currentWorker = -1;
+
+WorkStealingPool workerPool;
+
+// Lazily started coroutine returning a T to whoever co_awaits it. The awaiting
+// coroutine is resumed straight from this one's final suspend point.
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        std::optional<T> value;
+        std::coroutine_handle<> continuation;
+        // Set by whichever of the awaiting caller and the finishing task gets
+        // there first; the second one is responsible for resuming the caller
+        std::atomic<bool> handedOff{false};
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+                promise_type& promise = handle.promise();
+                if (promise.handedOff.exchange(true)) {
+                    promise.continuation.resume();
+                }
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T result) { value = std::move(result); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task&& other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    Task(const Task&) = delete;
+    ~Task() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    // Runs the task right here. If it finishes without suspending, the caller
+    // just carries on; resuming it from the task instead would nest a stack
+    // frame per call, since symmetric transfer is only a tail call when the
+    // compiler optimizes it into one.
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> caller) {
+        handle.promise().continuation = caller;
+        handle.resume();
+        return !handle.promise().handedOff.exchange(true);
+    }
+    T await_resume() { return std::move(*handle.promise().value); }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Fire-and-forget coroutine for a whole client session; frees itself at the end.
+struct SessionTask {
+    struct promise_type {
+        SessionTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+void resumeOnWorkerPool(std::coroutine_handle<> handle) {
+    workerPool.submit([handle]() { handle.resume(); });
+}
+
+// co_await this to continue the current coroutine on a pool worker
+struct ResumeOnWorkerPool {
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) { resumeOnWorkerPool(handle); }
+    void await_resume() {}
+};
+
+// co_await this to let the tasks queued on this worker run first
+struct YieldWorker {
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        workerPool.yield([handle]() { handle.resume(); });
+    }
+    void await_resume() {}
+};
+
+// Anything registered with the reactor: gets the epoll event mask of its fd.
+struct ReactorHandler {
+    virtual ~ReactorHandler() = default;
+    virtual void onEvents(uint32_t events) = 0;
+};
+
+// Single epoll loop that only tracks readiness. It wakes the coroutines and
+// flushes queued writes; all session logic runs on the worker pool. Handlers
+// are added and removed on the reactor thread only, other threads post().
+class Reactor {
+public:
+    bool start() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epollFd < 0 || wakeFd < 0) {
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event) == 0;
+    }
+
+    bool add(int fd, const std::shared_ptr<ReactorHandler>& handler, uint32_t events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.ptr = handler.get();
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            return false;
+        }
+        handlers[fd] = handler;
+        return true;
+    }
+
+    void modify(int fd, ReactorHandler* handler, uint32_t events) {
+        epoll_event event{};
+        event.events = events;
+        event.data.ptr = handler;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event);
+    }
+
+    void remove(int fd) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        handlers.erase(fd);
+    }
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(postedMutex);
+            postedTasks.push_back(std::move(task));
+        }
+        wake();
+    }
+
+    // Async-signal-safe
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    void run() {
+        epoll_event events[MAX_EPOLL_EVENTS];
+        while (!exitServer) {
+            int count = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+            if (count < 0 && errno != EINTR) {
+                std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+                return;
+            }
+            for (int i = 0; i < count; i++) {
+                if (events[i].data.ptr == nullptr) {
+                    uint64_t value;
+                    ssize_t ignored = read(wakeFd, &value, sizeof(value));
+                    (void)ignored;
+                    continue;
+                }
+                static_cast<ReactorHandler*>(events[i].data.ptr)->onEvents(events[i].events);
+            }
+            runPostedTasks();
+        }
+    }
+
+private:
+    void runPostedTasks() {
+        std::deque<std::function<void()>> tasks;
+        {
+            std::lock_guard<std::mutex> lock(postedMutex);
+            tasks.swap(postedTasks);
+        }
+        for (std::function<void()>& task : tasks) {
+            task();
+        }
+    }
+
+    int epollFd = -1;
+    int wakeFd = -1;
+    std::unordered_map<int, std::shared_ptr<ReactorHandler>> handlers;
+    std::mutex postedMutex;
+    std::deque<std::function<void()>> postedTasks;
+};
+
+Reactor reactor;
+
+struct Timer;
+
+// Hierarchical timing wheel: four levels of 64 slots over 10 ms ticks, so
+// timers up to about 46 hours away are linked into a slot in O(1) and only
+// cascade down a level when their slot comes up. Timers are intrusive list
+// nodes embedded in their owner; callbacks run on the reactor thread and
+// must stay short.
+class TimingWheel {
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS;
+    static const int LEVELS = 4;
+
+    TimingWheel();
+    virtual ~TimingWheel() = default;
+
+    // Arms the timer, replacing any earlier schedule of the same timer
+    void schedule(Timer& timer, int delayMs, std::function<void()> callback);
+    void cancel(Timer& timer);
+
+    // Runs every timer due up to now. Due timers wait in the ready list and
+    // are taken off it one at a time, so cancelling or rescheduling one that
+    // hasn't run yet still stops its callback.
+    void advance();
+
+    size_t pendingTimers() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return armedTimers;
+    }
+
+protected:
+    // Overridden by tests that move time along themselves
+    virtual uint64_t ticksSinceStart() {
+        auto elapsed = std::chrono::steady_clock::now() - startTime;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / TIMER_TICK_MS;
+    }
+
+private:
+    void clearList(Timer& head);
+    void append(Timer& head, Timer& timer);
+    void link(Timer& timer);
+    void unlink(Timer& timer);
+    void cascade();
+    void collect(Timer& head);
+
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+    uint64_t currentTick = 0;
+    size_t armedTimers = 0;
+    Timer* slots[LEVELS][SLOTS];
+    Timer* ready;  // due, callback not run yet
+};
+
+struct Timer {
+    Timer* prev = nullptr;
+    Timer* next = nullptr;
+    uint64_t expiryTick = 0;
+    std::function<void()> callback;
+
+    Timer() = default;
+    Timer(const Timer&) = delete;
+    ~Timer();
+};
+
+TimingWheel::TimingWheel() {
+    for (int level = 0; level < LEVELS; level++) {
+        for (int slot = 0; slot < SLOTS; slot++) {
+            slots[level][slot] = new Timer();
+            clearList(*slots[level][slot]);
         }
+    }
+    ready = new Timer();
+    clearList(*ready);
+}
+
+TimingWheel timingWheel;
+
+Timer::~Timer() {
+    timingWheel.cancel(*this);
+}
+
+void TimingWheel::advance() {
+    uint64_t targetTick = ticksSinceStart();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (currentTick < targetTick) {
+        currentTick++;
+        cascade();
+        collect(*slots[0][currentTick & (SLOTS - 1)]);
+    }
+    while (ready->next != ready) {
+        Timer& timer = *ready->next;
+        unlink(timer);
+        armedTimers--;
+        std::function<void()> callback = std::move(timer.callback);
+        timer.callback = nullptr;
+        lock.unlock();
+        callback();
+        lock.lock();
+    }
+}
+
+void TimingWheel::clearList(Timer& head) {
+    head.prev = &head;
+    head.next = &head;
+}
+
+void TimingWheel::link(Timer& timer) {
+    uint64_t delta = timer.expiryTick > currentTick ? timer.expiryTick - currentTick : 1;
+    uint64_t maxDelta = (1ull << (LEVEL_BITS * LEVELS)) - 1;
+    if (delta > maxDelta) {
+        delta = maxDelta;
+    }
+    timer.expiryTick = currentTick + delta;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ull << (LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+    append(*slots[level][(timer.expiryTick >> (LEVEL_BITS * level)) & (SLOTS - 1)], timer);
+}
+
+void TimingWheel::append(Timer& head, Timer& timer) {
+    timer.next = &head;
+    timer.prev = head.prev;
+    head.prev->next = &timer;
+    head.prev = &timer;
+}
+
+void TimingWheel::unlink(Timer& timer) {
+    timer.prev->next = timer.next;
+    timer.next->prev = timer.prev;
+    timer.prev = nullptr;
+    timer.next = nullptr;
+}
+
+// When the low bits of the tick wrap, the matching slot of each higher level
+// is redistributed into the levels below, highest level first. Timers due
+// on this very tick go straight to the ready list.
+void TimingWheel::cascade() {
+    int topLevel = 0;
+    while (topLevel < LEVELS - 1 && (currentTick & ((1ull << (LEVEL_BITS * (topLevel + 1))) - 1)) == 0) {
+        topLevel++;
+    }
+    for (int level = topLevel; level >= 1; level--) {
+        Timer& head = *slots[level][(currentTick >> (LEVEL_BITS * level)) & (SLOTS - 1)];
+        while (head.next != &head) {
+            Timer& timer = *head.next;
+            unlink(timer);
+            if (timer.expiryTick <= currentTick) {
+                append(*ready, timer);
+            } else {
+                link(timer);
+            }
+        }
+    }
+}
+
+void TimingWheel::collect(Timer& head) {
+    while (head.next != &head) {
+        Timer& timer = *head.next;
+        unlink(timer);
+        append(*ready, timer);
+    }
+}
+
+void TimingWheel::schedule(Timer& timer, int delayMs, std::function<void()> callback) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (timer.next != nullptr) {
+        unlink(timer);
+        armedTimers--;
+    }
+    timer.callback = std::move(callback);
+    timer.expiryTick = ticksSinceStart() + (delayMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    link(timer);
+    armedTimers++;
+}
+
+void TimingWheel::cancel(Timer& timer) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (timer.next != nullptr) {
+        unlink(timer);
+        armedTimers--;
+        timer.callback = nullptr;
+    }
+}
+
+// Drives the timing wheel from a periodic timerfd on the reactor
+class TimerTicker : public ReactorHandler {
+public:
+    bool start() {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd < 0) {
+            return false;
+        }
+        itimerspec interval{};
+        interval.it_interval.tv_nsec = TIMER_TICK_MS * 1000000L;
+        interval.it_value = interval.it_interval;
+        return timerfd_settime(timerFd, 0, &interval, nullptr) == 0;
+    }
+
+    void onEvents(uint32_t) override {
+        uint64_t expirations;
+        while (read(timerFd, &expirations, sizeof(expirations)) > 0) {
+        }
+        timingWheel.advance();
+    }
+
+    int timerFd = -1;
+};
+
+// An open log segment, closed once no queue refers to it any more
+struct LogFile {
+    explicit LogFile(int fd) : fd(fd) {}
+    ~LogFile() { ::close(fd); }
+    const int fd;
+};
+
+// Part of a log segment, sent with sendfile() instead of from memory
+struct FileRange {
+    std::shared_ptr<LogFile> file;
+    off_t offset;
+    size_t length;
+};
+
+void appendFrame(std::string& out, const std::string& message) {
+    int messageLength = message.length();
+    out.append(reinterpret_cast<const char*>(&messageLength), sizeof(messageLength));
+    out.append(message);
+}
+
+Frame encodeFrame(const std::string& message) {
+    std::string frame;
+    frame.reserve(sizeof(int) + message.length());
+    appendFrame(frame, message);
+    return std::make_shared<const std::string>(std::move(frame));
+}
+
+// Set while a hot restart hands the sessions over. Session coroutines park
+// instead of reading their next frame, so the state stops changing; they are
+// only resumed if the handoff fails.
+std::atomic<bool> readsPaused(false);
+std::mutex parkedReadersMutex;
+std::vector<std::coroutine_handle<>> parkedReaders;
+
+struct ParkReader {
+    bool await_ready() { return false; }
+    bool await_suspend(std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> lock(parkedReadersMutex);
+        if (!readsPaused) {
+            return false;
+        }
+        parkedReaders.push_back(handle);
+        return true;
+    }
+    void await_resume() {}
+};
+
+void resumeParkedReaders() {
+    std::vector<std::coroutine_handle<>> readers;
+    {
+        std::lock_guard<std::mutex> lock(parkedReadersMutex);
+        readsPaused = false;
+        readers.swap(parkedReaders);
+    }
+    for (std::coroutine_handle<> reader : readers) {
+        resumeOnWorkerPool(reader);
+    }
+}
+
+// Non-blocking client socket. The read side belongs to the session coroutine
+// (co_await read_frame()); the write side is a queue of frames that any thread
+// can append to and that is flushed with one vectored write at a time.
+class Connection : public ReactorHandler, public std::enable_shared_from_this<Connection> {
+public:
+    explicit Connection(int socket) : socket(socket) {}
+
+    struct ReadableAwaiter {
+        Connection& connection;
+
+        bool await_ready() { return connection.fillReadBuffer(); }
+        bool await_suspend(std::coroutine_handle<> handle) {
+            connection.readWaiter = handle.address();
+            // Data that arrived after our last recv() may have found no waiter
+            if (connection.readReady) {
+                void* expected = handle.address();
+                if (connection.readWaiter.compare_exchange_strong(expected, nullptr)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        void await_resume() {}
+    };
+
+    // Suspends while the replies to this client are above the high-water mark.
+    // Chat is bounded separately, so a busy channel doesn't stop us reading.
+    struct WritableAwaiter {
+        Connection& connection;
+
+        bool await_ready() {
+            std::lock_guard<std::mutex> lock(connection.writeMutex);
+            return connection.broken || connection.laneBytes[CONTROL_LANE] <= OUTBOUND_HIGH_WATER;
+        }
+        bool await_suspend(std::coroutine_handle<> handle) {
+            std::lock_guard<std::mutex> lock(connection.writeMutex);
+            if (connection.broken || connection.laneBytes[CONTROL_LANE] <= OUTBOUND_HIGH_WATER) {
+                return false;
+            }
+            connection.writeWaiter = handle;
+            return true;
+        }
+        void await_resume() {}
+    };
+
+    // Next complete frame, or nothing once the peer is gone. A frame that has
+    // started arriving must finish within FRAME_READ_TIMEOUT_MS.
+    Task<std::optional<std::string>> read_frame() {
+        while (true) {
+            if (readsPaused) {
+                co_await ParkReader{};
+                continue;
+            }
+            std::optional<std::string> frame = takeFrame();
+            if (frame || peerClosed) {
+                if (frameDeadlineArmed) {
+                    timingWheel.cancel(frameDeadline);
+                    frameDeadlineArmed = false;
+                }
+                co_return frame;
+            }
+            if (readBuffer.size() > readOffset && !frameDeadlineArmed) {
+                std::weak_ptr<Connection> weakConnection = shared_from_this();
+                timingWheel.schedule(frameDeadline, FRAME_READ_TIMEOUT_MS, [weakConnection]() {
+                    if (std::shared_ptr<Connection> connection = weakConnection.lock()) {
+                        std::cout << "Client " << connection->socket << " took too long to send a message." << std::endl;
+                        connection->shutdown();
+                    }
+                });
+                frameDeadlineArmed = true;
+            }
+            co_await ReadableAwaiter{*this};
+        }
+    }
+
+    WritableAwaiter write(const std::string& message) {
+        send(encodeFrame(message));
+        return WritableAwaiter{*this};
+    }
+
+    WritableAwaiter writable() { return WritableAwaiter{*this}; }
+
+    // Queues a frame without ever blocking; used for replies and fanout.
+    // Replies and notices go to the control lane, which is written ahead of
+    // any queued chat. Chat is dropped instead while this client is lagging
+    // (its chat queue delay has been above target). False once the
+    // connection is broken.
+    bool send(const Frame& frame, bool isChat = false) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (broken) {
+            return false;
+        }
+        std::deque<OutboundFrame>& chat = lanes[CHAT_LANE];
+        if (!chat.empty()) {
+            uint64_t nowMs = steadyMilliseconds();
+            trackQueueDelayLocked(nowMs - chat.front().enqueuedMs, nowMs);
+        }
+        if (isChat && queueDelay.overloaded) {
+            chatDroppedForLaggingClients++;
+            return true;
+        }
+        enqueueLocked(isChat ? CHAT_LANE : CONTROL_LANE, frame);
+        return true;
+    }
+
+    // Queues chat frames together so they go out in as few writes as possible;
+    // used to replay history, which is never shed like live chat. The first
+    // replyCount frames are replies and go to the control lane.
+    void sendAll(const std::vector<Frame>& frames, size_t replyCount = 0) {
+        std::vector<OutboundFrame> items;
+        for (const Frame& frame : frames) {
+            items.push_back({frame, 0, nullptr});
+        }
+        sendAllItems(items, replyCount);
+    }
+
+    // Same for log segment ranges, which go out with sendfile()
+    void sendAll(const std::vector<FileRange>& ranges) {
+        std::vector<OutboundFrame> items;
+        for (const FileRange& range : ranges) {
+            items.push_back({nullptr, 0, std::make_shared<const FileRange>(range)});
+        }
+        sendAllItems(items);
+    }
+
+    // Queues a join/leave/rename notice. While an older notice with the same
+    // key (channel and nickname) is still waiting, it is replaced instead, so
+    // a backlogged client only gets each user's latest state. Past
+    // MAX_PENDING_PRESENCE users it only learns how many changes it missed.
+    void sendPresence(const std::string& key, const Frame& frame) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (broken) {
+            return;
+        }
+        std::deque<OutboundFrame>& presence = lanes[PRESENCE_LANE];
+        auto pending = pendingPresence.find(key);
+        if (pending != pendingPresence.end()) {
+            size_t index = pending->second - presenceHead;
+            if (index > 0 || partialLane != PRESENCE_LANE) {
+                laneBytes[PRESENCE_LANE] += frame->size() - presence[index].size();
+                presence[index].frame = frame;
+                presenceConflated++;
+                return;
+            }
+        }
+        if (pendingPresence.size() >= MAX_PENDING_PRESENCE) {
+            presenceSuppressed++;
+            missedPresence++;
+            return;
+        }
+        pendingPresence[key] = presenceHead + presence.size();
+        presenceKeys.push_back(key);
+        enqueueLocked(PRESENCE_LANE, frame);
+    }
+
+    // Ends the session from outside: the reader sees end of stream
+    void shutdown() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (!closed) {
+            ::shutdown(socket, SHUT_RDWR);
+        }
+    }
+
+    // For a hot restart: input read but not handled yet, and output queued but
+    // not written, in the order it would have gone out. The session must be
+    // parked (see readsPaused).
+    std::string unreadBytes() const {
+        return readBuffer.substr(readOffset);
+    }
+
+    std::string unsentBytes() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        std::string bytes;
+        auto append = [&bytes](const OutboundFrame& item, size_t skip) {
+            if (item.frame) {
+                bytes.append(*item.frame, skip);
+                return;
+            }
+            size_t start = bytes.size();
+            bytes.resize(start + item.range->length - skip);
+            size_t done = 0;
+            while (done < item.range->length - skip) {
+                ssize_t count = pread(item.range->file->fd, bytes.data() + start + done, item.range->length - skip - done,
+                                      item.range->offset + skip + done);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count <= 0) {
+                    break;
+                }
+                done += count;
+            }
+            bytes.resize(start + done);
+        };
+        if (partialLane != NO_LANE) {
+            append(lanes[partialLane].front(), outboundOffset);
+        }
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            for (size_t i = lane == partialLane ? 1 : 0; i < lanes[lane].size(); i++) {
+                append(lanes[lane][i], 0);
+            }
+        }
+        return bytes;
+    }
+
+    // Before the connection is registered: picks up where another process
+    // left off
+    void restore(const std::string& unread, const std::string& unsent) {
+        readBuffer = unread;
+        if (!unsent.empty()) {
+            lanes[CONTROL_LANE].push_back({std::make_shared<const std::string>(unsent), steadyMilliseconds(), nullptr});
+            laneBytes[CONTROL_LANE] += unsent.size();
+        }
+    }
+
+    // The socket belongs to another process now: never write to it or shut
+    // it down again, only close our descriptor
+    void abandon() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        closed = true;
+        broken = true;
+        clearLanesLocked();
+    }
+
+    // Reactor thread only
+    void close() {
+        std::coroutine_handle<> waiter;
+        {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            if (!broken) {
+                flushLocked();  // best effort for the last replies
+            }
+            closed = true;
+            broken = true;
+            clearLanesLocked();
+            if (queueDelay.overloaded) {
+                laggingClients--;
+                queueDelay.overloaded = false;
+            }
+            waiter = writeWaiter;
+            writeWaiter = nullptr;
+        }
+        timingWheel.cancel(frameDeadline);
+        reactor.remove(socket);
+        ::close(socket);
+        if (waiter) {
+            resumeOnWorkerPool(waiter);
+        }
+    }
+
+    void onEvents(uint32_t events) override {
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            readReady = true;
+            void* waiter = readWaiter.exchange(nullptr);
+            if (waiter != nullptr) {
+                resumeOnWorkerPool(std::coroutine_handle<>::from_address(waiter));
+            }
+        }
+        if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+            std::lock_guard<std::mutex> lock(writeMutex);
+            if (!broken) {
+                flushLocked();
+            }
+        }
+    }
+
+    const int socket;
+
+private:
+    // Reads what the socket has; false when nothing new arrived (would block)
+    bool fillReadBuffer() {
+        readReady = false;
+        bool gotData = false;
+        char buffer[BUFFER_SIZE];
+        while (true) {
+            if (readBuffer.size() - readOffset >= READ_BUFFER_LIMIT) {
+                readReady = true;  // left unread; edge-triggered epoll won't tell us again
+                return true;
+            }
+            ssize_t receivedBytes = recv(socket, buffer, sizeof(buffer), 0);
+            if (receivedBytes > 0) {
+                if (readOffset > 0) {
+                    readBuffer.erase(0, readOffset);
+                    readOffset = 0;
+                }
+                readBuffer.append(buffer, receivedBytes);
+                gotData = true;
+                continue;
+            }
+            if (receivedBytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (receivedBytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return gotData;
+            }
+            peerClosed = true;
+            return true;
+        }
+    }
+
+    std::optional<std::string> takeFrame() {
+        int messageLength;
+        size_t available = readBuffer.size() - readOffset;
+        if (available < sizeof(messageLength)) {
+            return std::nullopt;
+        }
+        memcpy(&messageLength, readBuffer.data() + readOffset, sizeof(messageLength));
+        if (messageLength < 0 || messageLength > MAX_FRAME_SIZE) {
+            peerClosed = true;
+            return std::nullopt;
+        }
+        if (available < sizeof(messageLength) + messageLength) {
+            return std::nullopt;
+        }
+
+        std::string message = readBuffer.substr(readOffset + sizeof(messageLength), messageLength);
+        readOffset += sizeof(messageLength) + messageLength;
+        if (readOffset == readBuffer.size()) {
+            readBuffer.clear();
+            readOffset = 0;
+            if (readBuffer.capacity() > BUFFER_SIZE) {
+                readBuffer.shrink_to_fit();
+            }
+        }
+        return message;
+    }
+
+    // Writes the frame in flight first, then control frames, then chat; lanes
+    // only change at frame boundaries so frames are never interleaved.
+    struct OutboundFrame {
+        Frame frame;
+        uint64_t enqueuedMs;
+        std::shared_ptr<const FileRange> range;  // instead of frame for log replay
+
+        size_t size() const { return frame ? frame->size() : range->length; }
+    };
+
+    void sendAllItems(std::vector<OutboundFrame>& items, size_t replyCount = 0) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (broken || items.empty()) {
+            return;
+        }
+        bool idle = true;
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            idle = idle && lanes[lane].empty();
+        }
+        uint64_t nowMs = steadyMilliseconds();
+        for (size_t i = 0; i < items.size(); i++) {
+            OutboundFrame& item = items[i];
+            int lane = i < replyCount ? CONTROL_LANE : CHAT_LANE;
+            item.enqueuedMs = nowMs;
+            laneBytes[lane] += item.size();
+            fileBytes += item.range ? item.range->length : 0;
+            lanes[lane].push_back(std::move(item));
+        }
+        if (idle) {
+            flushLocked();
+        }
+    }
+
+    void enqueueLocked(int lane, const Frame& frame) {
+        lanes[lane].push_back({frame, steadyMilliseconds(), nullptr});
+        laneBytes[lane] += frame->size();
+        size_t queuedBytes = 0, queuedFrames = 0;
+        for (int i = 0; i < LANE_COUNT; i++) {
+            queuedBytes += laneBytes[i];
+            queuedFrames += lanes[i].size();
+        }
+        // Log replay waits in the page cache, not in our memory
+        if (queuedBytes - fileBytes > MAX_OUTBOUND_BYTES) {
+            std::cout << "Dropping client " << socket << ": too far behind." << std::endl;
+            failLocked();
+            return;
+        }
+        // Anything else queued means an earlier flush is waiting for EPOLLOUT
+        if (queuedFrames == 1) {
+            flushLocked();
+        }
+    }
+
+    void flushLocked() {
+        while (!lanes[CONTROL_LANE].empty() || !lanes[PRESENCE_LANE].empty() || !lanes[CHAT_LANE].empty()) {
+            iovec iov[MAX_IOVECS];
+            int iovLane[MAX_IOVECS];
+            int count = 0;
+            // A file range goes out on its own with sendfile(); gathering
+            // stops in front of it so nothing overtakes it
+            const FileRange* fileRange = nullptr;
+            off_t fileOffset = 0;
+            bool stopped = false;
+            auto addFrames = [&](int lane, size_t first, size_t last) {
+                std::deque<OutboundFrame>& frames = lanes[lane];
+                for (size_t i = first; i < std::min(last, frames.size()) && count < MAX_IOVECS && !stopped; ++i) {
+                    size_t skip = i == 0 && partialLane == lane ? outboundOffset : 0;
+                    if (frames[i].range) {
+                        stopped = true;
+                        if (count == 0) {
+                            fileRange = frames[i].range.get();
+                            fileOffset = fileRange->offset + skip;
+                            iov[0].iov_base = nullptr;
+                            iov[0].iov_len = fileRange->length - skip;
+                            iovLane[0] = lane;
+                            count = 1;
+                        }
+                        return;
+                    }
+                    iov[count].iov_base = const_cast<char*>(frames[i].frame->data()) + skip;
+                    iov[count].iov_len = frames[i].frame->size() - skip;
+                    iovLane[count] = lane;
+                    count++;
+                }
+            };
+            size_t start[LANE_COUNT] = {};
+            if (partialLane != NO_LANE) {
+                addFrames(partialLane, 0, 1);
+                start[partialLane] = 1;
+            }
+            for (int lane = 0; lane < LANE_COUNT; lane++) {
+                addFrames(lane, start[lane], SIZE_MAX);
+            }
+
+            ssize_t sentBytes;
+            if (fileRange != nullptr) {
+                sentBytes = sendfile(socket, fileRange->file->fd, &fileOffset, iov[0].iov_len);
+                if (sentBytes == 0) {
+                    // The segment is shorter than it was when queued
+                    failLocked();
+                    return;
+                }
+            } else {
+                msghdr message{};
+                message.msg_iov = iov;
+                message.msg_iovlen = count;
+                sentBytes = sendmsg(socket, &message, MSG_NOSIGNAL);
+            }
+            if (sentBytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                failLocked();
+                return;
+            }
+
+            if (fileRange != nullptr) {
+                fileBytes -= sentBytes;
+            }
+            size_t remaining = sentBytes;
+            uint64_t nowMs = steadyMilliseconds();
+            for (int i = 0; i < count && remaining > 0; ++i) {
+                int lane = iovLane[i];
+                if (remaining < iov[i].iov_len) {
+                    laneBytes[lane] -= remaining;
+                    outboundOffset = (partialLane == lane ? outboundOffset : 0) + remaining;
+                    partialLane = lane;
+                    break;
+                }
+                remaining -= iov[i].iov_len;
+                laneBytes[lane] -= iov[i].iov_len;
+                if (lane == CHAT_LANE) {
+                    trackQueueDelayLocked(nowMs - lanes[lane].front().enqueuedMs, nowMs);
+                }
+                if (lane == PRESENCE_LANE) {
+                    auto pending = pendingPresence.find(presenceKeys.front());
+                    if (pending != pendingPresence.end() && pending->second == presenceHead) {
+                        pendingPresence.erase(pending);
+                    }
+                    presenceKeys.pop_front();
+                    presenceHead++;
+                }
+                lanes[lane].pop_front();
+                if (partialLane == lane) {
+                    partialLane = NO_LANE;
+                    outboundOffset = 0;
+                }
+            }
+        }
+        if (lanes[CHAT_LANE].empty()) {
+            trackQueueDelayLocked(0, steadyMilliseconds());
+        }
+        if (missedPresence > 0 && lanes[PRESENCE_LANE].empty() && !broken) {
+            Frame summary = encodeFrame(std::to_string(missedPresence) + " more people joined, left or changed their nickname.");
+            missedPresence = 0;
+            presenceKeys.push_back(std::string());
+            enqueueLocked(PRESENCE_LANE, summary);
+        }
+
+        if (writeWaiter && laneBytes[CONTROL_LANE] <= OUTBOUND_LOW_WATER) {
+            resumeOnWorkerPool(writeWaiter);
+            writeWaiter = nullptr;
+        }
+    }
+
+    void trackQueueDelayLocked(uint64_t delayMs, uint64_t nowMs) {
+        if (queueDelay.update(delayMs, nowMs, OUTBOUND_DELAY_TARGET_MS, OUTBOUND_DELAY_INTERVAL_MS)) {
+            laggingClients += queueDelay.overloaded ? 1 : -1;
+        }
+    }
+
+    void clearLanesLocked() {
+        for (int lane = 0; lane < LANE_COUNT; ++lane) {
+            lanes[lane].clear();
+            laneBytes[lane] = 0;
+        }
+        partialLane = NO_LANE;
+        outboundOffset = 0;
+        fileBytes = 0;
+        pendingPresence.clear();
+        presenceKeys.clear();
+        missedPresence = 0;
+    }
+
+    void failLocked() {
+        broken = true;
+        clearLanesLocked();
+        ::shutdown(socket, SHUT_RDWR);
+        if (writeWaiter) {
+            resumeOnWorkerPool(writeWaiter);
+            writeWaiter = nullptr;
+        }
+    }
+
+    // Read side, owned by the session coroutine
+    std::string readBuffer;
+    size_t readOffset = 0;
+    bool peerClosed = false;
+    std::atomic<bool> readReady{true};
+    std::atomic<void*> readWaiter{nullptr};
+    Timer frameDeadline;
+    bool frameDeadlineArmed = false;
+
+    // Written in this order, switching only between frames
+    enum { NO_LANE = -1, CONTROL_LANE = 0, PRESENCE_LANE = 1, CHAT_LANE = 2, LANE_COUNT = 3 };
+
+    // Write side
+    std::mutex writeMutex;
+    std::deque<OutboundFrame> lanes[LANE_COUNT];
+    size_t laneBytes[LANE_COUNT] = {};
+    int partialLane = NO_LANE;  // lane whose front frame is partly written
+    size_t outboundOffset = 0;  // bytes of that frame already written
+    size_t fileBytes = 0;       // queued log ranges, counted in laneBytes but not held in memory
+    std::unordered_map<std::string, uint64_t> pendingPresence;  // key -> position in the presence lane
+    std::deque<std::string> presenceKeys;  // key of each frame in the presence lane
+    uint64_t presenceHead = 0;  // position of the presence lane's front frame
+    uint64_t missedPresence = 0;
+    QueueDelayMonitor queueDelay;
+    bool broken = false;
+    bool closed = false;
+    std::coroutine_handle<> writeWaiter;
+};
+
+struct HomeProxy;
+
+struct ClientSession {
+    std::shared_ptr<Connection> connection;
+    std::string clientName;
+    std::string currentChannel;
+    Channel* channel = nullptr;
+    bool isChannelOwner = false;
+    std::atomic<bool> chosenName{false};  // picked with /nickname, so it can get its mailbox back
+    std::vector<std::string> watchedWords;  // guarded by the keyword matcher
+    std::string resumeToken;  // guarded by resumeMutex once issued
+    std::mutex dedupMutex;    // a resuming session copies the window
+    DedupWindow dedup;
+    std::atomic<bool> takenOver{false};  // another connection resumed this session
+
+    // Copy of channel, currentChannel and isChannelOwner for writeSnapshot,
+    // which runs on a pool worker; see publishPlace()
+    std::mutex placeMutex;
+    Channel* placeChannel = nullptr;
+    std::string placeChannelName;
+    bool placeOwner = false;
+
+    // Idle detection: checked lazily when idleTimer fires instead of being
+    // re-armed on every message
+    Timer idleTimer;
+    std::atomic<uint64_t> lastActivityMs{0};
+    std::atomic<bool> awaitingHeartbeat{false};
+
+    // Chat of its channel up to this sequence number was replayed when it
+    // joined; fanout that was still on its way skips it
+    std::atomic<uint64_t> replayedThroughSeq{0};
+    // Highest one fanout handed to the connection. Once the session left
+    // with a mailbox, chat up to it is the connection's and the rest the
+    // mailbox's; fanout then stops sending chat here.
+    std::atomic<uint64_t> deliveredThroughSeq{0};
+    std::atomic<bool> mailboxOpen{false};
+
+    // Server-side mute; muteGeneration lets a stale expiry timer notice that
+    // the mute it belonged to was replaced
+    std::atomic<bool> muted{false};
+    std::atomic<Channel*> mutedChannel{nullptr};  // the mute only holds there
+    std::atomic<uint64_t> muteGeneration{0};
+    std::atomic<uint64_t> muteExpiresMs{0};  // 0 while the mute has no duration
+    Timer muteTimer;
+
+    // Only touched by the session coroutine
+    TokenBucket rateLimit{config.sessionMessageRate, config.sessionMessageBurst};
+    uint64_t lastRateLimitNoticeMs = 0;
+    bool refused = false;  // the message being handled was turned away for now (rate limit, mute, busy server)
+    std::shared_ptr<HomeProxy> proxy;  // set while the session lives on its channel's home node
+    bool relayed = false;  // the client is another node's, which picked this node as the home
+};
+
+void sendMessage(Connection& connection, const std::string& message);
+
+// Called by the session after it changes channel or ownership
+void publishPlace(ClientSession& session) {
+    std::lock_guard<std::mutex> lock(session.placeMutex);
+    session.placeChannel = session.channel;
+    session.placeChannelName = session.currentChannel;
+    session.placeOwner = session.isChannelOwner;
+}
+
+// Defined with the nickname directory
+void directoryPublish(const ClientSession* session, const std::string& nickname, const std::string& channelName);
+void directoryMoved(const ClientSession* session, const std::string& channelName);
+void directoryWithdraw(const ClientSession* session);
+// Defined with the prefork workers
+bool channelOnOtherWorker(const std::string& channelName);
+
+// Pings a client that has been quiet for HEARTBEAT_INTERVAL_MS and drops it
+// if it is still quiet HEARTBEAT_TIMEOUT_MS later.
+void scheduleIdleCheck(const std::shared_ptr<ClientSession>& session, int delayMs) {
+    std::weak_ptr<ClientSession> weakSession = session;
+    timingWheel.schedule(session->idleTimer, delayMs, [weakSession]() {
+        std::shared_ptr<ClientSession> session = weakSession.lock();
+        if (session == nullptr) {
+            return;
+        }
+
+        uint64_t idleMs = steadyMilliseconds() - session->lastActivityMs;
+        if (idleMs < (uint64_t)HEARTBEAT_INTERVAL_MS) {
+            scheduleIdleCheck(session, HEARTBEAT_INTERVAL_MS - idleMs);
+        } else if (!session->awaitingHeartbeat) {
+            session->awaitingHeartbeat = true;
+            sendMessage(*session->connection, HEARTBEAT_COMMAND);
+            scheduleIdleCheck(session, HEARTBEAT_TIMEOUT_MS);
+        } else {
+            std::cout << session->clientName << " stopped responding." << std::endl;
+            session->connection->shutdown();
+        }
+    });
+}
+
+// Mutes or unmutes a user on a channel; a mute with a duration lifts itself
+// when it expires. Unmuting on another channel leaves the mute as it was
+// and returns false.
+bool setMuted(const std::shared_ptr<ClientSession>& user, bool muted, const std::string& channelName, int durationMs) {
+    Channel* channel = findChannel(channelName);
+    if (!muted && user->mutedChannel != channel) {
+        return false;
+    }
+    uint64_t generation = ++user->muteGeneration;
+    user->mutedChannel = muted ? channel : nullptr;
+    user->muted = muted;
+    user->muteExpiresMs = muted && durationMs > 0 ? steadyMilliseconds() + durationMs : 0;
+    if (!muted || durationMs <= 0) {
+        timingWheel.cancel(user->muteTimer);
+        return true;
+    }
+
+    std::weak_ptr<ClientSession> weakUser = user;
+    timingWheel.schedule(user->muteTimer, durationMs, [weakUser, generation, channelName]() {
+        std::shared_ptr<ClientSession> user = weakUser.lock();
+        if (user == nullptr || user->muteGeneration != generation) {
+            return;
+        }
+        user->muted = false;
+        user->mutedChannel = nullptr;
+        sendMessage(*user->connection, "You were unmuted on the channel " + channelName + ", your mute expired.");
+    });
+    return true;
+}
+
+void sendMessage(Connection& connection, const std::string& message) {
+    connection.send(encodeFrame(message));
+}
+
+// Shares fanout between channels with deficit round robin so that a flooding
+// channel can't starve quiet ones. Each message costs its frame size times the
+// channel's member count; every round an active channel may hand out
+// FANOUT_QUANTUM_BYTES times its weight, and no more than
+// FANOUT_IN_FLIGHT_LIMIT bytes are out with the workers at once.
+class FanoutScheduler {
+public:
+    void enqueue(Channel* channel, Frame frame, std::string presenceKey = std::string()) {
+        queue(channel, std::move(frame), std::move(presenceKey));
+        dispatch();
+    }
+
+    // Adds a message to its channel's queue without delivering anything yet.
+    // Presence notices are never dropped here; each client conflates them.
+    void queue(Channel* channel, Frame frame, std::string presenceKey = std::string(), uint64_t lastSeq = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (presenceKey.empty() && channel->fanoutQueuedBytes + frame->size() > MAX_CHANNEL_FANOUT_BACKLOG) {
+            chatDroppedForBusyChannels++;
+            return;
+        }
+        channel->fanoutQueuedBytes += frame->size();
+        channel->fanoutQueue.push_back({std::move(frame), std::chrono::steady_clock::now(), std::move(presenceKey), lastSeq});
+        if (!channel->fanoutActive) {
+            channel->fanoutActive = true;
+            activeChannels.push_back(channel);
+        }
+    }
+
+    // Delivers whatever the round robin allows right now
+    void dispatch() {
+        pump(0);
+    }
+
+    void setWeight(Channel* channel, int weight) {
+        std::lock_guard<std::mutex> lock(mutex);
+        channel->fanoutWeight = weight;
+    }
+
+    std::string stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::to_string(inFlightBytes) + " bytes in flight, " + std::to_string(activeChannels.size()) + " channels waiting, " +
+               std::to_string(chatDroppedForBusyChannels.load()) + " chat messages dropped for busy channels";
+    }
+
+    std::string channelStats(Channel* channel) {
+        size_t queued;
+        int weight;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued = channel->fanoutQueue.size();
+            weight = channel->fanoutWeight;
+        }
+        std::ostringstream out;
+        out << "weight " << weight << ", " << queued << " queued, " << channel->fanoutLatency.total() << " chunks delivered, p50 "
+            << channel->fanoutLatency.percentileMs(0.5) << " ms, p99 " << channel->fanoutLatency.percentileMs(0.99) << " ms";
+        return out.str();
+    }
+
+private:
+    struct Dispatch {
+        Channel* channel;
+        const ChannelRoster* roster;
+        FanoutJob job;
+    };
+
+    // Hands out whatever the round robin allows. Only one thread does this at
+    // a time, so a channel's messages reach deliver() in the order they came.
+    void pump(size_t completedBytes) {
+        EpochGuard guard;  // keeps the rosters picked below alive until delivered
+        std::unique_lock<std::mutex> lock(mutex);
+        inFlightBytes -= completedBytes;
+        if (pumping) {
+            return;
+        }
+        pumping = true;
+        while (true) {
+            std::vector<Dispatch> ready = takeReadyLocked();
+            if (ready.empty()) {
+                pumping = false;
+                return;
+            }
+            lock.unlock();
+            size_t deliveredBytes = 0;
+            for (Dispatch& dispatch : ready) {
+                deliveredBytes += deliver(dispatch);
+            }
+            lock.lock();
+            inFlightBytes -= deliveredBytes;
+        }
+    }
+
+    std::vector<Dispatch> takeReadyLocked() {
+        std::vector<Dispatch> ready;
+        while (inFlightBytes < FANOUT_IN_FLIGHT_LIMIT && !activeChannels.empty()) {
+            Channel* channel = activeChannels.front();
+            if (!channel->fanoutQuantumGranted) {
+                channel->fanoutDeficit += FANOUT_QUANTUM_BYTES * channel->fanoutWeight;
+                channel->fanoutQuantumGranted = true;
+            }
+
+            const ChannelRoster* roster = channel->roster.load();
+            FanoutJob& job = channel->fanoutQueue.front();
+            size_t cost = job.frame->size() * roster->members.size();
+            if (cost > channel->fanoutDeficit) {
+                // Used up its quantum; the deficit carries over to its next turn
+                channel->fanoutQuantumGranted = false;
+                activeChannels.pop_front();
+                activeChannels.push_back(channel);
+                continue;
+            }
+
+            channel->fanoutDeficit -= cost;
+            channel->fanoutQueuedBytes -= job.frame->size();
+            inFlightBytes += cost;
+            ready.push_back({channel, roster, std::move(job)});
+            channel->fanoutQueue.pop_front();
+            if (channel->fanoutQueue.empty()) {
+                channel->fanoutActive = false;
+                channel->fanoutQuantumGranted = false;
+                channel->fanoutDeficit = 0;
+                activeChannels.pop_front();
+            }
+        }
+        return ready;
+    }
+
+    // A channel whose earlier messages are all delivered and that fits in one
+    // chunk is served right here from the roster. Otherwise the message waits
+    // its turn in the channel's deliveries. Returns the bytes delivered here.
+    size_t deliver(const Dispatch& dispatch) {
+        Channel* channel = dispatch.channel;
+        const std::vector<std::shared_ptr<ClientSession>>& members = dispatch.roster->members;
+        bool servedHere;
+        {
+            std::lock_guard<std::mutex> lock(channel->deliveryMutex);
+            // Only pump() starts deliveries, so none can start behind our back
+            servedHere = !channel->delivering && members.size() <= FANOUT_CHUNK_SIZE;
+            if (!servedHere) {
+                channel->deliveries.push_back({std::make_shared<const std::vector<std::shared_ptr<ClientSession>>>(members), dispatch.job});
+                if (channel->delivering) {
+                    return 0;
+                }
+                channel->delivering = true;
+            }
+        }
+        if (servedHere) {
+            return deliverChunk(channel, {nullptr, dispatch.job}, members, 0);
+        }
+        return deliverQueued(channel);
+    }
+
+    // Delivers the channel's waiting messages one after the other. Members
+    // past the first FANOUT_CHUNK_SIZE are split into chunks that other
+    // workers deliver at the same time; whichever chunk finishes last starts
+    // the next message, so every member gets the messages in order. Returns
+    // the bytes delivered by the calling thread.
+    size_t deliverQueued(Channel* channel) {
+        size_t deliveredBytes = 0;
+        while (true) {
+            FanoutDelivery delivery;
+            {
+                std::lock_guard<std::mutex> lock(channel->deliveryMutex);
+                if (channel->deliveries.empty()) {
+                    channel->delivering = false;
+                    return deliveredBytes;
+                }
+                delivery = std::move(channel->deliveries.front());
+                channel->deliveries.pop_front();
+            }
+            const std::vector<std::shared_ptr<ClientSession>>& members = *delivery.members;
+            size_t chunks = std::max<size_t>(1, (members.size() + FANOUT_CHUNK_SIZE - 1) / FANOUT_CHUNK_SIZE);
+            auto remaining = std::make_shared<std::atomic<size_t>>(chunks);
+            for (size_t first = FANOUT_CHUNK_SIZE; first < members.size(); first += FANOUT_CHUNK_SIZE) {
+                workerPool.submit([this, channel, delivery, first, remaining]() {
+                    size_t bytes = deliverChunk(channel, delivery, *delivery.members, first);
+                    if (--*remaining == 0) {
+                        bytes += deliverQueued(channel);
+                    }
+                    pump(bytes);
+                });
+            }
+            deliveredBytes += deliverChunk(channel, delivery, members, 0);
+            if (--*remaining > 0) {
+                return deliveredBytes;
+            }
+        }
+    }
+
+    size_t deliverChunk(Channel* channel, const FanoutDelivery& delivery, const std::vector<std::shared_ptr<ClientSession>>& members,
+                        size_t first) {
+        size_t last = std::min(members.size(), first + FANOUT_CHUNK_SIZE);
+        for (size_t i = first; i < last; i++) {
+            deliverTo(*members[i], delivery.job);
+        }
+        channel->fanoutLatency.record(std::chrono::steady_clock::now() - delivery.job.enqueued);
+        return delivery.job.frame->size() * (last - first);
+    }
+
+    static void deliverTo(ClientSession& member, const FanoutJob& job) {
+        if (job.lastSeq != 0 && job.lastSeq <= member.replayedThroughSeq.load(std::memory_order_relaxed)) {
+            return;
+        }
+        if (job.presenceKey.empty()) {
+            if (!member.mailboxOpen && member.connection->send(job.frame, true) && job.lastSeq != 0) {
+                member.deliveredThroughSeq = job.lastSeq;
+            }
+        } else {
+            member.connection->sendPresence(job.presenceKey, job.frame);
+        }
+    }
+
+    std::mutex mutex;
+    std::deque<Channel*> activeChannels;
+    size_t inFlightBytes = 0;
+    bool pumping = false;
+};
+
+FanoutScheduler fanoutScheduler;
+
+// Batched fanout for busy channels: instead of one write per message and
+// member, messages pile up as encoded frames and go out together every
+// intervalMs or once maxBytes have piled up. Clients need nothing new, the
+// frames keep their own length prefixes.
+struct ChannelBatch {
+    std::mutex mutex;
+    int intervalMs = 0;  // 0 when batching is off
+    size_t maxBytes = DEFAULT_BATCH_BYTES;
+    std::string pending;
+    size_t pendingMessages = 0;
+    uint64_t pendingLastSeq = 0;
+    Timer timer;
+    std::atomic<uint64_t> batchesSent{0};
+    std::atomic<uint64_t> messagesSent{0};
+};
+
+ChannelBatch* channelBatch(Channel* channel) {
+    ChannelBatch* batch = channel->batch.load();
+    if (batch == nullptr) {
+        ChannelBatch* created = new ChannelBatch();
+        if (channel->batch.compare_exchange_strong(batch, created)) {
+            batch = created;
+        } else {
+            delete created;
+        }
+    }
+    return batch;
+}
+
+// Queues the pending messages as a single frame; dispatch() sends it
+void flushBatchLocked(Channel* channel, ChannelBatch& batch) {
+    if (batch.pending.empty()) {
+        return;
+    }
+    timingWheel.cancel(batch.timer);
+    batch.batchesSent++;
+    batch.messagesSent += batch.pendingMessages;
+    fanoutScheduler.queue(channel, std::make_shared<const std::string>(std::move(batch.pending)), std::string(), batch.pendingLastSeq);
+    batch.pending.clear();
+    batch.pendingMessages = 0;
+}
+
+void flushBatch(Channel* channel, ChannelBatch& batch) {
+    {
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        flushBatchLocked(channel, batch);
+    }
+    fanoutScheduler.dispatch();
+}
+
+// Changes the batching of a channel; an interval of 0 turns it off
+void configureBatch(Channel* channel, int intervalMs, size_t maxBytes) {
+    ChannelBatch& batch = *channelBatch(channel);
+    {
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        batch.intervalMs = intervalMs;
+        batch.maxBytes = maxBytes;
+        if (intervalMs == 0 || batch.pending.size() >= maxBytes) {
+            flushBatchLocked(channel, batch);
+        }
+    }
+    fanoutScheduler.dispatch();
+}
+
+// Durable channel history. Chat frames are appended, exactly as they go out
+// on the wire, to numbered segment files per channel. A background thread
+// writes everything queued since its last pass and syncs each touched segment
+// once, so many messages share one fdatasync(). Every few KB the segment's
+// .index file gets a (sequence, offset) pair, which lets /history find where
+// to start without reading the whole segment, and the replay itself is sent
+// from the page cache with sendfile().
+class MessageLog {
+public:
+    bool start(const std::string& directory, uint64_t retentionBytes, uint64_t retentionMs) {
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        if (error) {
+            std::cerr << "Failed to create " << directory << ": " << error.message() << std::endl;
+            return false;
+        }
+        this->directory = directory;
+        this->retentionBytes = retentionBytes;
+        this->retentionMs = retentionMs;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            std::string channelName;
+            if (!entry.is_directory() || !decodeName(entry.path().filename().string(), channelName)) {
+                continue;
+            }
+            if (!recoverChannel(channelName, entry.path().string())) {
+                return false;
+            }
+        }
+        if (error) {
+            std::cerr << "Failed to read " << directory << ": " << error.message() << std::endl;
+            return false;
+        }
+        running = true;
+        writer = std::thread(&MessageLog::writerLoop, this);
+        return true;
+    }
+
+    // Writes out whatever is still queued
+    void stop() {
+        if (!running) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            stopping = true;
+        }
+        pendingCondition.notify_one();
+        writer.join();
+        running = false;
+    }
+
+    bool enabled() const { return running; }
+
+    void append(const std::string& channelName, const Frame& frame) {
+        if (!running) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            if (pendingBytes + frame->size() > MAX_LOG_PENDING_BYTES) {
+                droppedMessages++;
+                return;
+            }
+            pending.push_back({channelName, frame});
+            pendingBytes += frame->size();
+        }
+        pendingCondition.notify_one();
+    }
+
+    // The last count committed messages of the channel, oldest first
+    std::vector<FileRange> tail(const std::string& channelName, size_t count) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::vector<FileRange> ranges;
+        auto found = channels.find(channelName);
+        if (found == channels.end() || found->second->segments.empty()) {
+            return ranges;
+        }
+        std::deque<Segment>& segments = found->second->segments;
+        uint64_t endSeq = segments.back().firstSeq + segments.back().committedMessages;
+        uint64_t startSeq = std::max(endSeq - std::min<uint64_t>(endSeq, count), segments.front().firstSeq);
+        size_t first = segments.size() - 1;
+        while (first > 0 && segments[first].firstSeq > startSeq) {
+            first--;
+        }
+        off_t offset = findOffset(segments[first], startSeq);
+        if (offset < 0) {
+            return ranges;
+        }
+        for (size_t i = first; i < segments.size(); i++) {
+            const Segment& segment = segments[i];
+            off_t from = i == first ? offset : 0;
+            if ((uint64_t)from < segment.committedBytes) {
+                ranges.push_back({segment.file, from, (size_t)(segment.committedBytes - from)});
+            }
+        }
+        return ranges;
+    }
+
+    // Splits text into the lowercase words /search matches on, each once
+    static std::vector<std::string> terms(const char* text, size_t length) {
+        std::vector<std::string> words;
+        std::string word;
+        for (size_t i = 0; i <= length; i++) {
+            unsigned char c = i < length ? text[i] : ' ';
+            if (std::isalnum(c)) {
+                if (word.size() < MAX_TERM_LENGTH) {
+                    word += (char)std::tolower(c);
+                }
+            } else {
+                if (word.size() >= MIN_TERM_LENGTH) {
+                    words.push_back(word);
+                }
+                word.clear();
+            }
+        }
+        std::sort(words.begin(), words.end());
+        words.erase(std::unique(words.begin(), words.end()), words.end());
+        return words;
+    }
+
+    // The channel's latest messages containing every word, oldest first
+    std::vector<Frame> search(const std::string& channelName, const std::vector<std::string>& words, size_t limit) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        std::vector<Frame> results;
+        auto found = channels.find(channelName);
+        if (found == channels.end() || words.empty()) {
+            return results;
+        }
+        std::deque<Segment>& segments = found->second->segments;
+        std::vector<uint64_t> matches, postings, common;
+        for (size_t i = segments.size(); i-- > 0 && results.size() < limit;) {
+            const Segment& segment = segments[i];
+            for (size_t w = 0; w < words.size(); w++) {
+                postings.clear();
+                findPostings(segment, words[w], postings);
+                if (w == 0) {
+                    matches.swap(postings);
+                } else {
+                    common.clear();
+                    std::set_intersection(matches.begin(), matches.end(), postings.begin(), postings.end(), std::back_inserter(common));
+                    matches.swap(common);
+                }
+                if (matches.empty()) {
+                    break;
+                }
+            }
+            // Newest first while collecting, reversed at the end
+            for (size_t m = matches.size(); m-- > 0 && results.size() < limit;) {
+                uint64_t frameBytes;
+                std::string frame;
+                if (matches[m] >= segment.committedBytes ||
+                    !readFrameLength(segment, matches[m], segment.committedBytes, frameBytes)) {
+                    continue;
+                }
+                frame.resize(frameBytes);
+                if (pread(segment.file->fd, frame.data(), frameBytes, matches[m]) == (ssize_t)frameBytes) {
+                    results.push_back(std::make_shared<const std::string>(std::move(frame)));
+                }
+            }
+        }
+        std::reverse(results.begin(), results.end());
+        return results;
+    }
+
+    // Messages ever logged for the channel, including ones retention removed
+    uint64_t messageCount(const std::string& channelName) {
+        std::lock_guard<std::mutex> lock(logMutex);
+        auto found = channels.find(channelName);
+        if (found == channels.end() || found->second->segments.empty()) {
+            return 0;
+        }
+        const Segment& last = found->second->segments.back();
+        return last.firstSeq + last.committedMessages;
+    }
+
+    std::string stats() {
+        size_t channelCount, segmentCount = 0;
+        uint64_t bytes = 0;
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            channelCount = channels.size();
+            for (const auto& [name, log] : channels) {
+                segmentCount += log->segments.size();
+                for (const Segment& segment : log->segments) {
+                    bytes += segment.committedBytes;
+                }
+            }
+        }
+        uint64_t commits = groupCommits.load();
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(1) << channelCount << " channels, " << segmentCount << " segments, " << bytes
+            << " bytes on disk, " << commits << " syncs, "
+            << (commits > 0 ? (double)committedMessagesTotal.load() / commits : 0.0) << " messages per sync, "
+            << droppedMessages.load() << " dropped";
+        return out.str();
+    }
+
+private:
+    struct IndexEntry {
+        uint64_t seq;
+        uint64_t offset;
+    };
+
+    // Offsets of the messages containing a word, as varint deltas
+    struct Postings {
+        std::string deltas;
+        uint64_t lastOffset = 0;
+        uint32_t count = 0;
+    };
+
+    // A sealed segment's search index, mapped read-only from its .terms file:
+    // a header, a table of entries sorted by word, the words, then the
+    // postings in the same encoding as in memory
+    struct TermFileHeader {
+        char magic[8];
+        uint64_t fileBytes;
+        uint64_t termCount;
+    };
+
+    struct TermEntry {
+        uint64_t wordOffset;
+        uint64_t postingsOffset;
+        uint32_t wordLength;
+        uint32_t postingsLength;
+    };
+
+    struct TermFile {
+        TermFile(const char* data, size_t size) : data(data), size(size) {}
+        ~TermFile() { munmap(const_cast<char*>(data), size); }
+
+        const TermFileHeader& header() const { return *reinterpret_cast<const TermFileHeader*>(data); }
+        const TermEntry* entries() const { return reinterpret_cast<const TermEntry*>(data + sizeof(TermFileHeader)); }
+
+        const char* data;
+        size_t size;
+    };
+
+    struct Segment {
+        uint64_t firstSeq = 0;
+        std::string path;  // without the .log/.index extension
+        std::shared_ptr<LogFile> file;
+        std::shared_ptr<LogFile> indexFile;
+        std::unordered_map<std::string, Postings> terms;  // until the segment is sealed
+        std::shared_ptr<const TermFile> termFile;         // after
+        std::vector<IndexEntry> index;
+        uint64_t committedBytes = 0;  // synced, and what /history may send
+        uint64_t committedMessages = 0;
+        uint64_t lastWriteMs = 0;  // wall clock, for retention
+        // Writer thread only
+        uint64_t writtenBytes = 0;
+        uint64_t writtenMessages = 0;
+        uint64_t nextIndexOffset = 0;
+        bool full = false;
+    };
+
+    struct ChannelLog {
+        std::string directory;
+        std::deque<Segment> segments;
+    };
+
+    // What one writer pass appends to a segment
+    struct SegmentWrite {
+        Segment* segment;
+        std::string data;
+        uint64_t offset;
+        uint64_t messages = 0;
+        std::vector<IndexEntry> index;
+        std::vector<uint64_t> frameOffsets;  // within data
+    };
+
+    static const char* termFileMagic() { return "CHTERMS1"; }
+
+    static void appendVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out += (char)(value | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    static void decodePostings(const char* data, size_t size, std::vector<uint64_t>& offsets) {
+        uint64_t offset = 0, value = 0;
+        int shift = 0;
+        for (size_t i = 0; i < size && shift < 64; i++) {
+            value |= (uint64_t)(data[i] & 0x7f) << shift;
+            shift += 7;
+            if ((data[i] & 0x80) == 0) {
+                offset += value;
+                offsets.push_back(offset);
+                value = 0;
+                shift = 0;
+            }
+        }
+    }
+
+    static void addTerms(Segment& segment, uint64_t offset, const char* frame, size_t frameBytes) {
+        // The sequence number is not worth indexing
+        std::string_view message(frame + sizeof(int), frameBytes - sizeof(int));
+        if (message.starts_with(SEQUENCE_PREFIX)) {
+            size_t end = message.find(' ', SEQUENCE_PREFIX.size());
+            message.remove_prefix(end == std::string_view::npos ? message.size() : end + 1);
+        }
+        for (const std::string& word : terms(message.data(), message.size())) {
+            Postings& postings = segment.terms[word];
+            appendVarint(postings.deltas, offset - postings.lastOffset);
+            postings.lastOffset = offset;
+            postings.count++;
+        }
+    }
+
+    static void findPostings(const Segment& segment, const std::string& word, std::vector<uint64_t>& offsets) {
+        if (segment.termFile == nullptr) {
+            auto found = segment.terms.find(word);
+            if (found != segment.terms.end()) {
+                decodePostings(found->second.deltas.data(), found->second.deltas.size(), offsets);
+            }
+            return;
+        }
+        const TermFile& file = *segment.termFile;
+        const TermEntry* entries = file.entries();
+        auto wordOf = [&file](const TermEntry& entry) { return std::string_view(file.data + entry.wordOffset, entry.wordLength); };
+        const TermEntry* end = entries + file.header().termCount;
+        const TermEntry* entry = std::lower_bound(entries, end, word, [&wordOf](const TermEntry& entry, const std::string& word) {
+            return wordOf(entry) < word;
+        });
+        if (entry != end && wordOf(*entry) == word) {
+            decodePostings(file.data + entry->postingsOffset, entry->postingsLength, offsets);
+        }
+    }
+
+    // Maps a .terms file, or nullptr if it is missing or does not add up
+    static std::shared_ptr<const TermFile> mapTermFile(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        struct stat status;
+        void* data = MAP_FAILED;
+        if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(TermFileHeader)) {
+            data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+        auto file = std::make_shared<const TermFile>(static_cast<const char*>(data), status.st_size);
+        const TermFileHeader& header = file->header();
+        if (memcmp(header.magic, termFileMagic(), sizeof(header.magic)) != 0 || header.fileBytes != file->size ||
+            header.termCount > (file->size - sizeof(TermFileHeader)) / sizeof(TermEntry)) {
+            return nullptr;
+        }
+        for (uint64_t i = 0; i < header.termCount; i++) {
+            const TermEntry& entry = file->entries()[i];
+            if (entry.wordOffset + entry.wordLength > file->size || entry.postingsOffset + entry.postingsLength > file->size) {
+                return nullptr;
+            }
+        }
+        return file;
+    }
+
+    // Writes the segment's words to its .terms file and maps it
+    static std::shared_ptr<const TermFile> writeTermFile(const Segment& segment) {
+        std::vector<const std::pair<const std::string, Postings>*> sorted;
+        sorted.reserve(segment.terms.size());
+        size_t wordBytes = 0;
+        for (const auto& term : segment.terms) {
+            sorted.push_back(&term);
+            wordBytes += term.first.size();
+        }
+        std::sort(sorted.begin(), sorted.end(), [](const auto* a, const auto* b) { return a->first < b->first; });
+
+        std::string words, postings;
+        words.reserve(wordBytes);
+        std::vector<TermEntry> entries;
+        entries.reserve(sorted.size());
+        uint64_t wordsStart = sizeof(TermFileHeader) + sorted.size() * sizeof(TermEntry);
+        uint64_t postingsStart = wordsStart + wordBytes;
+        for (const auto* term : sorted) {
+            entries.push_back({wordsStart + words.size(), postingsStart + postings.size(), (uint32_t)term->first.size(),
+                               (uint32_t)term->second.deltas.size()});
+            words += term->first;
+            postings += term->second.deltas;
+        }
+        TermFileHeader header;
+        memcpy(header.magic, termFileMagic(), sizeof(header.magic));
+        header.fileBytes = postingsStart + postings.size();
+        header.termCount = entries.size();
+
+        // Written next to it and renamed, so a crash never leaves half a file
+        std::string path = segment.path + ".terms", temporary = path + ".tmp";
+        int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return nullptr;
+        }
+        iovec parts[4] = {{&header, sizeof(header)},
+                          {entries.data(), entries.size() * sizeof(TermEntry)},
+                          {words.data(), words.size()},
+                          {postings.data(), postings.size()}};
+        bool written = true;
+        off_t offset = 0;
+        for (const iovec& part : parts) {
+            for (size_t done = 0; written && done < part.iov_len;) {
+                ssize_t count = pwrite(fd, static_cast<const char*>(part.iov_base) + done, part.iov_len - done, offset);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                written = count > 0;
+                done += written ? count : 0;
+                offset += written ? count : 0;
+            }
+        }
+        written = written && fdatasync(fd) == 0;
+        close(fd);
+        if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+            unlink(temporary.c_str());
+            return nullptr;
+        }
+        return mapTermFile(path);
+    }
+
+    // Indexes a segment's committed messages from the file itself
+    static bool buildTerms(Segment& segment) {
+        std::string data(segment.committedBytes, '\0');
+        if (pread(segment.file->fd, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+            return false;
+        }
+        for (uint64_t offset = 0; offset + sizeof(int) <= data.size();) {
+            int messageLength;
+            memcpy(&messageLength, data.data() + offset, sizeof(messageLength));
+            if (messageLength < 0 || offset + sizeof(int) + messageLength > data.size()) {
+                break;
+            }
+            addTerms(segment, offset, data.data() + offset, sizeof(int) + messageLength);
+            offset += sizeof(int) + messageLength;
+        }
+        return true;
+    }
+
+    // Replaces full segments' in-memory words with mapped .terms files
+    void sealSegments() {
+        std::vector<Segment*> full;
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            for (auto& [name, log] : channels) {
+                for (Segment& segment : log->segments) {
+                    if (segment.full && segment.termFile == nullptr && !segment.terms.empty()) {
+                        full.push_back(&segment);
+                    }
+                }
+            }
+        }
+        // Only this thread changes segments, so they stay put meanwhile
+        for (Segment* segment : full) {
+            std::shared_ptr<const TermFile> termFile = writeTermFile(*segment);
+            if (termFile == nullptr) {
+                std::cerr << "Failed to write " << segment->path << ".terms" << std::endl;
+                continue;
+            }
+            syncDirectory(segment->path.substr(0, segment->path.rfind('/')));
+            std::lock_guard<std::mutex> lock(logMutex);
+            segment->termFile = termFile;
+            segment->terms.clear();
+        }
+    }
+
+    static uint64_t wallMilliseconds() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Channel names become hex so that any name is a safe directory name
+    static std::string encodeName(const std::string& name) {
+        static const char digits[] = "0123456789abcdef";
+        std::string encoded;
+        for (unsigned char c : name) {
+            encoded += digits[c >> 4];
+            encoded += digits[c & 15];
+        }
+        return encoded;
+    }
+
+    static bool decodeName(const std::string& encoded, std::string& name) {
+        if (encoded.empty() || encoded.size() % 2 != 0 || encoded.find_first_not_of("0123456789abcdef") != std::string::npos) {
+            return false;
+        }
+        name.clear();
+        for (size_t i = 0; i < encoded.size(); i += 2) {
+            name += (char)std::stoi(encoded.substr(i, 2), nullptr, 16);
+        }
+        return true;
+    }
+
+    static std::string segmentPath(const std::string& channelDirectory, uint64_t firstSeq) {
+        char name[21];
+        snprintf(name, sizeof(name), "%020llu", (unsigned long long)firstSeq);
+        return channelDirectory + "/" + name;
+    }
+
+    // Makes a new or removed file name durable
+    static void syncDirectory(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    static std::shared_ptr<LogFile> openFile(const std::string& path, int flags) {
+        int fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return nullptr;
+        }
+        return std::make_shared<LogFile>(fd);
+    }
+
+    // Reads the length of the frame at offset; false at the end of the valid log
+    static bool readFrameLength(const Segment& segment, uint64_t offset, uint64_t limit, uint64_t& frameBytes) {
+        int messageLength;
+        if (offset + sizeof(messageLength) > limit ||
+            pread(segment.file->fd, &messageLength, sizeof(messageLength), offset) != sizeof(messageLength) ||
+            messageLength < 0 || messageLength > MAX_FRAME_SIZE || offset + sizeof(messageLength) + messageLength > limit) {
+            return false;
+        }
+        frameBytes = sizeof(messageLength) + messageLength;
+        return true;
+    }
+
+    // Offset of message seq in the segment: the nearest index entry at or
+    // before it, then frame headers from there
+    static off_t findOffset(const Segment& segment, uint64_t seq) {
+        uint64_t currentSeq = segment.firstSeq, offset = 0;
+        auto after = std::upper_bound(segment.index.begin(), segment.index.end(), seq,
+                                      [](uint64_t value, const IndexEntry& entry) { return value < entry.seq; });
+        if (after != segment.index.begin()) {
+            currentSeq = std::prev(after)->seq;
+            offset = std::prev(after)->offset;
+        }
+        while (currentSeq < seq) {
+            uint64_t frameBytes;
+            if (!readFrameLength(segment, offset, segment.committedBytes, frameBytes)) {
+                return -1;
+            }
+            offset += frameBytes;
+            currentSeq++;
+        }
+        return offset;
+    }
+
+    bool openSegment(ChannelLog& log, uint64_t firstSeq) {
+        Segment segment;
+        segment.firstSeq = firstSeq;
+        segment.path = segmentPath(log.directory, firstSeq);
+        segment.file = openFile(segment.path + ".log", O_RDWR | O_CREAT | O_TRUNC);
+        segment.indexFile = openFile(segment.path + ".index", O_RDWR | O_CREAT | O_TRUNC | O_APPEND);
+        if (!segment.file || !segment.indexFile) {
+            return false;
+        }
+        segment.lastWriteMs = wallMilliseconds();
+        syncDirectory(log.directory);
+        log.segments.push_back(std::move(segment));
+        return true;
+    }
+
+    // Loads a channel's segments, cutting off whatever a crash left half written
+    bool recoverChannel(const std::string& channelName, const std::string& channelDirectory) {
+        auto log = std::make_unique<ChannelLog>();
+        log->directory = channelDirectory;
+        std::vector<uint64_t> firstSeqs;
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(channelDirectory, error)) {
+            std::string name = entry.path().filename().string();
+            if (entry.path().extension() == ".log" && name.size() == 24 && name.find_first_not_of("0123456789") == 20) {
+                firstSeqs.push_back(std::stoull(name.substr(0, 20)));
+            }
+        }
+        std::sort(firstSeqs.begin(), firstSeqs.end());
+        for (size_t i = 0; i < firstSeqs.size(); i++) {
+            Segment segment;
+            segment.firstSeq = firstSeqs[i];
+            segment.path = segmentPath(channelDirectory, firstSeqs[i]);
+            segment.file = openFile(segment.path + ".log", O_RDWR);
+            segment.indexFile = openFile(segment.path + ".index", O_RDWR | O_CREAT | O_APPEND);
+            struct stat status;
+            if (!segment.file || !segment.indexFile || fstat(segment.file->fd, &status) != 0) {
+                return false;
+            }
+            uint64_t size = status.st_size;
+            segment.lastWriteMs = (uint64_t)status.st_mtim.tv_sec * 1000 + status.st_mtim.tv_nsec / 1000000;
+
+            // Index entries are written after their data is synced, so only
+            // an ascending prefix that points into the file can be trusted
+            IndexEntry entry;
+            for (off_t at = 0; pread(segment.indexFile->fd, &entry, sizeof(entry), at) == sizeof(entry); at += sizeof(entry)) {
+                bool ascending = segment.index.empty() ? entry.seq == segment.firstSeq && entry.offset == 0
+                                                       : entry.seq > segment.index.back().seq && entry.offset > segment.index.back().offset;
+                if (!ascending || entry.offset >= size) {
+                    break;
+                }
+                segment.index.push_back(entry);
+            }
+            if (ftruncate(segment.indexFile->fd, segment.index.size() * sizeof(IndexEntry)) != 0) {
+                std::cerr << "Failed to repair " << segment.path << ".index" << std::endl;
+                return false;
+            }
+
+            if (i + 1 < firstSeqs.size()) {
+                segment.committedBytes = size;
+                segment.committedMessages = firstSeqs[i + 1] - firstSeqs[i];
+                segment.full = true;
+            } else {
+                uint64_t seq = segment.firstSeq, offset = 0, frameBytes;
+                if (!segment.index.empty()) {
+                    seq = segment.index.back().seq;
+                    offset = segment.index.back().offset;
+                }
+                while (readFrameLength(segment, offset, size, frameBytes)) {
+                    offset += frameBytes;
+                    seq++;
+                }
+                if (offset < size && ftruncate(segment.file->fd, offset) != 0) {
+                    std::cerr << "Failed to repair " << segment.path << ".log" << std::endl;
+                    return false;
+                }
+                segment.committedBytes = offset;
+                segment.committedMessages = seq - segment.firstSeq;
+            }
+            segment.writtenBytes = segment.committedBytes;
+            segment.writtenMessages = segment.committedMessages;
+            segment.nextIndexOffset = segment.index.empty() ? 0 : segment.index.back().offset + LOG_INDEX_INTERVAL_BYTES;
+            if (segment.full) {
+                segment.termFile = mapTermFile(segment.path + ".terms");
+            }
+            if (segment.termFile == nullptr && !buildTerms(segment)) {
+                std::cerr << "Failed to read " << segment.path << ".log" << std::endl;
+                return false;
+            }
+            log->segments.push_back(std::move(segment));
+        }
+        channels[channelName] = std::move(log);
+        return true;
+    }
+
+    ChannelLog* channelLog(const std::string& channelName) {
+        auto found = channels.find(channelName);
+        if (found != channels.end()) {
+            return found->second.get();
+        }
+        auto log = std::make_unique<ChannelLog>();
+        log->directory = directory + "/" + encodeName(channelName);
+        std::error_code error;
+        if (!std::filesystem::create_directory(log->directory, error) && error) {
+            std::cerr << "Failed to create " << log->directory << ": " << error.message() << std::endl;
+            return nullptr;
+        }
+        syncDirectory(directory);
+        return (channels[channelName] = std::move(log)).get();
+    }
+
+    void writerLoop() {
+        // Segments recovered without a usable .terms file
+        sealSegments();
+        std::vector<std::pair<std::string, Frame>> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(pendingMutex);
+                pendingCondition.wait_for(lock, std::chrono::milliseconds(LOG_MAINTENANCE_INTERVAL_MS),
+                                          [this]() { return stopping || !pending.empty(); });
+                if (stopping && pending.empty()) {
+                    return;
+                }
+                batch.swap(pending);
+                pendingBytes = 0;
+            }
+            if (!batch.empty()) {
+                writeBatch(batch);
+                batch.clear();
+                sealSegments();
+            }
+            enforceRetention();
+        }
+    }
+
+    void writeBatch(const std::vector<std::pair<std::string, Frame>>& batch) {
+        // Lay the messages out over segments, rolling over full ones
+        std::vector<SegmentWrite> writes;
+        std::unordered_map<Segment*, size_t> writeOf;
+        {
+            std::lock_guard<std::mutex> lock(logMutex);
+            for (const auto& [channelName, frame] : batch) {
+                ChannelLog* log = channelLog(channelName);
+                if (log == nullptr) {
+                    droppedMessages++;
+                    continue;
+                }
+                Segment* segment = log->segments.empty() ? nullptr : &log->segments.back();
+                if (segment == nullptr || segment->full || (segment->writtenBytes > 0 && segment->writtenBytes + frame->size() > LOG_SEGMENT_BYTES)) {
+                    uint64_t nextSeq = segment == nullptr ? 0 : segment->firstSeq + segment->writtenMessages;
+                    if (segment != nullptr) {
+                        segment->full = true;
+                    }
+                    if (!openSegment(*log, nextSeq)) {
+                        droppedMessages++;
+                        continue;
+                    }
+                    segment = &log->segments.back();
+                }
+                auto [slot, added] = writeOf.try_emplace(segment, writes.size());
+                if (added) {
+                    writes.push_back({segment, std::string(), segment->writtenBytes, 0, {}, {}});
+                }
+                SegmentWrite& write = writes[slot->second];
+                if (segment->writtenBytes >= segment->nextIndexOffset) {
+                    write.index.push_back({segment->firstSeq + segment->writtenMessages, segment->writtenBytes});
+                    segment->nextIndexOffset = segment->writtenBytes + LOG_INDEX_INTERVAL_BYTES;
+                }
+                write.frameOffsets.push_back(write.data.size());
+                write.data += *frame;
+                write.messages++;
+                segment->writtenBytes += frame->size();
+                segment->writtenMessages++;
+            }
+        }
+
+        // One write and one sync per segment for the whole batch
+        std::vector<bool> written(writes.size());
+        for (size_t i = 0; i < writes.size(); i++) {
+            const SegmentWrite& write = writes[i];
+            int fd = write.segment->file->fd;
+            size_t done = 0;
+            while (done < write.data.size()) {
+                ssize_t count = pwrite(fd, write.data.data() + done, write.data.size() - done, write.offset + done);
+                if (count < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (count <= 0) {
+                    break;
+                }
+                done += count;
+            }
+            written[i] = done == write.data.size() && fdatasync(fd) == 0;
+            if (!written[i]) {
+                std::cerr << "Failed to write " << write.segment->path << ".log: " << strerror(errno) << std::endl;
+                continue;
+            }
+            groupCommits++;
+            committedMessagesTotal += write.messages;
+            // A lost index entry only makes the index sparser, so no sync
+            if (!write.index.empty() &&
+                ::write(write.segment->indexFile->fd, write.index.data(), write.index.size() * sizeof(IndexEntry)) < 0) {
+                std::cerr << "Failed to write " << write.segment->path << ".index" << std::endl;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(logMutex);
+        uint64_t nowMs = wallMilliseconds();
+        for (size_t i = 0; i < writes.size(); i++) {
+            const SegmentWrite& write = writes[i];
+            Segment& segment = *write.segment;
+            if (written[i]) {
+                segment.committedBytes += write.data.size();
+                segment.committedMessages += write.messages;
+                segment.index.insert(segment.index.end(), write.index.begin(), write.index.end());
+                segment.lastWriteMs = nowMs;
+                for (size_t m = 0; m < write.frameOffsets.size(); m++) {
+                    size_t end = m + 1 < write.frameOffsets.size() ? write.frameOffsets[m + 1] : write.data.size();
+                    addTerms(segment, write.offset + write.frameOffsets[m], write.data.data() + write.frameOffsets[m],
+                             end - write.frameOffsets[m]);
+                }
+            } else {
+                // Forget the failed messages and move on to a fresh segment
+                droppedMessages += write.messages;
+                if (ftruncate(segment.file->fd, segment.committedBytes) != 0) {
+                    std::cerr << "Failed to truncate " << segment.path << ".log" << std::endl;
+                }
+                segment.writtenBytes = segment.committedBytes;
+                segment.writtenMessages = segment.committedMessages;
+                segment.full = true;
+            }
+        }
+    }
+
+    // Deletes a channel's oldest segments while it is over the size limit or
+    // they are older than the age limit. The segment being written stays.
+    void enforceRetention() {
+        std::lock_guard<std::mutex> lock(logMutex);
+        uint64_t nowMs = wallMilliseconds();
+        for (auto& [name, log] : channels) {
+            uint64_t bytes = 0;
+            for (const Segment& segment : log->segments) {
+                bytes += segment.committedBytes;
+            }
+            bool removed = false;
+            while (log->segments.size() > 1) {
+                Segment& oldest = log->segments.front();
+                if (bytes <= retentionBytes && oldest.lastWriteMs + retentionMs >= nowMs) {
+                    break;
+                }
+                // Replays still queued keep the open descriptor
+                unlink((oldest.path + ".log").c_str());
+                unlink((oldest.path + ".index").c_str());
+                unlink((oldest.path + ".terms").c_str());
+                bytes -= oldest.committedBytes;
+                log->segments.pop_front();
+                removed = true;
+            }
+            if (removed) {
+                syncDirectory(log->directory);
+            }
+        }
+    }
+
+    std::string directory;
+    uint64_t retentionBytes = 0;
+    uint64_t retentionMs = 0;
+    bool running = false;
+    std::thread writer;
+
+    std::mutex pendingMutex;
+    std::condition_variable pendingCondition;
+    std::vector<std::pair<std::string, Frame>> pending;
+    size_t pendingBytes = 0;
+    bool stopping = false;
+
+    std::mutex logMutex;  // channels and the committed part of their segments
+    std::unordered_map<std::string, std::unique_ptr<ChannelLog>> channels;
+
+    std::atomic<uint64_t> groupCommits{0};
+    std::atomic<uint64_t> committedMessagesTotal{0};
+    std::atomic<uint64_t> droppedMessages{0};
+};
+
+MessageLog messageLog;
+
+void dropOldestHistoryLocked(Channel* channel) {
+    Frame& oldest = channel->history[channel->historyHead];
+    channel->historyBytes -= oldest->size();
+    historyBytesTotal -= oldest->size();
+    historyFramesTotal--;
+    oldest.reset();
+    channel->historyHead = (channel->historyHead + 1) % HISTORY_FRAMES;
+    channel->historySize--;
+}
+
+// Keeps a chat frame for replay, dropping the channel's oldest ones to stay
+// within the ring and the per-channel and global byte limits
+void recordHistoryLocked(Channel* channel, const Frame& frame, uint64_t seq) {
+    while (channel->historySize > 0 &&
+           (channel->historySize == HISTORY_FRAMES || channel->historyBytes + frame->size() > MAX_CHANNEL_HISTORY_BYTES ||
+            historyBytesTotal + frame->size() > MAX_HISTORY_BYTES)) {
+        dropOldestHistoryLocked(channel);
+    }
+    if (frame->size() > MAX_CHANNEL_HISTORY_BYTES || historyBytesTotal + frame->size() > MAX_HISTORY_BYTES) {
+        return;
+    }
+    channel->history[(channel->historyHead + channel->historySize) % HISTORY_FRAMES] = frame;
+    channel->historySeqs[(channel->historyHead + channel->historySize) % HISTORY_FRAMES] = seq;
+    channel->historySize++;
+    channel->historyBytes += frame->size();
+    historyBytesTotal += frame->size();
+    historyFramesTotal++;
+}
+
+// Makes the session a member and queues the channel's history for it first.
+// Chat recorded later is only fanned out after the roster includes it, so
+// nothing falls between the replay and the live messages, and chat the
+// replay already covered is not delivered again. A resuming client
+// only gets what came after afterSeq, with a note if the ring no longer
+// reaches back that far. Replies passed in go out first in the same write,
+// on the control lane so they are never held behind chat.
+void joinChannel(Channel* channel, const std::shared_ptr<ClientSession>& session, uint64_t afterSeq = 0,
+                 std::vector<Frame> replies = {}) {
+    std::lock_guard<std::mutex> lock(channel->historyMutex);
+    size_t replyCount = replies.size();
+    std::vector<Frame> replay = std::move(replies);
+    replay.reserve(replay.size() + channel->historySize + 1);
+    uint64_t oldestSeq = channel->historySize > 0 ? channel->historySeqs[channel->historyHead] : channel->nextSeq;
+    if (afterSeq > 0 && oldestSeq > afterSeq + 1) {
+        replay.push_back(encodeFrame(std::to_string(oldestSeq - afterSeq - 1) + " earlier messages are no longer kept, see /history."));
+    }
+    for (size_t i = 0; i < channel->historySize; i++) {
+        size_t slot = (channel->historyHead + i) % HISTORY_FRAMES;
+        if (channel->historySeqs[slot] > afterSeq) {
+            replay.push_back(channel->history[slot]);
+        }
+    }
+    session->connection->sendAll(replay, replyCount);
+    // Messages numbered before now may still be waiting for fanout, which
+    // reads the roster late: the member skips them, as the replay covered
+    // them. A pending batch is queued first so that none mixes both kinds.
+    if (ChannelBatch* batch = channel->batch.load()) {
+        std::lock_guard<std::mutex> batchLock(batch->mutex);
+        flushBatchLocked(channel, *batch);
+    }
+    session->replayedThroughSeq = channel->nextSeq - 1;
+    session->deliveredThroughSeq = channel->nextSeq - 1;
+    updateRoster(channel, [&session](ChannelRoster& roster) {
+        roster.members.push_back(session);
+    });
+}
+
+// Chat sent to a channel while one of its members is disconnected, kept
+// under their nickname until they come back. The first part stays in
+// memory; past that, frames are appended to an unnamed temporary file that
+// is sent back with sendfile() like the channel log.
+struct Mailbox {
+    std::string nickname;
+    std::string channelName;
+    Channel* channel;
+    Timer expiryTimer;
+    uint64_t expiresAtMs = 0;
+
+    std::mutex mutex;
+    std::vector<Frame> frames;
+    size_t memoryBytes = 0;
+    std::string spillBuffer;  // wire frames not yet written to spillFile
+    uint64_t spillBufferMessages = 0;
+    std::shared_ptr<LogFile> spillFile;
+    uint64_t spilledBytes = 0;
+    uint64_t messages = 0;
+    uint64_t lostMessages = 0;
+    bool closed = false;
+};
+
+std::mutex mailboxesMutex;
+std::unordered_map<std::string, std::shared_ptr<Mailbox>> mailboxes;  // by nickname
+std::atomic<size_t> mailboxCount(0);
+
+void spillMailboxLocked(Mailbox& mailbox) {
+    if (mailbox.spillFile == nullptr) {
+        std::error_code error;
+        std::string directory = std::filesystem::temp_directory_path(error).string();
+        int fd = open(error ? "/tmp" : directory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (fd != -1) {
+            mailbox.spillFile = std::make_shared<LogFile>(fd);
+        }
+    }
+    size_t written = 0;
+    while (mailbox.spillFile != nullptr && written < mailbox.spillBuffer.size()) {
+        ssize_t count = pwrite(mailbox.spillFile->fd, mailbox.spillBuffer.data() + written, mailbox.spillBuffer.size() - written,
+                               mailbox.spilledBytes + written);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            break;
+        }
+        written += count;
+    }
+    if (written == mailbox.spillBuffer.size()) {
+        mailbox.spilledBytes += written;
+    } else {
+        // A torn frame would garble the replay, so the file ends where it did
+        mailbox.lostMessages += mailbox.spillBufferMessages;
+        mailbox.messages -= mailbox.spillBufferMessages;
+        mailboxMessagesLost += mailbox.spillBufferMessages;
+    }
+    mailbox.spillBuffer.clear();
+    mailbox.spillBufferMessages = 0;
+}
+
+void storeInMailbox(Mailbox& mailbox, const Frame& frame) {
+    std::lock_guard<std::mutex> lock(mailbox.mutex);
+    if (mailbox.closed) {
+        return;
+    }
+    bool spilling = mailbox.spilledBytes > 0 || !mailbox.spillBuffer.empty();
+    if (!spilling && mailbox.memoryBytes + frame->size() <= MAILBOX_MEMORY_BYTES) {
+        mailbox.frames.push_back(frame);
+        mailbox.memoryBytes += frame->size();
+    } else if (mailbox.spilledBytes + mailbox.spillBuffer.size() + frame->size() <= MAX_MAILBOX_SPILL_BYTES) {
+        mailbox.spillBuffer.append(*frame);
+        mailbox.spillBufferMessages++;
+        if (mailbox.spillBuffer.size() >= MAILBOX_SPILL_CHUNK_BYTES) {
+            spillMailboxLocked(mailbox);
+        }
+    } else {
+        mailbox.lostMessages++;
+        mailboxMessagesLost++;
+        return;
+    }
+    mailbox.messages++;
+    mailboxMessagesKept++;
+}
+
+// Takes the mailbox out of the registry and its channel; false if it was
+// already gone
+bool detachMailbox(const std::shared_ptr<Mailbox>& mailbox) {
+    {
+        std::lock_guard<std::mutex> lock(mailboxesMutex);
+        auto found = mailboxes.find(mailbox->nickname);
+        if (found == mailboxes.end() || found->second != mailbox) {
+            return false;
+        }
+        mailboxes.erase(found);
+        mailboxCount--;
+    }
+    updateRoster(mailbox->channel, [&mailbox](ChannelRoster& roster) {
+        roster.mailboxes.erase(std::remove(roster.mailboxes.begin(), roster.mailboxes.end(), mailbox), roster.mailboxes.end());
+    });
+    timingWheel.cancel(mailbox->expiryTimer);
+    std::lock_guard<std::mutex> lock(mailbox->mutex);
+    mailbox->closed = true;
+    return true;
+}
+
+void scheduleMailboxExpiry(const std::shared_ptr<Mailbox>& mailbox, int delayMs);
+
+// Starts collecting the channel's chat for a member who just disconnected.
+// Fanout reads the roster after chat is numbered, so chat numbered before
+// the mailbox was registered, that had not reached the member's connection
+// yet, is copied in from the channel's history.
+void openMailbox(const std::shared_ptr<ClientSession>& session) {
+    auto mailbox = std::make_shared<Mailbox>();
+    mailbox->nickname = session->clientName;
+    mailbox->channelName = session->currentChannel;
+    mailbox->channel = session->channel;
+    std::shared_ptr<Mailbox> replaced;
+    {
+        std::lock_guard<std::mutex> lock(mailboxesMutex);
+        auto found = mailboxes.find(mailbox->nickname);
+        if (found != mailboxes.end()) {
+            replaced = found->second;
+        } else if (mailboxes.size() >= MAX_MAILBOXES) {
+            return;
+        }
+    }
+    if (replaced != nullptr) {
+        detachMailbox(replaced);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mailboxesMutex);
+        if (!mailboxes.try_emplace(mailbox->nickname, mailbox).second) {
+            return;
+        }
+        mailboxCount++;
+    }
+    Channel* channel = mailbox->channel;
+    {
+        std::lock_guard<std::mutex> historyLock(channel->historyMutex);
+        session->mailboxOpen = true;
+        uint64_t deliveredSeq = session->deliveredThroughSeq;
+        uint64_t oldestSeq = channel->historySize > 0 ? channel->historySeqs[channel->historyHead] : channel->nextSeq;
+        if (oldestSeq > deliveredSeq + 1) {
+            std::lock_guard<std::mutex> lock(mailbox->mutex);
+            mailbox->lostMessages += oldestSeq - deliveredSeq - 1;
+            mailboxMessagesLost += oldestSeq - deliveredSeq - 1;
+        }
+        for (size_t i = 0; i < channel->historySize; i++) {
+            size_t slot = (channel->historyHead + i) % HISTORY_FRAMES;
+            if (channel->historySeqs[slot] > deliveredSeq) {
+                storeInMailbox(*mailbox, channel->history[slot]);
+            }
+        }
+        updateRoster(channel, [&mailbox](ChannelRoster& roster) {
+            roster.mailboxes.push_back(mailbox);
+        });
+    }
+    scheduleMailboxExpiry(mailbox, MAILBOX_LIFETIME_MS);
+}
+
+void scheduleMailboxExpiry(const std::shared_ptr<Mailbox>& mailbox, int delayMs) {
+    mailbox->expiresAtMs = steadyMilliseconds() + delayMs;
+    std::weak_ptr<Mailbox> weakMailbox = mailbox;
+    timingWheel.schedule(mailbox->expiryTimer, delayMs, [weakMailbox]() {
+        // The timer runs on the reactor thread, roster updates belong on a worker
+        workerPool.submit([weakMailbox]() {
+            if (std::shared_ptr<Mailbox> mailbox = weakMailbox.lock()) {
+                detachMailbox(mailbox);
+            }
+        });
+    });
+}
+
+// Sends everything kept for the session's nickname, if anything
+void deliverMailbox(const std::shared_ptr<ClientSession>& session) {
+    if (mailboxCount == 0) {
+        return;
+    }
+    std::shared_ptr<Mailbox> mailbox;
+    {
+        std::lock_guard<std::mutex> lock(mailboxesMutex);
+        auto found = mailboxes.find(session->clientName);
+        if (found == mailboxes.end()) {
+            return;
+        }
+        mailbox = found->second;
+    }
+    if (!detachMailbox(mailbox)) {
+        return;
+    }
+
+    // Closed now, so nothing else touches it
+    if (!mailbox->spillBuffer.empty()) {
+        spillMailboxLocked(*mailbox);
+    }
+    if (mailbox->messages == 0 && mailbox->lostMessages == 0) {
+        return;
+    }
+    std::string notice = "While you were away, " + std::to_string(mailbox->messages) + " messages were sent in " + mailbox->channelName;
+    if (mailbox->lostMessages > 0) {
+        notice += " (" + std::to_string(mailbox->lostMessages) + " more could not be kept)";
+    }
+    Connection& connection = *session->connection;
+    sendMessage(connection, notice + ":");
+    connection.sendAll(mailbox->frames);
+    if (mailbox->spilledBytes > 0) {
+        connection.sendAll(std::vector<FileRange>{{mailbox->spillFile, 0, (size_t)mailbox->spilledBytes}});
+    }
+    mailboxMessagesDelivered += mailbox->messages;
+}
+
+// Throws away what was kept for a nickname
+void dropMailbox(const std::string& nickname) {
+    if (mailboxCount == 0) {
+        return;
+    }
+    std::shared_ptr<Mailbox> mailbox;
+    {
+        std::lock_guard<std::mutex> lock(mailboxesMutex);
+        auto found = mailboxes.find(nickname);
+        if (found == mailboxes.end()) {
+            return;
+        }
+        mailbox = found->second;
+    }
+    detachMailbox(mailbox);
+}
+
+std::string mailboxStats() {
+    size_t count = 0, memoryBytes = 0;
+    uint64_t spilledBytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(mailboxesMutex);
+        for (const auto& [nickname, mailbox] : mailboxes) {
+            std::lock_guard<std::mutex> mailboxLock(mailbox->mutex);
+            count++;
+            memoryBytes += mailbox->memoryBytes + mailbox->spillBuffer.size();
+            spilledBytes += mailbox->spilledBytes;
+        }
+    }
+    return std::to_string(count) + " waiting, " + std::to_string(memoryBytes) + " bytes in memory, " + std::to_string(spilledBytes) +
+           " bytes on disk, " + std::to_string(mailboxMessagesKept.load()) + " messages kept, " +
+           std::to_string(mailboxMessagesDelivered.load()) + " delivered, " + std::to_string(mailboxMessagesLost.load()) + " lost";
+}
+
+// Numbers the message and hands it to history, log, mailboxes and fanout in
+// one step, so every member sees the channel's sequence numbers in order
+void broadcastToChannel(Channel* channel, const std::string& message) {
+    {
+        std::lock_guard<std::mutex> historyLock(channel->historyMutex);
+        uint64_t seq = channel->nextSeq++;
+        Frame frame = encodeFrame(SEQUENCE_PREFIX + std::to_string(seq) + " " + message);
+        recordHistoryLocked(channel, frame, seq);
+        messageLog.append(channel->name, frame);
+        {
+            EpochGuard guard;
+            for (const std::shared_ptr<Mailbox>& mailbox : channel->roster.load()->mailboxes) {
+                storeInMailbox(*mailbox, frame);
+            }
+        }
+
+        ChannelBatch* batch = channel->batch.load();
+        std::unique_lock<std::mutex> lock;
+        if (batch != nullptr) {
+            lock = std::unique_lock<std::mutex>(batch->mutex);
+        }
+        if (batch != nullptr && batch->intervalMs > 0) {
+            if (batch->pending.empty()) {
+                timingWheel.schedule(batch->timer, batch->intervalMs, [channel, batch]() {
+                    // The timer runs on the reactor thread, fanout belongs on a worker
+                    workerPool.submit([channel, batch]() { flushBatch(channel, *batch); });
+                });
+            }
+            batch->pending.append(*frame);
+            batch->pendingMessages++;
+            batch->pendingLastSeq = seq;
+            if (batch->pending.size() < batch->maxBytes) {
+                return;
+            }
+            flushBatchLocked(channel, *batch);
+        } else {
+            fanoutScheduler.queue(channel, frame, std::string(), seq);
+        }
+    }
+    // Delivery itself runs outside the channel's lock
+    fanoutScheduler.dispatch();
+}
+
+// Join, leave and rename notices, keyed by channel and nickname so that a
+// backlogged member only gets each user's latest state
+void broadcastPresence(Channel* channel, const std::string& channelName, const std::string& subjectName, const std::string& message) {
+    fanoutScheduler.enqueue(channel, encodeFrame(message), channelName + "\n" + subjectName);
+}
+
+// Channel settings and resumable sessions, written every few seconds so that
+// a server that crashed comes back with them. The file is a header, a table
+// of channels sorted by name, a table of sessions sorted by resume token and
+// the strings they point to. It is mapped as it is and searched in place, so
+// a restart costs no parsing: a channel gets its settings back when it is
+// first opened, a session when its client sends /resume.
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t fileBytes;
+    uint64_t checksum;     // of everything after the header
+    uint64_t writtenAtMs;  // wall clock, like every time in the file
+    uint64_t channelCount;
+    uint64_t sessionCount;
+};
+
+struct SnapshotChannel {
+    uint64_t nameOffset;     // into the strings
+    uint64_t blockedOffset;  // blocked words, separated by spaces
+    uint64_t nextSeq;
+    uint64_t loggedMessages;    // in the channel's log when written
+    uint64_t ownerExpiresAtMs;  // until then only the owner's /resume makes someone owner
+    uint64_t batchMaxBytes;
+    uint32_t nameLength;
+    uint32_t blockedLength;
+    uint32_t fanoutWeight;
+    uint32_t batchIntervalMs;
+};
+
+enum SnapshotSessionFlags : uint32_t {
+    SNAPSHOT_CHOSEN_NAME = 1,
+    SNAPSHOT_CHANNEL_OWNER = 2,
+    SNAPSHOT_MUTED = 4,
+};
+
+struct SnapshotSession {
+    char token[RESUME_TOKEN_LENGTH];
+    uint64_t nameOffset;
+    uint64_t channelNameOffset;
+    uint64_t expiresAtMs;
+    uint64_t muteExpiresAtMs;  // 0 while the mute has no duration
+    uint64_t dedupHighest;
+    uint64_t dedupSeen[DEDUP_WINDOW / 64];
+    uint32_t nameLength;
+    uint32_t channelNameLength;
+    uint32_t flags;
+    uint32_t padding;
+};
+
+uint64_t systemMilliseconds() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// FNV-1a, enough to tell a torn or damaged file
+uint64_t snapshotChecksum(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class StateSnapshot {
+public:
+    static const char* magic() { return "CHSNAP01"; }
+
+    ~StateSnapshot() {
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    // Maps the file; false if there is none or it doesn't check out
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat status;
+        void* mapped = MAP_FAILED;
+        if (fstat(fd, &status) == 0 && (size_t)status.st_size >= sizeof(SnapshotHeader)) {
+            mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+        size = status.st_size;
+
+        const SnapshotHeader& header = this->header();
+        uint64_t tablesBytes = header.channelCount * sizeof(SnapshotChannel) + header.sessionCount * sizeof(SnapshotSession);
+        if (memcmp(header.magic, magic(), sizeof(header.magic)) != 0 || header.fileBytes != size ||
+            header.channelCount > size || header.sessionCount > size || sizeof(SnapshotHeader) + tablesBytes > size ||
+            header.checksum != snapshotChecksum(data + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader))) {
+            std::cerr << "Ignoring the snapshot " << path << ": it is damaged or from another version." << std::endl;
+            munmap(mapped, size);
+            data = nullptr;
+            return false;
+        }
+        stringsStart = sizeof(SnapshotHeader) + tablesBytes;
+        return true;
+    }
+
+    bool loaded() const { return data != nullptr; }
+    const SnapshotHeader& header() const { return *reinterpret_cast<const SnapshotHeader*>(data); }
+
+    const SnapshotChannel* channels() const { return reinterpret_cast<const SnapshotChannel*>(data + sizeof(SnapshotHeader)); }
+    const SnapshotSession* sessions() const {
+        return reinterpret_cast<const SnapshotSession*>(data + sizeof(SnapshotHeader) + header().channelCount * sizeof(SnapshotChannel));
+    }
+
+    std::string_view text(uint64_t offset, uint32_t length) const {
+        if (offset > size - stringsStart || length > size - stringsStart - offset) {
+            return std::string_view();
+        }
+        return std::string_view(data + stringsStart + offset, length);
+    }
+
+    const SnapshotChannel* findChannel(std::string_view name) const {
+        if (!loaded()) {
+            return nullptr;
+        }
+        const SnapshotChannel* first = channels();
+        const SnapshotChannel* last = first + header().channelCount;
+        const SnapshotChannel* found = std::lower_bound(first, last, name, [this](const SnapshotChannel& channel, std::string_view key) {
+            return text(channel.nameOffset, channel.nameLength) < key;
+        });
+        return found != last && text(found->nameOffset, found->nameLength) == name ? found : nullptr;
+    }
+
+    const SnapshotSession* findSession(std::string_view token) const {
+        if (!loaded() || token.size() != RESUME_TOKEN_LENGTH) {
+            return nullptr;
+        }
+        const SnapshotSession* first = sessions();
+        const SnapshotSession* last = first + header().sessionCount;
+        const SnapshotSession* found = std::lower_bound(first, last, token, [](const SnapshotSession& session, std::string_view key) {
+            return std::string_view(session.token, RESUME_TOKEN_LENGTH) < key;
+        });
+        return found != last && std::string_view(found->token, RESUME_TOKEN_LENGTH) == token ? found : nullptr;
+    }
+
+private:
+    const char* data = nullptr;
+    size_t size = 0;
+    uint64_t stringsStart = 0;
+};
+
+// What the server started from; sessions are looked up here when a token is
+// not known otherwise
+StateSnapshot bootSnapshot;
+std::unordered_set<std::string> usedSnapshotTokens;  // guarded by resumeMutex
+std::atomic<uint64_t> snapshotsWritten(0);
+std::atomic<uint64_t> lastSnapshotBytes(0);
+std::atomic<uint64_t> lastSnapshotUs(0);
+
+Channel* openChannel(const std::string& channelName, bool& created);
+
+// Where a client was, looked up by the token it got from /connect. While
+// the session is open only live is set; on disconnect the rest is filled in
+// and kept for RESUME_WINDOW_MS.
+struct ResumeState {
+    std::weak_ptr<ClientSession> live;
+    std::string clientName;
+    bool chosenName = false;
+    std::string channelName;
+    Channel* channel = nullptr;
+    bool isChannelOwner = false;
+    bool muted = false;
+    uint64_t muteExpiresMs = 0;
+    DedupWindow dedup;  // so retries after the reconnect are still caught
+    uint64_t expiresAtMs = 0;
+};
+
+std::mutex resumeMutex;
+std::unordered_map<std::string, ResumeState> resumeStates;  // by token
+
+std::string issueResumeToken(const std::shared_ptr<ClientSession>& session) {
+    if (session->resumeToken.empty()) {
+        static thread_local std::mt19937_64 random(std::random_device{}());
+        std::ostringstream token;
+        token << std::hex << std::setfill('0') << std::setw(16) << random() << std::setw(16) << random();
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        session->resumeToken = token.str();
+        resumeStates[session->resumeToken].live = session;
+    }
+    return session->resumeToken;
+}
+
+// Remembers where a closing session was, unless it was resumed elsewhere
+void saveResumeState(const std::shared_ptr<ClientSession>& session) {
+    if (session->resumeToken.empty() || session->takenOver) {
+        return;
+    }
+    uint64_t nowMs = steadyMilliseconds();
+    std::lock_guard<std::mutex> lock(resumeMutex);
+    if (resumeStates.size() > MAX_RESUMABLE_SESSIONS) {
+        for (auto it = resumeStates.begin(); it != resumeStates.end();) {
+            it = it->second.expiresAtMs != 0 && it->second.expiresAtMs < nowMs ? resumeStates.erase(it) : std::next(it);
+        }
+    }
+    auto found = resumeStates.find(session->resumeToken);
+    if (found == resumeStates.end() || found->second.live.lock() != session) {
+        return;
+    }
+    ResumeState& state = found->second;
+    bool member = session->channel != nullptr && isChannelMember(session->channel, session.get());
+    state.live.reset();
+    state.clientName = session->clientName;
+    state.chosenName = session->chosenName;
+    state.channelName = member ? session->currentChannel : std::string();
+    state.channel = member ? session->channel : nullptr;
+    state.isChannelOwner = session->isChannelOwner;
+    state.muted = member && session->muted && session->mutedChannel == session->channel;
+    state.muteExpiresMs = session->muteExpiresMs;
+    {
+        std::lock_guard<std::mutex> dedupLock(session->dedupMutex);
+        state.dedup = session->dedup;
+    }
+    state.expiresAtMs = nowMs + RESUME_WINDOW_MS;
+}
+
+void forgetResumeState(const std::shared_ptr<ClientSession>& session) {
+    if (session->resumeToken.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(resumeMutex);
+    resumeStates.erase(session->resumeToken);
+    session->resumeToken.clear();
+}
+
+// A token from before a restart: its state comes from the snapshot, once
+void restoreSnapshotSession(const std::string& token) {
+    const SnapshotSession* record = bootSnapshot.findSession(token);
+    if (record == nullptr) {
+        return;
+    }
+    uint64_t nowMs = systemMilliseconds();
+    {
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        if (record->expiresAtMs <= nowMs || resumeStates.count(token) > 0 || !usedSnapshotTokens.insert(token).second) {
+            return;
+        }
+    }
+
+    ResumeState state;
+    state.clientName = bootSnapshot.text(record->nameOffset, record->nameLength);
+    state.chosenName = record->flags & SNAPSHOT_CHOSEN_NAME;
+    state.channelName = bootSnapshot.text(record->channelNameOffset, record->channelNameLength);
+    if (!state.channelName.empty()) {
+        bool created;
+        state.channel = openChannel(state.channelName, created);
+    }
+    state.isChannelOwner = record->flags & SNAPSHOT_CHANNEL_OWNER;
+    state.muted = record->flags & SNAPSHOT_MUTED;
+    uint64_t steadyNowMs = steadyMilliseconds();
+    if (state.muted && record->muteExpiresAtMs != 0) {
+        state.muteExpiresMs = steadyNowMs + (record->muteExpiresAtMs > nowMs ? record->muteExpiresAtMs - nowMs : 1);
+    }
+    state.dedup.highest = record->dedupHighest;
+    for (size_t bit = 0; bit < DEDUP_WINDOW; bit++) {
+        state.dedup.seen[bit] = (record->dedupSeen[bit / 64] >> (bit % 64)) & 1;
+    }
+    state.expiresAtMs = steadyNowMs + (record->expiresAtMs - nowMs);
+    std::lock_guard<std::mutex> lock(resumeMutex);
+    resumeStates.try_emplace(token, state);
+}
+
+std::string snapshotStats() {
+    std::string stats = std::to_string(snapshotsWritten.load()) + " written, the last one " + std::to_string(lastSnapshotBytes.load()) +
+                        " bytes in " + std::to_string(lastSnapshotUs.load()) + " us";
+    if (bootSnapshot.loaded()) {
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        stats += "; started from one with " + std::to_string(bootSnapshot.header().channelCount) + " channels and " +
+                 std::to_string(bootSnapshot.header().sessionCount) + " sessions, " + std::to_string(usedSnapshotTokens.size()) +
+                 " resumed from it";
+    }
+    return stats;
+}
+
+// Puts the session back where the token's session was and replays the chat
+// after lastSeq from the channel's ring. A session that is still open (its
+// client reconnected before we noticed the old connection die) is taken
+// over: it leaves the channel quietly and is shut down.
+bool resumeSession(const std::shared_ptr<ClientSession>& session, const std::string& token, uint64_t lastSeq) {
+    restoreSnapshotSession(token);
+    ResumeState state;
+    std::shared_ptr<ClientSession> previous;
+    {
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        auto found = resumeStates.find(token);
+        if (found == resumeStates.end()) {
+            return false;
+        }
+        previous = found->second.live.lock();
+        if (previous == nullptr && (found->second.expiresAtMs == 0 || found->second.expiresAtMs < steadyMilliseconds())) {
+            resumeStates.erase(found);
+            return false;
+        }
+        if (previous == session) {
+            return false;
+        }
+        if (previous != nullptr) {
+            previous->takenOver = true;
+            state.clientName = previous->clientName;
+            state.chosenName = previous->chosenName;
+            if (previous->channel != nullptr && isChannelMember(previous->channel, previous.get())) {
+                state.channelName = previous->currentChannel;
+                state.channel = previous->channel;
+            }
+            state.isChannelOwner = previous->isChannelOwner;
+            state.muted = state.channel != nullptr && previous->muted && previous->mutedChannel == state.channel;
+            state.muteExpiresMs = previous->muteExpiresMs;
+            std::lock_guard<std::mutex> dedupLock(previous->dedupMutex);
+            state.dedup = previous->dedup;
+        } else {
+            state = found->second;
+        }
+        if (!session->resumeToken.empty() && session->resumeToken != token) {
+            resumeStates.erase(session->resumeToken);
+        }
+        found->second = ResumeState();
+        found->second.live = session;
+        session->resumeToken = token;
+    }
+    if (previous != nullptr) {
+        if (state.channel != nullptr) {
+            removeFromChannel(state.channel, previous.get());
+        }
+        previous->connection->shutdown();
+    }
+
+    if (session->channel != nullptr && isChannelMember(session->channel, session.get())) {
+        removeFromChannel(session->channel, session.get());
+        broadcastPresence(session->channel, session->currentChannel, session->clientName,
+                          session->clientName + " left the channel " + session->currentChannel + ".");
+    }
+    session->clientName = state.clientName;
+    session->chosenName = state.chosenName;
+    session->isChannelOwner = state.isChannelOwner;
+    if (state.muted) {
+        uint64_t nowMs = steadyMilliseconds();
+        setMuted(session, true, state.channelName,
+                 state.muteExpiresMs == 0 ? 0 : state.muteExpiresMs > nowMs ? state.muteExpiresMs - nowMs : 1);
+    }
+    {
+        std::lock_guard<std::mutex> dedupLock(session->dedupMutex);
+        session->dedup = state.dedup;
+    }
+    session->currentChannel = state.channelName;
+    session->channel = state.channel;
+    publishPlace(*session);
+    updateConnectedClients([&session](ClientList& clients) {
+        for (ConnectedClient& client : clients) {
+            if (client.session == session) {
+                client.name = session->clientName;
+            }
+        }
+    });
+    // The replay below covers what the mailbox would have
+    dropMailbox(session->clientName);
+    if (session->chosenName) {
+        directoryPublish(session.get(), session->clientName, state.channelName);
+    }
+
+    if (state.channel == nullptr) {
+        sendMessage(*session->connection, "Resumed as " + state.clientName + ".");
+        return true;
+    }
+    if (previous == nullptr) {
+        broadcastPresence(state.channel, state.channelName, state.clientName, state.clientName + " joined the channel " + state.channelName + ".");
+    }
+    sendMessage(*session->connection, "Resumed as " + state.clientName + " in " + state.channelName + ".");
+    joinChannel(state.channel, session, lastSeq);
+    return true;
+}
+
+// One line per channel with its fanout weight, backlog and latency
+std::string channelFanoutStats() {
+    EpochGuard guard;
+    const ChannelMap* channels = channelsNames.load();
+    std::string lines;
+    int shown = 0;
+    for (const auto& [name, channel] : *channels) {
+        if (shown == STATS_CHANNEL_LINES) {
+            lines += "\n... and " + std::to_string(channels->size() - shown) + " more channels";
+            break;
+        }
+        lines += "\nChannel " + name + ": " + fanoutScheduler.channelStats(channel);
+        ChannelBatch* batch = channel->batch.load();
+        if (batch != nullptr && batch->intervalMs > 0) {
+            uint64_t batches = batch->batchesSent.load();
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(1) << ", batched every " << batch->intervalMs << " ms or " << batch->maxBytes
+                << " bytes, " << (batches > 0 ? (double)batch->messagesSent.load() / batches : 0.0) << " messages per batch";
+            lines += out.str();
+        }
+        shown++;
+    }
+    return lines;
+}
+
+// Words a message is matched against, normalized like the message text:
+// lowercase letters and digits, with every other run of characters turned
+// into one separator
+struct KeywordPattern {
+    std::vector<std::weak_ptr<ClientSession>> watchers;
+    std::vector<Channel*> blockedIn;
+};
+
+// Aho-Corasick automaton over all watched and blocked words, immutable once
+// built. Patterns are stored with a separator on both sides and messages are
+// scanned with one added at each end, so only whole words match. Edges are
+// kept sorted per node in one array; with failure links the walk costs the
+// same per character however many patterns there are.
+struct KeywordAutomaton {
+    static const int SEPARATOR = 0;
+    static const int SYMBOLS = 37;  // separator, a-z, 0-9
+
+    struct Node {
+        uint32_t firstEdge = 0;
+        uint32_t edgeCount = 0;
+        uint32_t fail = 0;
+        uint32_t output = 0;  // nearest node on the failure chain that ends a pattern, 0 for none
+        int32_t pattern = -1;
+    };
+
+    struct Edge {
+        uint8_t symbol;
+        uint32_t target;
+    };
+
+    KeywordAutomaton() : nodes(1) {}
+
+    explicit KeywordAutomaton(std::vector<std::pair<std::string, KeywordPattern>> entries) : patterns(std::move(entries)) {
+        // Trie first, with per-node edge lists
+        std::vector<std::vector<Edge>> children(1);
+        std::vector<int32_t> ends(1, -1);
+        for (size_t p = 0; p < patterns.size(); p++) {
+            uint32_t node = 0;
+            std::string word = " " + patterns[p].first + " ";
+            for (char c : word) {
+                uint8_t s = symbol(c);
+                auto edge = std::find_if(children[node].begin(), children[node].end(), [s](const Edge& e) { return e.symbol == s; });
+                if (edge == children[node].end()) {
+                    children[node].push_back({s, (uint32_t)children.size()});
+                    node = children.size();
+                    children.emplace_back();
+                    ends.push_back(-1);
+                } else {
+                    node = edge->target;
+                }
+            }
+            ends[node] = p;
+        }
+
+        // Flatten in breadth-first order so failure links can be set as we go
+        nodes.resize(children.size());
+        std::vector<uint32_t> order{0};
+        for (size_t i = 0; i < order.size(); i++) {
+            uint32_t node = order[i];
+            std::sort(children[node].begin(), children[node].end(), [](const Edge& a, const Edge& b) { return a.symbol < b.symbol; });
+            nodes[node].firstEdge = edges.size();
+            nodes[node].edgeCount = children[node].size();
+            nodes[node].pattern = ends[node];
+            edges.insert(edges.end(), children[node].begin(), children[node].end());
+            for (const Edge& edge : children[node]) {
+                order.push_back(edge.target);
+            }
+        }
+        for (size_t i = 1; i < order.size(); i++) {
+            uint32_t node = order[i];
+            for (uint32_t e = nodes[node].firstEdge; e < nodes[node].firstEdge + nodes[node].edgeCount; e++) {
+                uint32_t child = edges[e].target;
+                nodes[child].fail = next(nodes[node].fail, edges[e].symbol);
+                uint32_t fail = nodes[child].fail;
+                nodes[child].output = nodes[fail].pattern >= 0 ? fail : nodes[fail].output;
+            }
+        }
+        // Children of the root fail to the root, which they already do
+    }
+
+    static uint8_t symbol(char c) {
+        unsigned char u = c;
+        if (std::isdigit(u)) {
+            return 27 + (u - '0');
+        }
+        if (std::isalpha(u)) {
+            return 1 + (std::tolower(u) - 'a');
+        }
+        return SEPARATOR;
+    }
+
+    // Lowercase words separated by single spaces
+    static std::string normalize(const std::string& text) {
+        std::string normalized;
+        for (char c : text) {
+            if (symbol(c) != SEPARATOR) {
+                normalized += (char)std::tolower((unsigned char)c);
+            } else if (!normalized.empty() && normalized.back() != ' ') {
+                normalized += ' ';
+            }
+        }
+        if (!normalized.empty() && normalized.back() == ' ') {
+            normalized.pop_back();
+        }
+        return normalized;
+    }
+
+    uint32_t child(uint32_t node, uint8_t s) const {
+        const Edge* first = edges.data() + nodes[node].firstEdge;
+        const Edge* last = first + nodes[node].edgeCount;
+        const Edge* edge = std::lower_bound(first, last, s, [](const Edge& e, uint8_t s) { return e.symbol < s; });
+        return edge != last && edge->symbol == s ? edge->target : 0;
+    }
+
+    // Goto with failure links; the root loops to itself
+    uint32_t next(uint32_t node, uint8_t s) const {
+        while (true) {
+            uint32_t target = child(node, s);
+            if (target != 0 || node == 0) {
+                return target;
+            }
+            node = nodes[node].fail;
+        }
+    }
+
+    // Indices of the patterns found in text, each once
+    std::vector<uint32_t> scan(const std::string& text) const {
+        std::vector<uint32_t> found;
+        uint32_t node = next(0, SEPARATOR);
+        bool separated = true;
+        auto step = [&](uint8_t s) {
+            node = next(node, s);
+            for (uint32_t hit = nodes[node].pattern >= 0 ? node : nodes[node].output; hit != 0; hit = nodes[hit].output) {
+                if (std::find(found.begin(), found.end(), (uint32_t)nodes[hit].pattern) == found.end()) {
+                    found.push_back(nodes[hit].pattern);
+                }
+            }
+        };
+        for (char c : text) {
+            uint8_t s = symbol(c);
+            // Runs of separators count as one, as in the patterns
+            if (s == SEPARATOR && separated) {
+                continue;
+            }
+            separated = s == SEPARATOR;
+            step(s);
+        }
+        if (!separated) {
+            step(SEPARATOR);
+        }
+        return found;
+    }
+
+    std::vector<std::pair<std::string, KeywordPattern>> patterns;
+    std::vector<Node> nodes;
+    std::vector<Edge> edges;
+};
+
+// Keeps the watched and blocked words and republishes the automaton after
+// changes. Rebuilds run on the worker pool and coalesce: changes made while
+// one is running are picked up by one more pass, and the newest automaton is
+// swapped in through the same epoch-based publishing as the rosters.
+class KeywordMatcher {
+public:
+    // False if the session already watches the most words it may
+    bool watch(const std::shared_ptr<ClientSession>& session, const std::string& word) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string>& watched = session->watchedWords;
+        if (std::find(watched.begin(), watched.end(), word) != watched.end()) {
+            return true;
+        }
+        if (watched.size() >= MAX_WATCHED_WORDS) {
+            return false;
+        }
+        watched.push_back(word);
+        patterns[word].watchers.push_back(session);
+        changedLocked();
+        return true;
+    }
+
+    void unwatch(const std::shared_ptr<ClientSession>& session, const std::string& word) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string>& watched = session->watchedWords;
+        auto found = std::find(watched.begin(), watched.end(), word);
+        if (found == watched.end()) {
+            return;
+        }
+        watched.erase(found);
+        removeWatcherLocked(session.get(), word);
+        changedLocked();
+    }
+
+    void removeSession(const std::shared_ptr<ClientSession>& session) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (session->watchedWords.empty()) {
+            return;
+        }
+        for (const std::string& word : session->watchedWords) {
+            removeWatcherLocked(session.get(), word);
+        }
+        session->watchedWords.clear();
+        changedLocked();
+    }
+
+    std::vector<std::string> watchedWords(const std::shared_ptr<ClientSession>& session) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return session->watchedWords;
+    }
+
+    // False if the channel already blocks the most words it may
+    bool block(Channel* channel, const std::string& word) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string>& blocked = blockedWords[channel];
+        if (std::find(blocked.begin(), blocked.end(), word) != blocked.end()) {
+            return true;
+        }
+        if (blocked.size() >= MAX_BLOCKED_WORDS) {
+            return false;
+        }
+        blocked.push_back(word);
+        patterns[word].blockedIn.push_back(channel);
+        changedLocked();
+        return true;
+    }
+
+    void unblock(Channel* channel, const std::string& word) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::string>& blocked = blockedWords[channel];
+        auto found = std::find(blocked.begin(), blocked.end(), word);
+        if (found == blocked.end()) {
+            return;
+        }
+        blocked.erase(found);
+        std::vector<Channel*>& blockedIn = patterns[word].blockedIn;
+        blockedIn.erase(std::remove(blockedIn.begin(), blockedIn.end(), channel), blockedIn.end());
+        eraseIfUnusedLocked(word);
+        changedLocked();
+    }
+
+    std::vector<std::string> blockedIn(Channel* channel) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = blockedWords.find(channel);
+        return found == blockedWords.end() ? std::vector<std::string>() : found->second;
+    }
+
+    // One pass over the message: whether the channel blocks it, and who
+    // watches one of its words
+    bool match(Channel* channel, const std::string& text, std::vector<std::shared_ptr<ClientSession>>& watchers) {
+        EpochGuard guard;
+        const KeywordAutomaton* current = automaton.load();
+        if (current->patterns.empty()) {
+            return false;
+        }
+        bool blocked = false;
+        for (uint32_t index : current->scan(text)) {
+            const KeywordPattern& pattern = current->patterns[index].second;
+            blocked = blocked || std::find(pattern.blockedIn.begin(), pattern.blockedIn.end(), channel) != pattern.blockedIn.end();
+            for (const std::weak_ptr<ClientSession>& watcher : pattern.watchers) {
+                std::shared_ptr<ClientSession> session = watcher.lock();
+                if (session != nullptr && std::find(watchers.begin(), watchers.end(), session) == watchers.end()) {
+                    watchers.push_back(session);
+                }
+            }
+        }
+        return blocked;
+    }
+
+    std::string stats() {
+        size_t patternCount, nodeCount;
+        {
+            EpochGuard guard;
+            const KeywordAutomaton* current = automaton.load();
+            patternCount = current->patterns.size();
+            nodeCount = current->nodes.size();
+        }
+        return std::to_string(patternCount) + " words in " + std::to_string(nodeCount) + " states, " + std::to_string(rebuilds.load()) +
+               " rebuilds, last took " + std::to_string(lastRebuildUs.load()) + " us, " + std::to_string(messagesBlocked.load()) +
+               " messages blocked, " + std::to_string(watchNotices.load()) + " watch notices";
+    }
+
+    std::atomic<uint64_t> messagesBlocked{0};
+    std::atomic<uint64_t> watchNotices{0};
+
+private:
+    void removeWatcherLocked(const ClientSession* session, const std::string& word) {
+        std::vector<std::weak_ptr<ClientSession>>& watchers = patterns[word].watchers;
+        watchers.erase(std::remove_if(watchers.begin(), watchers.end(),
+                                      [session](const std::weak_ptr<ClientSession>& watcher) {
+                                          std::shared_ptr<ClientSession> locked = watcher.lock();
+                                          return locked == nullptr || locked.get() == session;
+                                      }),
+                       watchers.end());
+        eraseIfUnusedLocked(word);
+    }
+
+    void eraseIfUnusedLocked(const std::string& word) {
+        auto found = patterns.find(word);
+        if (found != patterns.end() && found->second.watchers.empty() && found->second.blockedIn.empty()) {
+            patterns.erase(found);
+        }
+    }
+
+    void changedLocked() {
+        dirty = true;
+        if (!rebuilding) {
+            rebuilding = true;
+            workerPool.submit([this]() { rebuild(); });
+        }
+    }
+
+    void rebuild() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (dirty) {
+            dirty = false;
+            std::vector<std::pair<std::string, KeywordPattern>> entries(patterns.begin(), patterns.end());
+            lock.unlock();
+            auto started = std::chrono::steady_clock::now();
+            const KeywordAutomaton* built = new KeywordAutomaton(std::move(entries));
+            lastRebuildUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+            rebuilds++;
+            publishSnapshot(automaton, built);
+            lock.lock();
+        }
+        rebuilding = false;
+    }
+
+    std::mutex mutex;
+    std::map<std::string, KeywordPattern> patterns;
+    std::unordered_map<Channel*, std::vector<std::string>> blockedWords;
+    bool dirty = false;
+    bool rebuilding = false;
+    std::atomic<const KeywordAutomaton*> automaton{new KeywordAutomaton()};
+    std::atomic<uint64_t> rebuilds{0};
+    std::atomic<uint64_t> lastRebuildUs{0};
+};
+
+KeywordMatcher keywordMatcher;
+
+// Like findOrCreateChannel(), but a channel in the snapshot comes back with
+// its settings and numbering. Whoever opens it only becomes its owner once
+// the owner's chance to resume is over.
+Channel* openChannel(const std::string& channelName, bool& created) {
+    Channel* channel = findOrCreateChannel(channelName, created);
+    const SnapshotChannel* record = created ? bootSnapshot.findChannel(channelName) : nullptr;
+    if (record == nullptr) {
+        return channel;
+    }
+    {
+        // Chat logged after the snapshot was written used numbers it doesn't know
+        uint64_t logged = messageLog.messageCount(channelName);
+        std::lock_guard<std::mutex> lock(channel->historyMutex);
+        channel->nextSeq = record->nextSeq + (logged > record->loggedMessages ? logged - record->loggedMessages : 0);
+    }
+    fanoutScheduler.setWeight(channel, std::clamp<int>(record->fanoutWeight, 1, MAX_CHANNEL_WEIGHT));
+    if (record->batchIntervalMs > 0) {
+        configureBatch(channel, std::min<int>(record->batchIntervalMs, MAX_BATCH_INTERVAL_MS),
+                       std::min<size_t>(record->batchMaxBytes, MAX_BATCH_BYTES));
+    }
+    std::string_view blocked = bootSnapshot.text(record->blockedOffset, record->blockedLength);
+    std::istringstream words{std::string(blocked)};
+    for (std::string word; words >> word;) {
+        keywordMatcher.block(channel, word);
+    }
+    created = record->ownerExpiresAtMs <= systemMilliseconds();
+    return channel;
+}
+
+void setNickname(const std::shared_ptr<ClientSession>& session, const std::string& newName) {
+    std::string& clientName = session->clientName;
+    std::cout << "Client " << session->connection->socket << " is now ";
+
+    if (session->channel != nullptr && newName != clientName) {
+        broadcastPresence(session->channel, session->currentChannel, clientName, clientName + " is now known as " + newName + ".");
+    }
+    clientName = newName;
+    updateConnectedClients([&session, &clientName](ClientList& clients) {
+        for (ConnectedClient& client : clients) {
+            if (client.session == session) {
+                client.name = clientName;
+            }
+        }
+    });
+    std::cout << clientName << std::endl;
+    session->chosenName = true;
+    deliverMailbox(session);
+    directoryPublish(session.get(), clientName, session->currentChannel);
+}
+
+// Moves the session into the channel, creating it if needed. The join reply
+// and the channel's recent chat are queued behind replies in one write.
+void enterChannel(const std::shared_ptr<ClientSession>& session, const std::string& channelName, std::vector<Frame> replies) {
+    std::string& clientName = session->clientName;
+    Channel*& channel = session->channel;
+    if (channel != nullptr && isChannelMember(channel, session.get())) {
+        removeFromChannel(channel, session.get());
+        broadcastPresence(channel, session->currentChannel, clientName, clientName + " left the channel " + session->currentChannel + ".");
+    }
+
+    //Check if channel exists
+    bool created;
+    channel = openChannel(channelName, created);
+    // In prefork mode the worker that has the channel already has its owner
+    created = created && !channelOnOtherWorker(channelName);
+    broadcastPresence(channel, channelName, clientName, clientName + " joined the channel " + channelName + ".");
+    session->currentChannel = channelName;
+
+    if(created){
+
+        std::string creationMessage = "Channel " + channelName + " created";
+        std::cout << creationMessage << std::endl;
+        replies.push_back(encodeFrame(creationMessage));
+        session->isChannelOwner = true;
+
+    }else{
+        replies.push_back(encodeFrame("Connected to the channel: " + channelName));
+    }
+    joinChannel(channel, session, 0, std::move(replies));
+    publishPlace(*session);
+    if (session->chosenName) {
+        directoryPublish(session.get(), clientName, channelName);
+    }
+}
+
+// Tells the channel's watchers about a message that matched their words
+void notifyWatchers(const std::vector<std::shared_ptr<ClientSession>>& watchers, const std::string& channelName,
+                    const std::string& fullMessage, const ClientSession* sender) {
+    if (watchers.empty()) {
+        return;
+    }
+    Frame notice = encodeFrame("Watched word in " + channelName + ", " + fullMessage);
+    for (const std::shared_ptr<ClientSession>& watcher : watchers) {
+        if (watcher.get() != sender) {
+            watcher->connection->send(notice, true);
+            keywordMatcher.watchNotices++;
+        }
+    }
+}
+
+// Takes the session out of its channel without keeping a mailbox
+void leaveChannel(const std::shared_ptr<ClientSession>& session) {
+    if (session->channel != nullptr && isChannelMember(session->channel, session.get())) {
+        removeFromChannel(session->channel, session.get());
+        broadcastPresence(session->channel, session->currentChannel, session->clientName,
+                          session->clientName + " left the channel " + session->currentChannel + ".");
+    }
+    session->channel = nullptr;
+    session->currentChannel.clear();
+    session->isChannelOwner = false;
+    publishPlace(*session);
+    directoryMoved(session.get(), "");
+}
+
+// Federation: several servers (nodes) share their channels over links
+// between them. Each node keeps its own members, owners and numbering, and
+// tells its peers which channels it has members or mailboxes in; chat only
+// crosses the links of the peers that want that channel. Chat that came
+// over a link is delivered here and never passed on, so every node needs a
+// link to every other one, dialed by either side.
+//
+// Each channel also has a home node, picked by consistent hashing of its
+// name onto the linked nodes. A client entering a channel whose home is
+// another node is relayed there whole (see routeToHome()), so the channel's
+// owner, mutes and history all live on its home. The sharing above only
+// matters while nodes disagree about the ring, for example while a link is
+// down.
+
+// FNV-1a, with its bits mixed so that similar names land far apart on the ring
+uint64_t ringHash(const std::string& key) {
+    uint64_t hash = snapshotChecksum(key.data(), key.size());
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+// A link message is a word followed by its fields, each after its length:
+// "CHAT 4 #abc 3 bob 5 hello"
+std::string encodeLinkMessage(const std::string& kind, const std::vector<std::string>& fields) {
+    std::string message = kind;
+    for (const std::string& field : fields) {
+        message += " " + std::to_string(field.size()) + " " + field;
+    }
+    return message;
+}
+
+bool decodeLinkMessage(const std::string& message, std::string& kind, std::vector<std::string>& fields) {
+    size_t offset = message.find(' ');
+    kind = message.substr(0, offset);
+    while (offset != std::string::npos && offset < message.size()) {
+        size_t lengthEnd = message.find(' ', offset + 1);
+        if (lengthEnd == std::string::npos) {
+            return false;
+        }
+        size_t length;
+        try {
+            length = std::stoul(message.substr(offset + 1, lengthEnd - offset - 1));
+        } catch (const std::exception&) {
+            return false;
+        }
+        if (message.size() - lengthEnd - 1 < length) {
+            return false;
+        }
+        fields.push_back(message.substr(lengthEnd + 1, length));
+        offset = lengthEnd + 1 + length;
+    }
+    return true;
+}
+
+// One server-to-server link. Chat for the peer is gathered for
+// LINK_BATCH_INTERVAL_MS, or until LINK_BATCH_BYTES are waiting, and then
+// goes out in one write; the frames keep their own length prefixes.
+struct PeerLink {
+    std::shared_ptr<Connection> connection;
+    std::string address;  // host:port we dialed; empty when the peer dialed us
+    uint64_t connectedAtMs = 0;
+    sockaddr_in clientAddress{};  // the peer's port for clients, at the address the link comes from
+
+    // Guarded by the federation's mutex
+    std::string node;  // from the peer's hello
+    bool established = false;
+    std::unordered_set<std::string> interests;  // channels the peer wants chat for
+
+    std::mutex batchMutex;
+    std::string batch;
+    size_t batchMessages = 0;
+    Timer batchTimer;
+
+    std::atomic<uint64_t> messagesSent{0};
+    std::atomic<uint64_t> bytesSent{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> messagesReceived{0};
+    std::atomic<uint64_t> bytesReceived{0};
+};
+
+// A server from --peers, dialed again LINK_RETRY_MS after every failure or
+// lost link unless a link the peer dialed already connects us
+struct PeerAddress {
+    std::string address;
+    sockaddr_in resolved{};  // looked up once at startup
+    std::string node;  // learned from its hello; guarded by the federation's mutex
+    bool unreachableReported = false;
+    Timer retryTimer;
+};
+
+// A connect() in progress, registered with the reactor until the socket
+// turns writable or LINK_CONNECT_TIMEOUT_MS pass. Reactor thread only.
+class PendingConnect : public ReactorHandler, public std::enable_shared_from_this<PendingConnect> {
+public:
+    PendingConnect(int socket, std::function<void(int)> done) : socket(socket), done(std::move(done)) {}
+
+    void start() {
+        std::weak_ptr<PendingConnect> weakConnect = shared_from_this();
+        timingWheel.schedule(timeoutTimer, LINK_CONNECT_TIMEOUT_MS, [weakConnect]() {
+            if (std::shared_ptr<PendingConnect> connect = weakConnect.lock()) {
+                connect->finish(ETIMEDOUT);
+            }
+        });
+    }
+
+    void onEvents(uint32_t) override {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &length);
+        finish(error);
+    }
+
+private:
+    void finish(int error) {
+        if (socket == -1) {
+            return;
+        }
+        // The reactor held the last reference
+        std::shared_ptr<PendingConnect> self = shared_from_this();
+        int connected = socket;
+        socket = -1;
+        timingWheel.cancel(timeoutTimer);
+        reactor.remove(connected);
+        if (error != 0) {
+            ::close(connected);
+            connected = -1;
+        }
+        done(connected);
+    }
+
+    int socket;
+    std::function<void(int)> done;
+    Timer timeoutTimer;
+};
+
+// Connects without blocking the reactor thread it runs on; done gets the
+// non-blocking socket, or -1 when the address could not be reached
+void connectNonBlocking(const sockaddr_in& address, std::function<void(int)> done) {
+    int socket = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (socket == -1) {
+        done(-1);
+        return;
+    }
+    if (connect(socket, (const sockaddr*)&address, sizeof(address)) == 0) {
+        done(socket);
+        return;
+    }
+    if (errno == EINPROGRESS) {
+        auto pending = std::make_shared<PendingConnect>(socket, done);
+        if (reactor.add(socket, pending, EPOLLOUT | EPOLLET)) {
+            pending->start();
+            return;
+        }
+    }
+    ::close(socket);
+    done(-1);
+}
+
+SessionTask peerLinkSession(std::shared_ptr<PeerLink> link);
+
+// Defined with the nickname directory, which sends through the federation
+bool handleDirectoryMessage(const std::shared_ptr<PeerLink>& link, const std::string& kind, const std::vector<std::string>& fields);
+void directoryLinked(const std::shared_ptr<PeerLink>& link);
+void applyModeration(const std::string& action, const std::string& userName, const std::string& channelName, int durationSeconds);
+
+// Chat a peer node accepted from one of its clients. The blocked words of
+// this node's channel still apply, and its watchers hear about it.
+void deliverPeerChat(const std::string& channelName, const std::string& sender, const std::string& text,
+                     std::atomic<uint64_t>& blocked) {
+    Channel* channel = findChannel(channelName);
+    if (channel == nullptr) {
+        return;
+    }
+    std::vector<std::shared_ptr<ClientSession>> watchers;
+    if (keywordMatcher.match(channel, text, watchers)) {
+        blocked++;
+        return;
+    }
+    std::string fullMessage = sender + ": " + text;
+    notifyWatchers(watchers, channelName, fullMessage, nullptr);
+    broadcastToChannel(channel, fullMessage);
+}
+
+class Federation {
+public:
+    // Defined after LinkListener
+    bool start();
+
+    bool enabled() const { return active; }
+
+    // Reactor thread, for sockets accepted on the link port
+    void accept(int socket) { startLink(socket, std::string()); }
+
+    // Called with the channel's roster lock held, so a channel's changes
+    // reach the peers in order
+    void interestChanged(const std::string& channelName, bool wanted) {
+        if (!active) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        if (wanted) {
+            localInterests.insert(channelName);
+        } else {
+            localInterests.erase(channelName);
+        }
+        std::string message = encodeLinkMessage(LINK_INTEREST, {channelName, wanted ? "1" : "0"});
+        for (const std::shared_ptr<PeerLink>& link : links) {
+            if (link->established) {
+                sendNow(*link, message);
+            }
+        }
+    }
+
+    // Local chat, already delivered here, for the peers with members in the channel
+    void forward(const std::string& channelName, const std::string& sender, const std::string& text) {
+        if (!active) {
+            return;
+        }
+        std::vector<std::shared_ptr<PeerLink>> targets;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const std::shared_ptr<PeerLink>& link : links) {
+                if (link->established && link->interests.count(channelName) > 0) {
+                    targets.push_back(link);
+                }
+            }
+        }
+        if (targets.empty()) {
+            chatKeptLocal++;
+            return;
+        }
+        std::string message = encodeLinkMessage(LINK_CHAT, {channelName, sender, text});
+        if (message.size() > (size_t)MAX_FRAME_SIZE) {
+            chatTooLarge++;
+            return;
+        }
+        chatForwarded++;
+        for (const std::shared_ptr<PeerLink>& link : targets) {
+            queue(link, message);
+        }
+    }
+
+    // Unlike chat these go out at once, to established links only
+    void sendTo(const std::shared_ptr<PeerLink>& link, const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (link->established) {
+            sendNow(*link, message);
+        }
+    }
+
+    void broadcast(const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::shared_ptr<PeerLink>& link : links) {
+            if (link->established) {
+                sendNow(*link, message);
+            }
+        }
+    }
+
+    bool sendToNode(const std::string& node, const std::string& message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::shared_ptr<PeerLink>& link : links) {
+            if (link->established && link->node == node) {
+                sendNow(*link, message);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool linkedTo(const std::string& node) {
+        sockaddr_in address{};
+        std::lock_guard<std::mutex> lock(mutex);
+        return linkedNodeLocked(node, address);
+    }
+
+    std::shared_ptr<PeerLink> randomLink() {
+        static thread_local std::mt19937_64 random(std::random_device{}());
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::shared_ptr<PeerLink>> established;
+        std::copy_if(links.begin(), links.end(), std::back_inserter(established),
+                     [](const std::shared_ptr<PeerLink>& link) { return link->established; });
+        return established.empty() ? nullptr : established[random() % established.size()];
+    }
+
+    // A frame from the link's peer; false closes the link
+    bool handle(const std::shared_ptr<PeerLink>& link, const std::string& message) {
+        link->messagesReceived++;
+        link->bytesReceived += message.size() + sizeof(int);
+        std::string kind;
+        std::vector<std::string> fields;
+        if (!decodeLinkMessage(message, kind, fields)) {
+            return false;
+        }
+        if (kind == LINK_HELLO && fields.size() == 2) {
+            if (!hello(link, fields[0], fields[1])) {
+                return false;
+            }
+            directoryLinked(link);
+            return true;
+        }
+        if (kind == LINK_INTEREST && fields.size() == 2) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (link->established && fields[1] == "1") {
+                link->interests.insert(fields[0]);
+            } else if (link->established) {
+                link->interests.erase(fields[0]);
+            }
+            return true;
+        }
+        if (kind == LINK_CHAT && fields.size() == 3) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!link->established) {
+                    return true;
+                }
+            }
+            chatFromPeers++;
+            deliverPeerChat(fields[0], fields[1], fields[2], chatBlocked);
+            return true;
+        }
+        if (kind == LINK_DIRECTORY_UPDATE || kind == LINK_DIRECTORY_DIGEST || kind == LINK_DIRECTORY_TABLE || kind == LINK_MODERATE) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!link->established) {
+                    return true;
+                }
+            }
+            if (kind == LINK_MODERATE) {
+                if (fields.size() != 4) {
+                    return false;
+                }
+                applyModeration(fields[0], fields[1], fields[2], atoi(fields[3].c_str()));
+                return true;
+            }
+            return handleDirectoryMessage(link, kind, fields);
+        }
+        return false;
+    }
+
+    // The link's session has ended
+    void closed(const std::shared_ptr<PeerLink>& link) {
+        PeerAddress* redial = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            links.erase(std::remove(links.begin(), links.end(), link), links.end());
+            if (link->established) {
+                std::cout << "Lost the link to node " << link->node << "." << std::endl;
+            }
+            link->established = false;
+            link->interests.clear();
+            rebuildRingLocked();
+            for (const std::unique_ptr<PeerAddress>& peer : peers) {
+                if (!stopped && !link->address.empty() && peer->address == link->address) {
+                    redial = peer.get();
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(link->batchMutex);
+            timingWheel.cancel(link->batchTimer);
+            link->batch.clear();
+        }
+        std::shared_ptr<Connection> connection = link->connection;
+        reactor.post([connection]() { connection->close(); });
+        if (redial != nullptr) {
+            scheduleDial(*redial, LINK_RETRY_MS);
+        }
+    }
+
+    // The node a channel belongs on: its name, and address set to that node's
+    // port for clients. Empty when it is this node.
+    std::string homeOf(const std::string& channelName, sockaddr_in& address) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto point = std::lower_bound(ring.begin(), ring.end(), std::make_pair(ringHash(channelName), std::string()));
+        if (point == ring.end()) {
+            point = ring.begin();
+        }
+        if (point == ring.end() || point->second == config.nodeName) {
+            return std::string();
+        }
+        return linkedNodeLocked(point->second, address) ? point->second : std::string();
+    }
+
+    // Resume tokens other nodes gave our relayed clients, so that a client
+    // coming back with one is relayed to the node that can resume it
+    void rememberToken(const std::string& token, const std::string& node) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!tokenHomes.insert_or_assign(token, node).second) {
+            return;
+        }
+        tokenOrder.push_back(token);
+        if (tokenOrder.size() > MAX_RESUMABLE_SESSIONS) {
+            tokenHomes.erase(tokenOrder.front());
+            tokenOrder.pop_front();
+        }
+    }
+
+    std::string tokenHome(const std::string& token, sockaddr_in& address) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = tokenHomes.find(token);
+        if (found == tokenHomes.end() || !linkedNodeLocked(found->second, address)) {
+            return std::string();
+        }
+        return found->second;
+    }
+
+    // Oldest first, for a hot restart
+    std::vector<std::pair<std::string, std::string>> rememberedTokens() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::pair<std::string, std::string>> tokens;
+        for (const std::string& token : tokenOrder) {
+            tokens.emplace_back(token, tokenHomes[token]);
+        }
+        return tokens;
+    }
+
+    // Reactor thread. Lets go of the link port and drops every link, for a
+    // hot restart: the new server dials and is dialed in our place.
+    void stop() {
+        std::vector<std::shared_ptr<PeerLink>> open;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopped = true;
+            open = links;
+        }
+        if (listenSocket != -1) {
+            reactor.remove(listenSocket);
+            ::close(listenSocket);
+            listenSocket = -1;
+        }
+        for (const std::shared_ptr<PeerLink>& link : open) {
+            link->connection->shutdown();
+        }
+    }
+
+    std::string stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t established = std::count_if(links.begin(), links.end(), [](const std::shared_ptr<PeerLink>& link) { return link->established; });
+        std::string text = "node " + config.nodeName + ", " + std::to_string(established) + " links, " +
+                           std::to_string(localInterests.size()) + " channels wanted from peers; chat " +
+                           std::to_string(chatForwarded.load()) + " forwarded, " + std::to_string(chatKeptLocal.load()) +
+                           " wanted by no peer, " + std::to_string(chatTooLarge.load()) + " too large to forward, " +
+                           std::to_string(chatFromPeers.load()) + " from peers, " + std::to_string(chatBlocked.load()) +
+                           " of those blocked here; ring of " + std::to_string(ring.size() / RING_VIRTUAL_NODES) +
+                           " nodes; clients relayed to their channel's home: " + std::to_string(relaysActive.load()) + " now, " +
+                           std::to_string(relaysOpened.load()) + " in total, " + std::to_string(relayConnectsFailed.load()) +
+                           " could not reach it";
+        uint64_t nowMs = steadyMilliseconds();
+        for (const std::shared_ptr<PeerLink>& link : links) {
+            if (!link->established) {
+                continue;
+            }
+            uint64_t writes = link->writes.load();
+            std::ostringstream out;
+            out << std::fixed << std::setprecision(1) << "\nLink to " << link->node << " ("
+                << (link->address.empty() ? "dialed by it" : "dialed " + link->address) << "): up "
+                << (nowMs - link->connectedAtMs) / 1000 << " s, " << link->interests.size() << " channels wanted, "
+                << link->messagesSent.load() << " messages out in " << writes << " writes ("
+                << (writes > 0 ? (double)link->messagesSent.load() / writes : 0.0) << " per write, " << link->bytesSent.load()
+                << " bytes), " << link->messagesReceived.load() << " in (" << link->bytesReceived.load() << " bytes)";
+            text += out.str();
+        }
+        return text;
+    }
+
+    std::atomic<uint64_t> chatForwarded{0};
+    std::atomic<uint64_t> chatKeptLocal{0};
+    std::atomic<uint64_t> chatTooLarge{0};
+    std::atomic<uint64_t> chatFromPeers{0};
+    std::atomic<uint64_t> chatBlocked{0};
+    std::atomic<int64_t> relaysActive{0};
+    std::atomic<uint64_t> relaysOpened{0};
+    std::atomic<uint64_t> relayConnectsFailed{0};
+
+    // "host:port" to an IPv4 address; blocks on DNS, so only used at startup
+    static bool resolve(const std::string& address, sockaddr_in& resolved) {
+        size_t colon = address.rfind(':');
+        if (colon == std::string::npos) {
+            return false;
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result = nullptr;
+        if (getaddrinfo(address.substr(0, colon).c_str(), address.substr(colon + 1).c_str(), &hints, &result) != 0) {
+            return false;
+        }
+        resolved = *(const sockaddr_in*)result->ai_addr;
+        freeaddrinfo(result);
+        return true;
+    }
+
+private:
+    // Both ends keep the same link when two connect the same nodes: the one
+    // dialed by the node whose name sorts first, or the newer of two dialed
+    // by the same node (the older is likely dead without us knowing yet)
+    bool hello(const std::shared_ptr<PeerLink>& link, const std::string& node, const std::string& clientPort) {
+        std::lock_guard<std::mutex> lock(mutex);
+        socklen_t addressLength = sizeof(link->clientAddress);
+        if (link->established || node.empty() ||
+            getpeername(link->connection->socket, (sockaddr*)&link->clientAddress, &addressLength) < 0) {
+            return false;
+        }
+        link->clientAddress.sin_port = htons(atoi(clientPort.c_str()));
+        link->node = node;
+        for (const std::unique_ptr<PeerAddress>& peer : peers) {
+            if (!link->address.empty() && peer->address == link->address) {
+                peer->node = node;
+            }
+        }
+        if (node == config.nodeName) {
+            std::cerr << "Not linking to " << (link->address.empty() ? "a node" : link->address) << " with our own name " << node << "." << std::endl;
+            return false;
+        }
+        const std::string& dialer = link->address.empty() ? node : config.nodeName;
+        for (const std::shared_ptr<PeerLink>& other : links) {
+            if (other == link || !other->established || other->node != node) {
+                continue;
+            }
+            const std::string& otherDialer = other->address.empty() ? node : config.nodeName;
+            if (dialer > otherDialer) {
+                return false;
+            }
+            other->established = false;
+            other->interests.clear();
+            other->connection->shutdown();
+        }
+        link->established = true;
+        link->connectedAtMs = steadyMilliseconds();
+        rebuildRingLocked();
+        std::cout << "Linked to node " << node << "." << std::endl;
+        for (const std::string& channelName : localInterests) {
+            sendNow(*link, encodeLinkMessage(LINK_INTEREST, {channelName, "1"}));
+        }
+        return true;
+    }
+
+    // Every node puts RING_VIRTUAL_NODES points on the ring, so one joining
+    // or leaving moves about 1/N of the channels and each gets a fair share
+    void rebuildRingLocked() {
+        std::vector<std::string> nodes = {config.nodeName};
+        for (const std::shared_ptr<PeerLink>& link : links) {
+            if (link->established) {
+                nodes.push_back(link->node);
+            }
+        }
+        ring.clear();
+        for (const std::string& node : nodes) {
+            for (int i = 0; i < RING_VIRTUAL_NODES; i++) {
+                ring.emplace_back(ringHash(node + "#" + std::to_string(i)), node);
+            }
+        }
+        std::sort(ring.begin(), ring.end());
+    }
+
+    bool linkedNodeLocked(const std::string& node, sockaddr_in& address) {
+        for (const std::shared_ptr<PeerLink>& link : links) {
+            if (link->established && link->node == node) {
+                address = link->clientAddress;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void sendNow(PeerLink& link, const std::string& message) {
+        Frame frame = encodeFrame(message);
+        link.messagesSent++;
+        link.bytesSent += frame->size();
+        link.writes++;
+        link.connection->send(frame);
+    }
+
+    void queue(const std::shared_ptr<PeerLink>& link, const std::string& message) {
+        std::lock_guard<std::mutex> lock(link->batchMutex);
+        if (link->batch.empty()) {
+            std::weak_ptr<PeerLink> weakLink = link;
+            timingWheel.schedule(link->batchTimer, LINK_BATCH_INTERVAL_MS, [weakLink]() {
+                if (std::shared_ptr<PeerLink> link = weakLink.lock()) {
+                    std::lock_guard<std::mutex> lock(link->batchMutex);
+                    flushLocked(*link);
+                }
+            });
+        }
+        appendFrame(link->batch, message);
+        link->batchMessages++;
+        if (link->batch.size() >= LINK_BATCH_BYTES) {
+            timingWheel.cancel(link->batchTimer);
+            flushLocked(*link);
+        }
+    }
+
+    static void flushLocked(PeerLink& link) {
+        if (link.batch.empty()) {
+            return;
+        }
+        link.messagesSent += link.batchMessages;
+        link.bytesSent += link.batch.size();
+        link.writes++;
+        link.connection->send(std::make_shared<const std::string>(std::move(link.batch)));
+        link.batch.clear();
+        link.batchMessages = 0;
+    }
+
+    void scheduleDial(PeerAddress& peer, int delayMs) {
+        timingWheel.schedule(peer.retryTimer, delayMs, [this, &peer]() { dial(peer); });
+    }
+
+    // Reactor thread, from the retry timer
+    void dial(PeerAddress& peer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopped) {
+                return;
+            }
+            bool linked = peer.node == config.nodeName;
+            for (const std::shared_ptr<PeerLink>& link : links) {
+                linked = linked || (!peer.node.empty() && link->established && link->node == peer.node);
+            }
+            if (linked) {
+                scheduleDial(peer, LINK_RETRY_MS);
+                return;
+            }
+        }
+        connectNonBlocking(peer.resolved, [this, &peer](int socket) { dialed(peer, socket); });
+    }
+
+    // Reactor thread; socket is -1 when the peer could not be reached
+    void dialed(PeerAddress& peer, int socket) {
+        if (socket == -1) {
+            if (!peer.unreachableReported) {
+                std::cerr << "Could not reach peer " << peer.address << ", retrying every " << LINK_RETRY_MS << " ms." << std::endl;
+                peer.unreachableReported = true;
+            }
+            scheduleDial(peer, LINK_RETRY_MS);
+            return;
+        }
+        peer.unreachableReported = false;
+        startLink(socket, peer.address);
+    }
+
+    // Reactor thread
+    void startLink(int socket, const std::string& address) {
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        auto link = std::make_shared<PeerLink>();
+        link->connection = std::make_shared<Connection>(socket);
+        link->address = address;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopped) {
+                ::close(socket);
+                return;
+            }
+            links.push_back(link);
+        }
+        if (!reactor.add(socket, link->connection, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+            std::cerr << "Failed to register a link." << std::endl;
+            closed(link);
+            return;
+        }
+        peerLinkSession(link);
+    }
+
+    bool active = false;
+    bool stopped = false;  // guarded by mutex
+    int listenSocket = -1;
+    std::mutex mutex;
+    std::vector<std::shared_ptr<PeerLink>> links;
+    std::unordered_set<std::string> localInterests;
+    std::vector<std::unique_ptr<PeerAddress>> peers;
+    std::vector<std::pair<uint64_t, std::string>> ring;  // points sorted by hash, with their node
+    std::unordered_map<std::string, std::string> tokenHomes;
+    std::deque<std::string> tokenOrder;
+};
+
+Federation federation;
+
+// Prefork mode (--workers=N): a supervisor process forks N worker
+// processes, each a whole server with its own sessions and channels, all
+// accepting on the client port (SO_REUSEPORT). A worker that crashes only
+// takes its own connections down; the supervisor starts another in its place.
+//
+// What the workers share lives in one shared memory mapping made before the
+// fork. Two directories say which workers have members (or mailboxes) in a
+// channel and which have a client of a given nickname; names are 64-bit
+// hashes and each slot holds one bit per worker, so updates are single
+// atomic operations and never wait. Chat for a channel with members on
+// other workers goes to them over one single-producer, single-consumer ring
+// per pair of workers, with an eventfd to wake the reader. A worker that
+// dies half way through a write never published it.
+struct SharedSlot {
+    std::atomic<uint64_t> key;      // 0 while free, then the name's hash for good
+    std::atomic<uint64_t> workers;  // bit i: worker i has it
+};
+
+struct WorkerRing {
+    alignas(64) std::atomic<uint64_t> head;  // bytes read, by the receiving worker
+    alignas(64) std::atomic<uint64_t> tail;  // bytes written, by the sending worker
+    char data[WORKER_RING_BYTES];
+};
+
+// Followed by workerCount * workerCount rings, by sender then receiver
+struct alignas(64) SharedWorkerState {
+    SharedSlot channels[SHARED_DIRECTORY_SLOTS];
+    SharedSlot nicknames[SHARED_DIRECTORY_SLOTS];
+    std::atomic<uint64_t> restarts;
+
+    WorkerRing* rings() { return reinterpret_cast<WorkerRing*>(this + 1); }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the shared directories need lock-free 64-bit atomics");
+
+class Prefork {
+public:
+    bool enabled() const { return shared != nullptr; }
+
+    // Maps the shared state and forks the workers. Returns -1 in a worker,
+    // which goes on to run the server, and the exit code in the supervisor
+    // once every worker is gone.
+    int superviseWorkers(int count) {
+        workerCount = count;
+        size_t bytes = sizeof(SharedWorkerState) + sizeof(WorkerRing) * count * count;
+        void* mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Failed to map the workers' shared state: " << strerror(errno) << std::endl;
+            return 1;
+        }
+        // Zeroed by the kernel, which is the empty state of every atomic in it
+        shared = static_cast<SharedWorkerState*>(mapping);
+        for (int i = 0; i < count; i++) {
+            wakeFds.push_back(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+            if (wakeFds.back() == -1) {
+                std::cerr << "Failed to create the workers' eventfds." << std::endl;
+                return 1;
+            }
+        }
+
+        std::vector<pid_t> pids(count, -1);
+        for (int i = 0; i < count; i++) {
+            pids[i] = forkWorker(i);
+            if (pids[i] == 0) {
+                return -1;
+            }
+        }
+        std::cout << "Started " << count << " worker processes on port " << config.port << "." << std::endl;
+
+        int exitCode = 0;
+        bool stopping = false;
+        while (std::count(pids.begin(), pids.end(), -1) < count) {
+            if (exitServer && !stopping) {
+                stopping = true;
+                for (pid_t pid : pids) {
+                    if (pid != -1) {
+                        kill(pid, SIGINT);
+                    }
+                }
+            }
+            int status;
+            pid_t pid = waitpid(-1, &status, WNOHANG);
+            if (pid <= 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(WORKER_SUPERVISE_INTERVAL_MS));
+                continue;
+            }
+            int worker = std::find(pids.begin(), pids.end(), pid) - pids.begin();
+            if (worker == count) {
+                continue;
+            }
+            pids[worker] = -1;
+            forgetWorker(worker);
+            if (stopping) {
+                continue;
+            }
+            if (WIFEXITED(status)) {
+                // Not a crash: it could not start, and neither would a new one
+                std::cerr << "Worker " << worker << " exited with status " << WEXITSTATUS(status) << ", stopping." << std::endl;
+                exitCode = 1;
+                exitServer = true;
+                continue;
+            }
+            std::cerr << "Worker " << worker << " was killed by signal " << WTERMSIG(status)
+                      << "; its clients were disconnected, starting a new one." << std::endl;
+            shared->restarts++;
+            pids[worker] = forkWorker(worker);
+            if (pids[worker] == 0) {
+                return -1;
+            }
+        }
+        return exitCode;
+    }
+
+    // In a worker, once the reactor is running: wakes up for the rings
+    bool attach();
+
+    // Takes the ring's waiting messages to this worker
+    void drain() {
+        std::lock_guard<std::mutex> lock(drainMutex);
+        for (int sender = 0; sender < workerCount; sender++) {
+            WorkerRing& ring = ringBetween(sender, worker);
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            uint64_t tail = ring.tail.load(std::memory_order_acquire);
+            while (head != tail) {
+                uint32_t length;
+                copyOut(ring, head, reinterpret_cast<char*>(&length), sizeof(length));
+                std::string message(length, '\0');
+                copyOut(ring, head + sizeof(length), message.data(), length);
+                head += sizeof(length) + length;
+                // Read, so the sender may reuse the space before the message is handled
+                ring.head.store(head, std::memory_order_release);
+                handle(message);
+            }
+        }
+    }
+
+    // Called with the channel's roster lock held, like the federation's
+    void channelChanged(const std::string& channelName, bool wanted) {
+        if (!enabled()) {
+            return;
+        }
+        SharedSlot* slot = findSlot(shared->channels, channelName, wanted);
+        if (slot != nullptr && wanted) {
+            slot->workers.fetch_or(1ULL << worker);
+        } else if (slot != nullptr) {
+            slot->workers.fetch_and(~(1ULL << worker));
+        }
+    }
+
+    bool channelElsewhere(const std::string& channelName) {
+        return enabled() && (channelWorkers(channelName) & ~(1ULL << worker)) != 0;
+    }
+
+    // Local chat, already delivered here, for the other workers in the channel
+    void forward(const std::string& channelName, const std::string& sender, const std::string& text) {
+        if (!enabled()) {
+            return;
+        }
+        uint64_t targets = channelWorkers(channelName) & ~(1ULL << worker);
+        if (targets != 0) {
+            sendToWorkers(targets, encodeLinkMessage(LINK_CHAT, {channelName, sender, text}));
+        }
+    }
+
+    // Nicknames can repeat, so each worker counts its own clients per name
+    void publish(const ClientSession* session, const std::string& nickname) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(namesMutex);
+        auto known = sessionNames.find(session);
+        if (known != sessionNames.end() && known->second == nickname) {
+            return;
+        }
+        if (known != sessionNames.end()) {
+            releaseNameLocked(known->second);
+        }
+        sessionNames[session] = nickname;
+        if (nameCounts[nickname]++ == 0) {
+            if (SharedSlot* slot = findSlot(shared->nicknames, nickname, true)) {
+                slot->workers.fetch_or(1ULL << worker);
+            }
+        }
+    }
+
+    void withdraw(const ClientSession* session) {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(namesMutex);
+        auto known = sessionNames.find(session);
+        if (known != sessionNames.end()) {
+            releaseNameLocked(known->second);
+            sessionNames.erase(known);
+        }
+    }
+
+    // The lowest other worker with a client of that nickname, or -1
+    int workerWith(const std::string& nickname) {
+        if (!enabled()) {
+            return -1;
+        }
+        SharedSlot* slot = findSlot(shared->nicknames, nickname, false);
+        uint64_t workers = slot != nullptr ? slot->workers.load() & ~(1ULL << worker) : 0;
+        return workers != 0 ? std::countr_zero(workers) : -1;
+    }
+
+    // /kick, /mute or /unmute for clients of other workers; kicks only go to
+    // workers that also have the channel. False if there are none.
+    bool moderate(const std::string& action, const std::string& userName, const std::string& channelName, int durationSeconds) {
+        SharedSlot* slot = findSlot(shared->nicknames, userName, false);
+        uint64_t targets = slot != nullptr ? slot->workers.load() & ~(1ULL << worker) : 0;
+        if (action == KICK_COMMAND) {
+            targets &= channelWorkers(channelName);
+        }
+        if (targets != 0) {
+            sendToWorkers(targets, encodeLinkMessage(LINK_MODERATE, {action, userName, channelName, std::to_string(durationSeconds)}));
+        }
+        return targets != 0;
+    }
+
+    std::string stats() {
+        return "worker " + std::to_string(worker) + " of " + std::to_string(workerCount) + " (pid " + std::to_string(getpid()) +
+               "); chat " + std::to_string(chatSent.load()) + " messages sent to other workers, " + std::to_string(chatDropped.load()) +
+               " dropped on full rings, " + std::to_string(chatReceived.load()) + " received, " + std::to_string(chatBlocked.load()) +
+               " of those blocked here; " + std::to_string(slotsMissing.load()) + " names found no free directory slot; " +
+               std::to_string(shared->restarts.load()) + " workers restarted after crashing";
+    }
+
+private:
+    pid_t forkWorker(int index) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            worker = index;
+            // Don't outlive the supervisor
+            prctl(PR_SET_PDEATHSIG, SIGINT);
+        } else if (pid < 0) {
+            std::cerr << "Failed to start worker " << index << ": " << strerror(errno) << std::endl;
+        }
+        return pid;
+    }
+
+    // Supervisor, once the worker is gone: its names and unread messages go with it
+    void forgetWorker(int index) {
+        for (size_t i = 0; i < SHARED_DIRECTORY_SLOTS; i++) {
+            shared->channels[i].workers.fetch_and(~(1ULL << index));
+            shared->nicknames[i].workers.fetch_and(~(1ULL << index));
+        }
+        for (int sender = 0; sender < workerCount; sender++) {
+            WorkerRing& ring = ringBetween(sender, index);
+            ring.head.store(ring.tail.load());
+        }
+    }
+
+    // Open addressing over at most SHARED_DIRECTORY_PROBES slots. Slots are
+    // never given back, so a name keeps its slot once it has one.
+    // crowded tells a name that has no slot apart from one that has no room.
+    SharedSlot* findSlot(SharedSlot* table, const std::string& name, bool create, bool* crowded = nullptr) {
+        uint64_t key = ringHash(name) | 1;
+        for (size_t probe = 0; probe < SHARED_DIRECTORY_PROBES; probe++) {
+            SharedSlot& slot = table[(key + probe) % SHARED_DIRECTORY_SLOTS];
+            uint64_t current = slot.key.load(std::memory_order_acquire);
+            if (current == 0 && create) {
+                slot.key.compare_exchange_strong(current, key);
+                current = slot.key.load(std::memory_order_acquire);
+            }
+            if (current == key) {
+                return &slot;
+            }
+            if (current == 0) {
+                return nullptr;
+            }
+        }
+        if (create) {
+            slotsMissing++;
+        }
+        if (crowded != nullptr) {
+            *crowded = true;
+        }
+        return nullptr;
+    }
+
+    // A channel without a slot could be on any worker
+    uint64_t channelWorkers(const std::string& channelName) {
+        bool crowded = false;
+        SharedSlot* slot = findSlot(shared->channels, channelName, false, &crowded);
+        if (slot != nullptr) {
+            return slot->workers.load();
+        }
+        return crowded ? ~0ULL >> (MAX_WORKER_PROCESSES - workerCount) : 0;
+    }
+
+    void releaseNameLocked(const std::string& nickname) {
+        if (--nameCounts[nickname] > 0) {
+            return;
+        }
+        nameCounts.erase(nickname);
+        if (SharedSlot* slot = findSlot(shared->nicknames, nickname, false)) {
+            slot->workers.fetch_and(~(1ULL << worker));
+        }
+    }
+
+    WorkerRing& ringBetween(int sender, int receiver) { return shared->rings()[sender * workerCount + receiver]; }
+
+    static void copyIn(WorkerRing& ring, uint64_t position, const char* bytes, size_t length) {
+        size_t offset = position % WORKER_RING_BYTES;
+        size_t first = std::min(length, WORKER_RING_BYTES - offset);
+        memcpy(ring.data + offset, bytes, first);
+        memcpy(ring.data, bytes + first, length - first);
+    }
+
+    static void copyOut(WorkerRing& ring, uint64_t position, char* bytes, size_t length) {
+        size_t offset = position % WORKER_RING_BYTES;
+        size_t first = std::min(length, WORKER_RING_BYTES - offset);
+        memcpy(bytes, ring.data + offset, first);
+        memcpy(bytes + first, ring.data, length - first);
+    }
+
+    // The shared rings have one writer each: this process's threads take
+    // turns on sendMutex
+    void sendToWorkers(uint64_t targets, const std::string& message) {
+        uint32_t length = message.size();
+        for (int receiver = 0; receiver < workerCount; receiver++) {
+            if ((targets & (1ULL << receiver)) == 0) {
+                continue;
+            }
+            WorkerRing& ring = ringBetween(worker, receiver);
+            {
+                std::lock_guard<std::mutex> lock(sendMutex);
+                uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+                if (tail - ring.head.load(std::memory_order_acquire) + sizeof(length) + length > WORKER_RING_BYTES) {
+                    chatDropped++;
+                    continue;
+                }
+                copyIn(ring, tail, reinterpret_cast<const char*>(&length), sizeof(length));
+                copyIn(ring, tail + sizeof(length), message.data(), length);
+                ring.tail.store(tail + sizeof(length) + length, std::memory_order_release);
+            }
+            chatSent++;
+            uint64_t one = 1;
+            ssize_t ignored = write(wakeFds[receiver], &one, sizeof(one));
+            (void)ignored;
+        }
+    }
+
+    void handle(const std::string& message) {
+        std::string kind;
+        std::vector<std::string> fields;
+        if (!decodeLinkMessage(message, kind, fields)) {
+            return;
+        }
+        if (kind == LINK_CHAT && fields.size() == 3) {
+            chatReceived++;
+            deliverPeerChat(fields[0], fields[1], fields[2], chatBlocked);
+        } else if (kind == LINK_MODERATE && fields.size() == 4) {
+            applyModeration(fields[0], fields[1], fields[2], atoi(fields[3].c_str()));
+        }
+    }
+
+    SharedWorkerState* shared = nullptr;
+    int workerCount = 0;
+    int worker = 0;  // this process's index
+    std::vector<int> wakeFds;  // one per worker, made before the fork
+    std::mutex sendMutex;
+    std::mutex drainMutex;
+    std::mutex namesMutex;
+    std::unordered_map<const ClientSession*, std::string> sessionNames;
+    std::unordered_map<std::string, int> nameCounts;
+    std::atomic<uint64_t> chatSent{0};
+    std::atomic<uint64_t> chatDropped{0};
+    std::atomic<uint64_t> chatReceived{0};
+    std::atomic<uint64_t> chatBlocked{0};
+    std::atomic<uint64_t> slotsMissing{0};
+};
+
+Prefork prefork;
+
+// Reactor handler for this worker's eventfd
+class WorkerRingListener : public ReactorHandler {
+public:
+    explicit WorkerRingListener(int wakeFd) : wakeFd(wakeFd) {}
+
+    void onEvents(uint32_t) override {
+        uint64_t count;
+        ssize_t ignored = read(wakeFd, &count, sizeof(count));
+        (void)ignored;
+        workerPool.submit([]() { prefork.drain(); });
+    }
+
+private:
+    int wakeFd;
+};
+
+bool Prefork::attach() {
+    // Anything sent while the worker was starting is waiting already
+    if (!reactor.add(wakeFds[worker], std::make_shared<WorkerRingListener>(wakeFds[worker]), EPOLLIN)) {
+        return false;
+    }
+    workerPool.submit([]() { prefork.drain(); });
+    return true;
+}
+
+bool channelOnOtherWorker(const std::string& channelName) {
+    return prefork.channelElsewhere(channelName);
+}
+
+void channelInterestChanged(const std::string& channelName, bool wanted) {
+    federation.interestChanged(channelName, wanted);
+    prefork.channelChanged(channelName, wanted);
+}
+
+// One coroutine per link, like a client's session. It never waits for its
+// own writes: two nodes stuck waiting for each other would stop both links.
+SessionTask peerLinkSession(std::shared_ptr<PeerLink> link) {
+    co_await ResumeOnWorkerPool{};
+    link->connection->send(encodeFrame(encodeLinkMessage(LINK_HELLO, {config.nodeName, std::to_string(config.port)})));
+    int framesThisTurn = 0;
+    while (true) {
+        if (++framesThisTurn == SESSION_FRAMES_PER_TURN) {
+            framesThisTurn = 0;
+            co_await YieldWorker{};
+        }
+        std::optional<std::string> message = co_await link->connection->read_frame();
+        if (!message) {
+            break;
+        }
+        if (!federation.handle(link, *message)) {
+            std::cerr << "Closing a link after a message we don't understand." << std::endl;
+            break;
+        }
+    }
+    federation.closed(link);
+}
+
+// A client's session that lives on its channel's home node. This node only
+// relays frames between the client and its own connection to that node,
+// where it looks like any other client.
+struct HomeProxy {
+    std::shared_ptr<Connection> connection;
+    std::string node;
+    std::string nickname;  // chosen through the relay, taken along to the next home
+    std::atomic<bool> current{true};  // false once the session has moved on
+};
+
+// co_await this on a pool worker to connect without holding the worker while
+// the connect() is under way; it resumes on a worker with the socket, or -1
+struct ConnectOnReactor {
+    sockaddr_in address;
+    int socket = -1;
+
+    bool await_ready() { return false; }
+    void await_suspend(std::coroutine_handle<> handle) {
+        reactor.post([this, handle]() {
+            connectNonBlocking(address, [this, handle](int connected) {
+                socket = connected;
+                resumeOnWorkerPool(handle);
+            });
+        });
+    }
+    int await_resume() { return socket; }
+};
+
+// Introduces the relay on a socket connected to the home node's port for clients
+std::shared_ptr<HomeProxy> openHomeProxy(const std::string& node, int socket) {
+    int noDelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    auto proxy = std::make_shared<HomeProxy>();
+    proxy->connection = std::make_shared<Connection>(socket);
+    proxy->node = node;
+    proxy->connection->send(encodeFrame(PROXY_COMMAND + " " + config.nodeName));
+    std::shared_ptr<Connection> connection = proxy->connection;
+    reactor.post([connection]() {
+        if (!reactor.add(connection->socket, connection, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+            connection->shutdown();
+            connection->onEvents(EPOLLHUP);
+        }
+    });
+    federation.relaysActive++;
+    federation.relaysOpened++;
+    return proxy;
+}
+
+// Passes what the home node sends on to the client. The home's welcome is
+// dropped (the client had ours), and so is anything after the session moved on.
+SessionTask homeProxyReader(std::shared_ptr<ClientSession> session, std::shared_ptr<HomeProxy> proxy) {
+    co_await ResumeOnWorkerPool{};
+    bool welcomed = false;
+    int framesThisTurn = 0;
+    while (true) {
+        if (++framesThisTurn == SESSION_FRAMES_PER_TURN) {
+            framesThisTurn = 0;
+            co_await YieldWorker{};
+        }
+        std::optional<std::string> frame = co_await proxy->connection->read_frame();
+        if (!frame) {
+            break;
+        }
+        if (!welcomed || !proxy->current) {
+            welcomed = true;
+            continue;
+        }
+        if (frame->rfind(TOKEN_PREFIX, 0) == 0) {
+            federation.rememberToken(frame->substr(TOKEN_PREFIX.size()), proxy->node);
+        }
+        session->connection->send(encodeFrame(*frame), frame->rfind(SEQUENCE_PREFIX, 0) == 0);
+    }
+    federation.relaysActive--;
+    if (proxy->current) {
+        std::cout << "Node " << proxy->node << " ended the session of " << session->clientName << "." << std::endl;
+        session->connection->shutdown();
+    }
+    std::shared_ptr<Connection> connection = proxy->connection;
+    reactor.post([connection]() { connection->close(); });
+}
+
+// Nicknames on all the linked nodes. Each node lists its own clients that
+// picked a nickname, with their channel, and only it changes that table;
+// every change goes straight to all links, numbered per node. A node that
+// missed a change, or was linked later, catches up with the digests (the
+// tables' versions) traded with a random peer every
+// DIRECTORY_GOSSIP_INTERVAL_MS: whichever side is behind on a table gets it
+// whole, from whoever has it. /whois, /kick and /mute then find users on
+// other nodes here, without asking anyone.
+class NicknameDirectory {
+public:
+    struct Entry {
+        std::string nickname;
+        std::string channelName;  // empty outside a channel
+    };
+
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex);
+        incarnation = systemMilliseconds();
+        origins[config.nodeName].incarnation = incarnation;
+        active = true;
+        scheduleGossip();
+    }
+
+    void publish(const ClientSession* session, const std::string& nickname, const std::string& channelName) {
+        if (!active) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t& id = localIds[session];
+        if (id == 0) {
+            id = ++nextId;
+        }
+        Origin& self = origins[config.nodeName];
+        auto found = self.entries.find(id);
+        if (found != self.entries.end() && found->second.nickname == nickname && found->second.channelName == channelName) {
+            return;
+        }
+        self.entries[id] = {nickname, channelName};
+        changedLocked(id, &self.entries[id]);
+    }
+
+    // Keeps the nickname; sessions that aren't listed are left out
+    void moved(const ClientSession* session, const std::string& channelName) {
+        if (!active) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto id = localIds.find(session);
+        if (id == localIds.end()) {
+            return;
+        }
+        Entry& entry = origins[config.nodeName].entries[id->second];
+        if (entry.channelName != channelName) {
+            entry.channelName = channelName;
+            changedLocked(id->second, &entry);
+        }
+    }
+
+    void withdraw(const ClientSession* session) {
+        if (!active) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        auto id = localIds.find(session);
+        if (id == localIds.end()) {
+            return;
+        }
+        origins[config.nodeName].entries.erase(id->second);
+        changedLocked(id->second, nullptr);
+        localIds.erase(id);
+    }
+
+    // The nodes other than this one with a client of that nickname
+    std::vector<std::pair<std::string, Entry>> find(const std::string& nickname) {
+        std::vector<std::pair<std::string, Entry>> found;
+        if (!active) {
+            return found;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        lookups++;
+        auto listed = byNickname.find(nickname);
+        if (listed == byNickname.end()) {
+            return found;
+        }
+        for (const auto& [node, id] : listed->second) {
+            found.emplace_back(node, origins[node].entries[id]);
+        }
+        return found;
+    }
+
+    // A directory frame from a peer; false if it makes no sense
+    bool handle(const std::shared_ptr<PeerLink>& link, const std::string& kind, const std::vector<std::string>& fields) {
+        auto number = [](const std::string& text) { return (uint64_t)strtoull(text.c_str(), nullptr, 10); };
+        std::lock_guard<std::mutex> lock(mutex);
+        if (kind == LINK_DIRECTORY_UPDATE && fields.size() == 7) {
+            const std::string& node = fields[0];
+            uint64_t nodeIncarnation = number(fields[1]), version = number(fields[2]);
+            if (node == config.nodeName) {
+                return true;
+            }
+            Origin& origin = originLocked(node);
+            if (nodeIncarnation != origin.incarnation || version != origin.version + 1) {
+                // Missed something: the digests will bring the whole table
+                if (nodeIncarnation > origin.incarnation || (nodeIncarnation == origin.incarnation && version > origin.version)) {
+                    sendDigestLocked(link, false);
+                }
+                return true;
+            }
+            origin.version = version;
+            uint64_t id = number(fields[3]);
+            unindexLocked(node, id);
+            if (fields[6] == "1") {
+                origin.entries[id] = {fields[4], fields[5]};
+                byNickname[fields[4]].insert({node, id});
+            } else {
+                origin.entries.erase(id);
+            }
+            updatesApplied++;
+            return true;
+        }
+        if (kind == LINK_DIRECTORY_DIGEST && fields.size() % 3 == 1) {
+            std::map<std::string, std::pair<uint64_t, uint64_t>> theirs;
+            for (size_t i = 1; i < fields.size(); i += 3) {
+                theirs[fields[i]] = {number(fields[i + 1]), number(fields[i + 2])};
+            }
+            for (const auto& [node, origin] : origins) {
+                auto known = theirs.find(node);
+                if (origin.incarnation != 0 && (known == theirs.end() || std::make_pair(origin.incarnation, origin.version) > known->second)) {
+                    sendTableLocked(link, node, origin);
+                }
+            }
+            // Push-pull: answer a digest with ours, so the asker can send what we lack
+            if (fields[0] == "0") {
+                sendDigestLocked(link, true);
+            }
+            return true;
+        }
+        if (kind == LINK_DIRECTORY_TABLE && fields.size() >= 5 && (fields.size() - 5) % 3 == 0) {
+            const std::string& node = fields[0];
+            uint64_t nodeIncarnation = number(fields[1]), version = number(fields[2]);
+            uint64_t part = number(fields[3]), parts = number(fields[4]);
+            if (node == config.nodeName) {
+                return true;
+            }
+            // A table comes in parts, one after the other on the same link
+            PartialTable& partial = partialTables[{link.get(), node}];
+            if (part == 0) {
+                partial = PartialTable{nodeIncarnation, version, {}};
+            } else if (partial.incarnation != nodeIncarnation || partial.version != version) {
+                return true;
+            }
+            for (size_t i = 5; i < fields.size(); i += 3) {
+                partial.entries[number(fields[i])] = {fields[i + 1], fields[i + 2]};
+            }
+            if (part + 1 < parts) {
+                return true;
+            }
+            Origin& origin = originLocked(node);
+            if (std::make_pair(nodeIncarnation, version) > std::make_pair(origin.incarnation, origin.version)) {
+                for (const auto& [id, entry] : origin.entries) {
+                    unindexLocked(node, id);
+                }
+                origin.incarnation = nodeIncarnation;
+                origin.version = version;
+                origin.entries = std::move(partial.entries);
+                for (const auto& [id, entry] : origin.entries) {
+                    byNickname[entry.nickname].insert({node, id});
+                }
+                tablesApplied++;
+            }
+            partialTables.erase({link.get(), node});
+            return true;
+        }
+        return false;
+    }
+
+    // A new link catches up right away instead of at the next gossip round
+    void linked(const std::shared_ptr<PeerLink>& link) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sendDigestLocked(link, false);
+    }
+
+    std::string stats() {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t entries = 0;
+        for (const auto& [node, origin] : origins) {
+            entries += origin.entries.size();
+        }
+        return std::to_string(entries) + " nicknames on " + std::to_string(origins.size()) + " nodes, " +
+               std::to_string(lookups) + " lookups; " + std::to_string(updatesSent) + " changes sent, " +
+               std::to_string(updatesApplied) + " applied from peers, " + std::to_string(tablesSent) + " tables sent, " +
+               std::to_string(tablesApplied) + " applied, " + std::to_string(nodesForgotten) + " unreachable nodes forgotten";
+    }
+
+private:
+    struct Origin {
+        uint64_t incarnation = 0;  // when the node started; a restarted node's table starts over
+        uint64_t version = 0;      // changes made since
+        std::map<uint64_t, Entry> entries;  // by the node's own session numbers
+        uint64_t lastLinkedMs = 0;
+    };
+
+    struct PartialTable {
+        uint64_t incarnation = 0;
+        uint64_t version = 0;
+        std::map<uint64_t, Entry> entries;
+    };
+
+    Origin& originLocked(const std::string& node) {
+        Origin& origin = origins[node];
+        if (origin.lastLinkedMs == 0) {
+            origin.lastLinkedMs = steadyMilliseconds();
+        }
+        return origin;
+    }
+
+    void unindexLocked(const std::string& node, uint64_t id) {
+        const std::map<uint64_t, Entry>& entries = origins[node].entries;
+        auto entry = entries.find(id);
+        if (entry == entries.end()) {
+            return;
+        }
+        auto listed = byNickname.find(entry->second.nickname);
+        listed->second.erase({node, id});
+        if (listed->second.empty()) {
+            byNickname.erase(listed);
+        }
+    }
+
+    void changedLocked(uint64_t id, const Entry* entry) {
+        Origin& self = origins[config.nodeName];
+        self.version++;
+        federation.broadcast(encodeLinkMessage(LINK_DIRECTORY_UPDATE,
+                                               {config.nodeName, std::to_string(incarnation), std::to_string(self.version), std::to_string(id),
+                                                entry != nullptr ? entry->nickname : "", entry != nullptr ? entry->channelName : "",
+                                                entry != nullptr ? "1" : "0"}));
+        updatesSent++;
+    }
+
+    void sendDigestLocked(const std::shared_ptr<PeerLink>& link, bool reply) {
+        std::vector<std::string> fields = {reply ? "1" : "0"};
+        for (const auto& [node, origin] : origins) {
+            if (origin.incarnation != 0) {
+                fields.insert(fields.end(), {node, std::to_string(origin.incarnation), std::to_string(origin.version)});
+            }
+        }
+        federation.sendTo(link, encodeLinkMessage(LINK_DIRECTORY_DIGEST, fields));
+    }
+
+    // In parts of about DIRECTORY_TABLE_PART_BYTES, each one link frame
+    void sendTableLocked(const std::shared_ptr<PeerLink>& link, const std::string& node, const Origin& origin) {
+        std::vector<std::vector<std::string>> parts(1);
+        size_t partBytes = 0;
+        for (const auto& [id, entry] : origin.entries) {
+            if (partBytes > DIRECTORY_TABLE_PART_BYTES) {
+                parts.emplace_back();
+                partBytes = 0;
+            }
+            parts.back().insert(parts.back().end(), {std::to_string(id), entry.nickname, entry.channelName});
+            partBytes += entry.nickname.size() + entry.channelName.size() + 32;
+        }
+        for (size_t i = 0; i < parts.size(); i++) {
+            std::vector<std::string> fields = {node, std::to_string(origin.incarnation), std::to_string(origin.version),
+                                               std::to_string(i), std::to_string(parts.size())};
+            fields.insert(fields.end(), parts[i].begin(), parts[i].end());
+            federation.sendTo(link, encodeLinkMessage(LINK_DIRECTORY_TABLE, fields));
+        }
+        tablesSent++;
+    }
+
+    void scheduleGossip() {
+        timingWheel.schedule(gossipTimer, DIRECTORY_GOSSIP_INTERVAL_MS, [this]() {
+            workerPool.submit([this]() { gossip(); });
+        });
+    }
+
+    // Trades digests with one random peer, and forgets the tables of nodes
+    // we have had no link to for DIRECTORY_FORGET_MS (a node that comes back
+    // sends a new table anyway)
+    void gossip() {
+        std::shared_ptr<PeerLink> link = federation.randomLink();
+        std::lock_guard<std::mutex> lock(mutex);
+        uint64_t nowMs = steadyMilliseconds();
+        for (auto origin = origins.begin(); origin != origins.end();) {
+            if (origin->first == config.nodeName || federation.linkedTo(origin->first)) {
+                origin->second.lastLinkedMs = nowMs;
+            } else if (nowMs - origin->second.lastLinkedMs > (uint64_t)DIRECTORY_FORGET_MS) {
+                for (const auto& [id, entry] : origin->second.entries) {
+                    unindexLocked(origin->first, id);
+                }
+                origin = origins.erase(origin);
+                nodesForgotten++;
+                continue;
+            }
+            ++origin;
+        }
+        if (link != nullptr) {
+            sendDigestLocked(link, false);
+        }
+        scheduleGossip();
+    }
+
+    bool active = false;
+    std::mutex mutex;
+    uint64_t incarnation = 0;
+    uint64_t nextId = 0;
+    std::unordered_map<const ClientSession*, uint64_t> localIds;
+    std::map<std::string, Origin> origins;
+    std::unordered_map<std::string, std::set<std::pair<std::string, uint64_t>>> byNickname;  // other nodes only
+    std::map<std::pair<const PeerLink*, std::string>, PartialTable> partialTables;
+    Timer gossipTimer;
+    uint64_t lookups = 0;
+    uint64_t updatesSent = 0;
+    uint64_t updatesApplied = 0;
+    uint64_t tablesSent = 0;
+    uint64_t tablesApplied = 0;
+    uint64_t nodesForgotten = 0;
+};
+
+NicknameDirectory nicknameDirectory;
+
+void directoryPublish(const ClientSession* session, const std::string& nickname, const std::string& channelName) {
+    nicknameDirectory.publish(session, nickname, channelName);
+    prefork.publish(session, nickname);
+}
+
+void directoryMoved(const ClientSession* session, const std::string& channelName) {
+    nicknameDirectory.moved(session, channelName);
+}
+
+void directoryWithdraw(const ClientSession* session) {
+    nicknameDirectory.withdraw(session);
+    prefork.withdraw(session);
+}
+
+bool handleDirectoryMessage(const std::shared_ptr<PeerLink>& link, const std::string& kind, const std::vector<std::string>& fields) {
+    return nicknameDirectory.handle(link, kind, fields);
+}
+
+void directoryLinked(const std::shared_ptr<PeerLink>& link) {
+    nicknameDirectory.linked(link);
+}
+
+// Takes a member out of the channel on /kick
+void kickMember(Channel* channel, const std::string& channelName, const std::shared_ptr<ClientSession>& user, const std::string& userName) {
+    removeFromChannel(channel, user.get());
+    broadcastPresence(channel, channelName, userName, userName + " left the channel " + channelName + ".");
+    directoryMoved(user.get(), "");
+    sendMessage(*user->connection, "You were kicked of the channel " + channelName + " by an administrator.");
+}
+
+void muteUser(const std::shared_ptr<ClientSession>& user, bool muted, const std::string& channelName, int durationSeconds) {
+    if (!setMuted(user, muted, channelName, durationSeconds * 1000)) {
+        return;
+    }
+    std::string duration = durationSeconds > 0 ? " for " + std::to_string(durationSeconds) + " seconds" : "";
+    sendMessage(*user->connection, muted ? "You were muted on the channel " + channelName + " by an administrator" + duration + "."
+                                         : "You were unmuted on the channel " + channelName + " by an administrator.");
+}
+
+// /kick, /mute or /unmute from a channel owner on another node, for a
+// client of this one that its directory listed there
+void applyModeration(const std::string& action, const std::string& userName, const std::string& channelName, int durationSeconds) {
+    std::shared_ptr<ClientSession> user = findClient(userName);
+    if (user == nullptr) {
+        return;
+    }
+    if (action == KICK_COMMAND) {
+        Channel* channel = findChannel(channelName);
+        if (channel != nullptr && isChannelMember(channel, user.get())) {
+            kickMember(channel, channelName, user, userName);
+        }
+    } else {
+        muteUser(user, action == MUTE_COMMAND, channelName, durationSeconds);
+    }
+}
+
+// Sends the moderation to the node the directory has the user on, or to
+// the other worker processes with the user. Kicks only reach someone in the
+// same channel. False if there is no such node.
+bool moderateRemotely(const std::string& action, const std::string& userName, const std::string& channelName, int durationSeconds) {
+    if (prefork.enabled()) {
+        return prefork.moderate(action, userName, channelName, durationSeconds);
+    }
+    for (const auto& [node, entry] : nicknameDirectory.find(userName)) {
+        if (action != KICK_COMMAND || entry.channelName == channelName) {
+            return federation.sendToNode(node, encodeLinkMessage(LINK_MODERATE, {action, userName, channelName, std::to_string(durationSeconds)}));
+        }
+    }
+    return false;
+}
+
+// Reactor handler for the link port
+class LinkListener : public ReactorHandler {
+public:
+    explicit LinkListener(int socket) : socket(socket) {}
+
+    void onEvents(uint32_t) override {
+        while (true) {
+            int linkSocket = accept4(socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (linkSocket < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            federation.accept(linkSocket);
+        }
+    }
+
+private:
+    int socket;
+};
+
+bool Federation::start() {
+    if (config.nodeName.empty()) {
+        config.nodeName = "node-" + std::to_string(config.port);
+    }
+    if (config.linkPort > 0) {
+        listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int reuseAddress = 1;
+        setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(config.linkPort);
+        if (listenSocket == -1 || bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+            listen(listenSocket, SOMAXCONN) < 0 || !reactor.add(listenSocket, std::make_shared<LinkListener>(listenSocket), EPOLLIN)) {
+            std::cerr << "Failed to listen for links on port " << config.linkPort << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+    }
+    active = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        rebuildRingLocked();
+    }
+    nicknameDirectory.start();
+    std::stringstream addresses(config.peers);
+    for (std::string address; std::getline(addresses, address, ',');) {
+        if (address.empty()) {
+            continue;
+        }
+        auto peer = std::make_unique<PeerAddress>();
+        peer->address = address;
+        if (!resolve(address, peer->resolved)) {
+            std::cerr << "Could not resolve peer " << address << "." << std::endl;
+            continue;
+        }
+        scheduleDial(*peer, 0);
+        peers.push_back(std::move(peer));
+    }
+    std::cout << "Node " << config.nodeName << " links to " << peers.size() << " peers"
+              << (config.linkPort > 0 ? " and accepts links on port " + std::to_string(config.linkPort) : "") << "." << std::endl;
+    return true;
+}
+
+
+// Runs one decoded client message on behalf of the session coroutine
+void handleClientMessage(const std::shared_ptr<ClientSession>& session, const std::string& receivedMessage) {
+    Connection& connection = *session->connection;
+    std::string& clientName = session->clientName;
+    std::string& currentChannel = session->currentChannel;
+    Channel*& channel = session->channel;
+    bool& isChannelOwner = session->isChannelOwner;
+
+    // Check if the client wants to ping the server
+    if (receivedMessage == PING_COMMAND) {
+        sendMessage(connection, PONG_MESSAGE);
+        return;
+    }
+
+    // A message the client may send again if the ack is slow: handled the
+    // first time, only acked after that. One turned away for now is not
+    // marked as seen and gets a retry answer instead of the ack.
+    if (receivedMessage.rfind(MESSAGE_ID_PREFIX, 0) == 0) {
+        size_t end = receivedMessage.find(' ', MESSAGE_ID_PREFIX.size());
+        std::string id = receivedMessage.substr(MESSAGE_ID_PREFIX.size(), end - MESSAGE_ID_PREFIX.size());
+        uint64_t messageId;
+        try {
+            messageId = std::stoull(id);
+        } catch (const std::exception&) {
+            sendMessage(connection, "Usage: /id <number> <message>");
+            return;
+        }
+        bool firstTime;
+        {
+            std::lock_guard<std::mutex> lock(session->dedupMutex);
+            firstTime = session->dedup.firstTime(messageId);
+        }
+        session->refused = false;
+        if (!firstTime) {
+            chatDuplicatesDropped++;
+        } else if (end != std::string::npos && end + 1 < receivedMessage.size()) {
+            handleClientMessage(session, receivedMessage.substr(end + 1));
+        }
+        if (session->refused) {
+            std::lock_guard<std::mutex> lock(session->dedupMutex);
+            session->dedup.forget(messageId);
+        }
+        sendMessage(connection, (session->refused ? RETRY_PREFIX : ACK_PREFIX) + id);
+        return;
+    }
+
+    // Check if the client wants the server statistics
+    if (receivedMessage == STATS_COMMAND) {
+        std::string stats = workerPool.stats() + "\nTimers armed: " + std::to_string(timingWheel.pendingTimers()) +
+                            "\nChat messages: " + std::to_string(chatMessagesAccepted.load()) + " accepted, " +
+                            std::to_string(chatRejectedBySession.load()) + " over the client limit, " +
+                            std::to_string(chatRejectedByChannel.load()) + " over the channel limit, " +
+                            std::to_string(chatDuplicatesDropped.load()) + " retries dropped as duplicates" +
+                            "\nOverload: " + workerPool.overloadStats() + "; " + std::to_string(laggingClients.load()) +
+                            " lagging clients, " + std::to_string(chatDroppedForLaggingClients.load()) + " chat messages dropped for them, " +
+                            std::to_string(acceptsDeferred.load()) + " accepts deferred, " + std::to_string(joinsRejected.load()) + " joins rejected" +
+                            "\nPresence: " + std::to_string(presenceConflated.load()) + " notices replaced by newer ones, " +
+                            std::to_string(presenceSuppressed.load()) + " left out for backlogged clients" +
+                            "\nHistory: " + std::to_string(historyFramesTotal.load()) + " messages, " +
+                            std::to_string(historyBytesTotal.load()) + " bytes kept for replay" +
+                            (messageLog.enabled() ? "\nLog: " + messageLog.stats() : "") +
+                            "\nMailboxes: " + mailboxStats() +
+                            "\nKeywords: " + keywordMatcher.stats() +
+                            (config.snapshotPath.empty() ? "" : "\nSnapshot: " + snapshotStats()) +
+                            (federation.enabled() ? "\nFederation: " + federation.stats() + "\nDirectory: " + nicknameDirectory.stats() : "") +
+                            (prefork.enabled() ? "\nWorkers: " + prefork.stats() : "") +
+                            "\nFanout: " + fanoutScheduler.stats() + channelFanoutStats();
+        sendMessage(connection, stats);
+        return;
+    }
+
+    //Leaves the channel; a node relaying this client sends it before moving the session elsewhere
+    if(receivedMessage == LEAVE_COMMAND){
+        if(channel == nullptr){
+            sendMessage(connection, "Join a channel first.");
+            return;
+        }
+        std::string channelName = currentChannel;
+        leaveChannel(session);
+        sendMessage(connection, "You left the channel " + channelName + ".");
+        return;
+    }
+
+    //Another node relays this client here, its channel's home; it is never relayed on
+    if(receivedMessage.rfind(PROXY_COMMAND + " ", 0) == 0){
+        session->relayed = true;
+        return;
+    }
+
+    //Check if the client wants to add Nickname
+    if(receivedMessage.rfind(NICKNAME_COMMAND, 0) == 0) {
+        setNickname(session, receivedMessage.substr(10));
+        return;
+    }
+
+    //Nickname, resume token and join in one frame, answered with one write
+    if(receivedMessage.rfind(REGISTER_COMMAND + " ", 0) == 0) {
+        std::string arguments = receivedMessage.substr(REGISTER_COMMAND.size() + 1);
+        size_t space = arguments.rfind(' ');
+        if (space == std::string::npos || space == 0 || space + 1 == arguments.size()) {
+            sendMessage(connection, "Usage: /register <nickname> <channel>");
+            return;
+        }
+        if (workerPool.overloaded()) {
+            joinsRejected++;
+            session->refused = true;
+            sendMessage(connection, "The server is busy, please try joining again in a moment.");
+            return;
+        }
+        setNickname(session, arguments.substr(0, space));
+        enterChannel(session, arguments.substr(space + 1),
+                     {encodeFrame(TOKEN_PREFIX + issueResumeToken(session)), encodeFrame("Your nickname is now " + clientName + ".")});
+        return;
+    }
+
+    //Check if the client wants to join/create a channel
+    if(receivedMessage.rfind(JOIN_COMMAND, 0) == 0) {
+        std::string channelName = receivedMessage.substr(6);
+        if (workerPool.overloaded()) {
+            joinsRejected++;
+            session->refused = true;
+            sendMessage(connection, "The server is busy, please try joining again in a moment.");
+            return;
+        }
+        enterChannel(session, channelName, {});
+        return;
+
+    }
+
+    //If user wants to kick another user from the channel
+    if(receivedMessage.rfind(KICK_COMMAND, 0) == 0){
+        //Checks if he is administrator
+        if(isChannelOwner){
+            std::string userName = receivedMessage.substr(6);
+            
+            //Searches for the user in all the clients, then in the other nodes' nicknames
+            std::shared_ptr<ClientSession> user = findClient(userName);
+            if(channel == nullptr || (user != nullptr && !isChannelMember(channel, user.get())) ||
+               (user == nullptr && !moderateRemotely(KICK_COMMAND, userName, currentChannel, 0))){
+                std::string userMessage = "User not found.";
+                sendMessage(connection, userMessage);
+                return;
+            }
+
+            //Disconnects the user 
+            if(user != nullptr){
+                kickMember(channel, currentChannel, user, userName);
+            }
+
+            std::string userMessage = "User " + userName + " was kicked.";
+            sendMessage(connection, userMessage);
+            return;
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+            return;
+        }
+    }
+
+
+    //If user wants to mute another user from the channel
+    if(receivedMessage.rfind(MUTE_COMMAND, 0) == 0){
+        //Checks if he is administrator
+        if(isChannelOwner){
+            std::string userName = receivedMessage.substr(6);
+            
+            //Searches for the user in all the clients
+            std::shared_ptr<ClientSession> user = findClient(userName);
+
+            //An optional trailing number of seconds makes the mute temporary
+            int durationSeconds = 0;
+            size_t lastSpace = userName.rfind(' ');
+            if(user == nullptr && lastSpace != std::string::npos && lastSpace + 1 < userName.size() &&
+               userName.find_first_not_of("0123456789", lastSpace + 1) == std::string::npos){
+                durationSeconds = std::stoi(userName.substr(lastSpace + 1));
+                userName = userName.substr(0, lastSpace);
+                user = findClient(userName);
+            }
+            if(user == nullptr && !moderateRemotely(MUTE_COMMAND, userName, currentChannel, durationSeconds)){
+                std::string userMessage = "User not found.";
+                sendMessage(connection, userMessage);
+                return;
+            }
+            if(user != nullptr){
+                muteUser(user, true, currentChannel, durationSeconds);
+            }
+
+            std::string duration = durationSeconds > 0 ? " for " + std::to_string(durationSeconds) + " seconds" : "";
+            std::string userMessage = "User " + userName + " was muted" + duration + ".";
+            sendMessage(connection, userMessage);
+            return;
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+            return;
+        }
+    }
+
+    //If user wants to unmute another user from the channel
+    if(receivedMessage.rfind(UNMUTE_COMMAND, 0) == 0){
+        //Checks if he is administrator
+        if(isChannelOwner){
+            std::string userName = receivedMessage.substr(8);
+            
+            //Searches for the user in all the clients
+            std::shared_ptr<ClientSession> user = findClient(userName);
+            if(user == nullptr && !moderateRemotely(UNMUTE_COMMAND, userName, currentChannel, 0)){
+                std::string userMessage = "User not found.";
+                sendMessage(connection, userMessage);
+                return;
+            }
+            if(user != nullptr){
+                muteUser(user, false, currentChannel, 0);
+            }
+
+            std::string userMessage = "User " + userName + " was unmuted.";
+            sendMessage(connection, userMessage);
+            return;
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+            return;
+        }
+    }
+
+    //If the channel administrator wants to change the channel's message rate limit
+    if(receivedMessage.rfind(RATE_LIMIT_COMMAND, 0) == 0){
+        if(isChannelOwner && channel != nullptr){
+            std::istringstream arguments(receivedMessage.substr(RATE_LIMIT_COMMAND.size()));
+            double rate, burst;
+            if(!(arguments >> rate >> burst) || rate <= 0 || burst < 1){
+                sendMessage(connection, "Usage: /ratelimit <messages per second> <burst>");
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(channel->rateLimitMutex);
+                channel->rateLimit.configure(rate, burst);
+            }
+            std::ostringstream reply;
+            reply << "Channel " << currentChannel << " now allows " << rate << " messages per second, bursts of " << burst << ".";
+            sendMessage(connection, reply.str());
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+        }
+        return;
+    }
+
+    //If the channel administrator wants to change the channel's share of fanout
+    if(receivedMessage.rfind(WEIGHT_COMMAND, 0) == 0){
+        if(isChannelOwner && channel != nullptr){
+            std::istringstream arguments(receivedMessage.substr(WEIGHT_COMMAND.size()));
+            int weight;
+            if(!(arguments >> weight) || weight < 1 || weight > MAX_CHANNEL_WEIGHT){
+                sendMessage(connection, "Usage: /weight <1-" + std::to_string(MAX_CHANNEL_WEIGHT) + ">");
+                return;
+            }
+            fanoutScheduler.setWeight(channel, weight);
+            sendMessage(connection, "Channel " + currentChannel + " now has fanout weight " + std::to_string(weight) + ".");
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+        }
+        return;
+    }
+
+    //If the channel administrator wants messages sent in batches
+    if(receivedMessage.rfind(BATCH_COMMAND, 0) == 0){
+        if(isChannelOwner && channel != nullptr){
+            std::istringstream arguments(receivedMessage.substr(BATCH_COMMAND.size()));
+            int intervalMs;
+            size_t maxBytes = DEFAULT_BATCH_BYTES;
+            if(!(arguments >> intervalMs) || intervalMs < 0 || intervalMs > MAX_BATCH_INTERVAL_MS ||
+               (!(arguments >> maxBytes) && !arguments.eof()) || maxBytes < 1 || maxBytes > MAX_BATCH_BYTES){
+                sendMessage(connection, "Usage: /batch <milliseconds, 0 to turn off> [bytes]");
+                return;
+            }
+            configureBatch(channel, intervalMs, maxBytes);
+            if(intervalMs == 0){
+                sendMessage(connection, "Channel " + currentChannel + " now sends every message right away.");
+            }else{
+                sendMessage(connection, "Channel " + currentChannel + " now sends messages in batches every " + std::to_string(intervalMs) +
+                                        " ms or " + std::to_string(maxBytes) + " bytes.");
+            }
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+        }
+        return;
+    }
+
+    //If the user wants older messages of the channel from the log on disk
+    if(receivedMessage.rfind(HISTORY_COMMAND, 0) == 0){
+        std::istringstream arguments(receivedMessage.substr(HISTORY_COMMAND.size()));
+        size_t count = DEFAULT_HISTORY_MESSAGES;
+        if((!(arguments >> count) && !arguments.eof()) || count < 1 || count > MAX_HISTORY_MESSAGES){
+            sendMessage(connection, "Usage: /history [1-" + std::to_string(MAX_HISTORY_MESSAGES) + "]");
+            return;
+        }
+        if(!messageLog.enabled()){
+            sendMessage(connection, "This server does not keep channel history.");
+        }else if(channel == nullptr){
+            sendMessage(connection, "Join a channel first.");
+        }else{
+            connection.sendAll(messageLog.tail(currentChannel, count));
+        }
+        return;
+    }
+
+    //The client asks for a token it can resume this session with after a disconnect
+    if(receivedMessage == CONNECT_COMMAND){
+        sendMessage(connection, TOKEN_PREFIX + issueResumeToken(session));
+        return;
+    }
+
+    //The client reconnected and wants its nickname, channel and missed chat back
+    if(receivedMessage.rfind(RESUME_COMMAND, 0) == 0){
+        std::istringstream arguments(receivedMessage.substr(RESUME_COMMAND.size()));
+        std::string token;
+        uint64_t lastSeq = 0;
+        if(!(arguments >> token) || (!(arguments >> lastSeq) && !arguments.eof())){
+            sendMessage(connection, "Usage: /resume <token> [last sequence number seen]");
+        }else if(!resumeSession(session, token, lastSeq)){
+            sendMessage(connection, "This session can no longer be resumed, please /connect again.");
+        }
+        return;
+    }
+
+    //If the user wants the channel's latest messages containing some words
+    if(receivedMessage.rfind(SEARCH_COMMAND, 0) == 0){
+        std::string query = receivedMessage.substr(SEARCH_COMMAND.size());
+        std::vector<std::string> words = MessageLog::terms(query.data(), query.size());
+        if(words.empty()){
+            sendMessage(connection, "Usage: /search <words>");
+        }else if(!messageLog.enabled()){
+            sendMessage(connection, "This server does not keep channel history.");
+        }else if(channel == nullptr){
+            sendMessage(connection, "Join a channel first.");
+        }else{
+            std::vector<Frame> results = messageLog.search(currentChannel, words, MAX_SEARCH_RESULTS);
+            if(results.empty()){
+                sendMessage(connection, "No messages in " + currentChannel + " match" + query + ".");
+            }else{
+                sendMessage(connection, std::to_string(results.size()) + " latest messages in " + currentChannel + " matching" + query + ":");
+                connection.sendAll(results);
+            }
+        }
+        return;
+    }
+
+    //If the user wants to hear about messages with some words in any channel
+    if(receivedMessage.rfind(WATCH_COMMAND, 0) == 0){
+        std::string words = KeywordAutomaton::normalize(receivedMessage.substr(WATCH_COMMAND.size()));
+        std::istringstream arguments(words);
+        std::string word, added;
+        while(arguments >> word){
+            if(!keywordMatcher.watch(session, word)){
+                sendMessage(connection, "You can watch at most " + std::to_string(MAX_WATCHED_WORDS) + " words.");
+                break;
+            }
+            added += (added.empty() ? "" : ", ") + word;
+        }
+        if(!added.empty()){
+            sendMessage(connection, "You will be told about messages containing: " + added + ".");
+        }else if(words.empty()){
+            std::string watched;
+            for(const std::string& watchedWord : keywordMatcher.watchedWords(session)){
+                watched += (watched.empty() ? "" : ", ") + watchedWord;
+            }
+            sendMessage(connection, watched.empty() ? "Usage: /watch <words>" : "You are watching: " + watched + ".");
+        }
+        return;
+    }
+
+    if(receivedMessage.rfind(UNWATCH_COMMAND, 0) == 0){
+        std::string words = KeywordAutomaton::normalize(receivedMessage.substr(UNWATCH_COMMAND.size()));
+        std::istringstream arguments(words);
+        std::string word;
+        while(arguments >> word){
+            keywordMatcher.unwatch(session, word);
+        }
+        sendMessage(connection, words.empty() ? "Usage: /unwatch <words>" : "You stopped watching: " + words + ".");
+        return;
+    }
+
+    //If the channel administrator wants messages with some words rejected
+    if(receivedMessage.rfind(BLOCK_COMMAND, 0) == 0 || receivedMessage.rfind(UNBLOCK_COMMAND, 0) == 0){
+        if(isChannelOwner && channel != nullptr){
+            bool blocking = receivedMessage.rfind(BLOCK_COMMAND, 0) == 0;
+            std::string words = KeywordAutomaton::normalize(receivedMessage.substr(blocking ? BLOCK_COMMAND.size() : UNBLOCK_COMMAND.size()));
+            std::istringstream arguments(words);
+            std::string word;
+            while(arguments >> word){
+                if(!blocking){
+                    keywordMatcher.unblock(channel, word);
+                }else if(!keywordMatcher.block(channel, word)){
+                    sendMessage(connection, "A channel can block at most " + std::to_string(MAX_BLOCKED_WORDS) + " words.");
+                    return;
+                }
+            }
+            if(!words.empty()){
+                sendMessage(connection, "Messages with " + words + " are now " + (blocking ? "blocked" : "allowed") + " in " + currentChannel + ".");
+            }else if(!blocking){
+                sendMessage(connection, "Usage: /unblock <words>");
+            }else{
+                std::string blocked;
+                for(const std::string& blockedWord : keywordMatcher.blockedIn(channel)){
+                    blocked += (blocked.empty() ? "" : ", ") + blockedWord;
+                }
+                sendMessage(connection, blocked.empty() ? "Usage: /block <words>" : "Blocked in " + currentChannel + ": " + blocked + ".");
+            }
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+        }
+        return;
+    }
+
+    //If user wants to get the ip address another user from the channel
+    if(receivedMessage.rfind(WHOIS_COMMAND, 0) == 0){
+        //Checks if he is administrator
+        if(isChannelOwner){
+            std::string userName = receivedMessage.substr(7);
+            
+            //Searches for the user in all the clients
+            std::shared_ptr<ClientSession> user = findClient(userName);
+            if(user == nullptr){
+                //A client of another linked node or worker process
+                auto found = nicknameDirectory.find(userName);
+                int worker = prefork.workerWith(userName);
+                std::string userMessage = !found.empty() ? "User " + userName + " is on node " + found[0].first +
+                    (found[0].second.channelName.empty() ? "." : " (in " + found[0].second.channelName + ").") :
+                    worker >= 0 ? "User " + userName + " is on worker process " + std::to_string(worker) + "." : "User not found.";
+                sendMessage(connection, userMessage);
+                return;
+            }
+
+            //Pegar o ip aqui, não do cliente que mandou a mensagem mas do alvo userName, que pegamos o  index no vetor com os ID's
+            std::string ip = "127.0.0.1";
+            std::string userMessage = "User " + userName + " is on IP: " + ip;
+            sendMessage(connection, userMessage);
+
+            return;
+        }else{
+            std::string permissionMessage = "This command may only be used by the channel administrator";
+            sendMessage(connection, permissionMessage);
+            return;
+        }
+    }
+    if (session->muted && session->mutedChannel == channel) {
+        session->refused = true;
+        sendMessage(connection, "You are muted on this channel.");
+        return;
+    }
+    if (channel == nullptr) {
+        return;
+    }
+
+    // Rate limits are checked before the message is built or fanned out
+    uint64_t nowMs = steadyMilliseconds();
+    bool allowed = session->rateLimit.tryTake(nowMs);
+    if (!allowed) {
+        chatRejectedBySession++;
+    } else {
+        std::lock_guard<std::mutex> lock(channel->rateLimitMutex);
+        allowed = channel->rateLimit.tryTake(nowMs);
+        if (!allowed) {
+            chatRejectedByChannel++;
+        }
+    }
+    if (!allowed) {
+        session->refused = true;
+        if (nowMs - session->lastRateLimitNoticeMs >= (uint64_t)RATE_LIMIT_NOTICE_INTERVAL_MS) {
+            session->lastRateLimitNoticeMs = nowMs;
+            sendMessage(connection, "You are sending messages too fast, some were dropped.");
+        }
+        return;
+    }
+
+    // Blocked and watched words are looked for once, before any fanout
+    std::vector<std::shared_ptr<ClientSession>> watchers;
+    if (keywordMatcher.match(channel, receivedMessage, watchers)) {
+        keywordMatcher.messagesBlocked++;
+        sendMessage(connection, "Your message was not sent: it contains a word blocked in " + currentChannel + ".");
+        return;
+    }
+    chatMessagesAccepted++;
+
+    std::string fullMessage = clientName + ": " + receivedMessage;
+    notifyWatchers(watchers, currentChannel, fullMessage, session.get());
+
+    // Send the message to all clients in the same channel, here and on the
+    // nodes that have members in it
+    broadcastToChannel(channel, fullMessage);
+    federation.forward(currentChannel, clientName, receivedMessage);
+    prefork.forward(currentChannel, clientName, receivedMessage);
+}
+
+// Where a client's frame is handled while nodes are linked. Entering a
+// channel (or resuming a session) whose home is another node moves the
+// session there; from then on its frames are relayed until it enters a
+// channel that lives elsewhere. Returns false for frames handled here.
+// The session waits for the connection to a new home without its worker.
+Task<bool> routeToHome(std::shared_ptr<ClientSession> session, std::string message) {
+    if (session->relayed) {
+        co_return false;
+    }
+    std::shared_ptr<HomeProxy> proxy = session->proxy;
+
+    std::string channelName, nickname, node;
+    sockaddr_in address{};
+    if (message.rfind(REGISTER_COMMAND + " ", 0) == 0) {
+        std::string arguments = message.substr(REGISTER_COMMAND.size() + 1);
+        size_t space = arguments.rfind(' ');
+        if (space != std::string::npos && space > 0 && space + 1 < arguments.size()) {
+            nickname = arguments.substr(0, space);
+            channelName = arguments.substr(space + 1);
+        }
+    } else if (message.rfind(JOIN_COMMAND + " ", 0) == 0) {
+        channelName = message.substr(JOIN_COMMAND.size() + 1);
+    }
+    bool moving = !channelName.empty();
+    if (moving) {
+        node = federation.homeOf(channelName, address);
+    } else if (message.rfind(RESUME_COMMAND + " ", 0) == 0) {
+        std::istringstream arguments(message.substr(RESUME_COMMAND.size()));
+        std::string token;
+        arguments >> token;
+        node = federation.tokenHome(token, address);
+        moving = !node.empty();
+    }
+
+    if (!moving || (proxy != nullptr && proxy->node == node)) {
+        if (proxy == nullptr) {
+            co_return false;
+        }
+        if (message.rfind(NICKNAME_COMMAND + " ", 0) == 0) {
+            proxy->nickname = message.substr(NICKNAME_COMMAND.size() + 1);
+        } else if (!nickname.empty()) {
+            proxy->nickname = nickname;
+        }
+        proxy->connection->send(encodeFrame(message));
+        co_return true;
+    }
+
+    if (proxy != nullptr && nickname.empty()) {
+        nickname = proxy->nickname;
+    }
+    if (nickname.empty() && session->chosenName) {
+        nickname = session->clientName;
+    }
+    std::string introduction = message;
+    if (message.rfind(JOIN_COMMAND + " ", 0) == 0 && !nickname.empty()) {
+        introduction = REGISTER_COMMAND + " " + nickname + " " + channelName;
+    }
+
+    std::shared_ptr<HomeProxy> next;
+    if (!node.empty()) {
+        int socket = co_await ConnectOnReactor{address};
+        if (socket == -1) {
+            federation.relayConnectsFailed++;
+        } else {
+            next = openHomeProxy(node, socket);
+        }
+    }
+
+    // Leaving the node the session lived on, which lets it go without a mailbox
+    if (proxy != nullptr) {
+        proxy->current = false;
+        proxy->connection->send(encodeFrame(LEAVE_COMMAND));
+        proxy->connection->send(encodeFrame(QUIT_COMMAND));
+        session->proxy = nullptr;
+    }
+    if (next == nullptr) {
+        // The home is this node, or out of reach for now
+        if (proxy == nullptr || introduction == message) {
+            co_return false;
+        }
+        handleClientMessage(session, introduction);
+        co_return true;
+    }
+    leaveChannel(session);
+    directoryWithdraw(session.get());
+    forgetResumeState(session);
+    {
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        session->resumeToken.clear();
+    }
+    next->nickname = nickname;
+    next->connection->send(encodeFrame(introduction));
+    session->proxy = next;
+    homeProxyReader(session, next);
+    co_return true;
+}
+
+void closeSession(const std::shared_ptr<ClientSession>& session) {
+    timingWheel.cancel(session->idleTimer);
+    timingWheel.cancel(session->muteTimer);
+    if (session->proxy != nullptr) {
+        // The home keeps the session for /resume, as if the client had dropped there
+        session->proxy->current = false;
+        session->proxy->connection->shutdown();
+    }
+
+    // Remembered before leaving the channel, for /resume
+    saveResumeState(session);
 
-        buffer[receivedBytes] = '\0';
-        message += buffer;
-        bytesRead += receivedBytes;
+    // Remove client from its channel and from the connected clients list
+    // A kicked client still points at the channel but was already announced
+    if (session->channel != nullptr && isChannelMember(session->channel, session.get())) {
+        removeFromChannel(session->channel, session.get());
+        broadcastPresence(session->channel, session->currentChannel, session->clientName,
+                          session->clientName + " left the channel " + session->currentChannel + ".");
+        if (session->chosenName && !session->takenOver) {
+            openMailbox(session);
+        }
     }
+    keywordMatcher.removeSession(session);
+    directoryWithdraw(session.get());
+    updateConnectedClients([&session](ClientList& clients) {
+        clients.erase(std::remove_if(clients.begin(), clients.end(),
+                                     [&session](const ConnectedClient& client) { return client.session == session; }),
+                      clients.end());
+    });
 
-    return message;
+    // Close the client socket
+    std::shared_ptr<Connection> connection = session->connection;
+    reactor.post([connection]() { connection->close(); });
 }
 
-void clientThread(int clientSocket) {
-    int clientId = clientSocket;
-    std::string clientName = "Client " + std::to_string(clientId);
-    std::string currentChannel;
+// One coroutine per client, written as a plain loop. It is suspended (not
+// blocking a thread) while waiting for a frame or for its outbound queue to
+// drain, and resumes on whichever pool worker is free.
+// A session handed over by the previous process was already welcomed.
+SessionTask clientSession(std::shared_ptr<ClientSession> session, bool handedOver = false) {
+    co_await ResumeOnWorkerPool{};
+    Connection& connection = *session->connection;
 
     // Send welcome message to the client
-    std::string welcomeMessage = "Welcome to the chat! Your nickname is " + clientName + ".";
-    sendMessage(clientSocket, welcomeMessage);
+    if (!handedOver) {
+        std::string welcomeMessage = "Welcome to the chat! Your nickname is " + session->clientName + ".";
+        co_await connection.write(welcomeMessage);
+    }
 
-    // Add client to the connected clients vector
-    connectedClients.push_back(clientSocket);
-    clientNames.push_back(clientName);
+    // Add client to the connected clients list
+    updateConnectedClients([&session](ClientList& clients) {
+        clients.push_back({session, session->clientName});
+    });
+    session->lastActivityMs = steadyMilliseconds();
+    scheduleIdleCheck(session, HEARTBEAT_INTERVAL_MS);
 
-    bool connected = true;
-    bool isChannelOwner = false;
+    int framesThisTurn = 0;
+    while (true) {
+        // A client with a backlog of frames mustn't keep the worker to itself
+        if (++framesThisTurn == SESSION_FRAMES_PER_TURN) {
+            framesThisTurn = 0;
+            co_await YieldWorker{};
+        }
 
-    while (connected) {
         // Receive message from the client
-        std::string receivedMessage = receiveMessage(clientSocket);
-        if (receivedMessage.empty()) {
-            std::cout << clientName << " has disconnected." << std::endl;
+        std::optional<std::string> receivedMessage = co_await connection.read_frame();
+        if (!receivedMessage) {
+            std::cout << session->clientName << " has disconnected." << std::endl;
             break;
         }
+        session->lastActivityMs = steadyMilliseconds();
+        session->awaitingHeartbeat = false;
 
-        // Check if the client wants to quit
-        if (receivedMessage == QUIT_COMMAND) {
-            std::cout << clientName << " has left the chat." << std::endl;
-            break;
+        // A session living on another node gets everything relayed, even heartbeats
+        if (federation.enabled() && co_await routeToHome(session, *receivedMessage)) {
+            if (*receivedMessage == QUIT_COMMAND) {
+                std::cout << session->clientName << " has left the chat." << std::endl;
+                break;
+            }
+            std::shared_ptr<HomeProxy> proxy = session->proxy;
+            if (proxy != nullptr) {
+                co_await proxy->connection->writable();
+            }
+            continue;
         }
-
-        // Check if the client wants to ping the server
-        if (receivedMessage == PING_COMMAND) {
-            sendMessage(clientSocket, PONG_MESSAGE);
+        if (receivedMessage->empty() || *receivedMessage == HEARTBEAT_COMMAND) {
             continue;
         }
 
-        //Check if the client wants to add Nickname
-        if(receivedMessage.rfind(NICKNAME_COMMAND, 0) == 0) {
-            std::string newName = receivedMessage.substr(10);
-            std::cout << "Client " << clientId << " is now ";
-            
-            int index = find(clientNames.begin(), clientNames.end(), clientName) - clientNames.begin();
-            clientName = newName;
-            clientNames[index] = clientName;
-            std::cout << clientName << std::endl;  
+        // Check if the client wants to quit
+        if (*receivedMessage == QUIT_COMMAND) {
+            std::cout << session->clientName << " has left the chat." << std::endl;
+            forgetResumeState(session);
+            break;
         }
 
-        //Check if the client wants to join/create a channel
-        if(receivedMessage.rfind(JOIN_COMMAND, 0) == 0) {
-            std::string channelName = receivedMessage.substr(6);
-            //Check if channel exists
-            if(channelsNames.find(channelName) == channelsNames.end()){
+        handleClientMessage(session, *receivedMessage);
 
-                channelsNames[channelName].push_back(clientId);
-                currentChannel = channelName;
-                std::string creationMessage = "Channel " + channelName + " created";
-                std::cout << creationMessage << std::endl;  
-                sendMessage(clientSocket, creationMessage);
-                isChannelOwner = true;
+        // Stop reading from a client that isn't reading what we send it
+        co_await connection.writable();
+    }
 
-            }else{
-                currentChannel = channelName;
-                channelsNames[channelName].push_back(clientId);
-                std::string connectionMessage = "Connected to the channel: " + channelName;
-                sendMessage(clientSocket, connectionMessage);
-            }            
-
-        }
-
-        //If user wants to kick another user from the channel
-        if(receivedMessage.rfind(KICK_COMMAND, 0) == 0){
-            //Checks if he is administrator
-            if(isChannelOwner){
-                std::string userName = receivedMessage.substr(6);
-                
-                //Searches for the user in all the clients
-                auto flag = find(clientNames.begin(), clientNames.end(), userName);
-                if(flag == clientNames.end()){
-                    std::string userMessage = "User not found.";
-                    sendMessage(clientSocket, userMessage);
-                    continue;
-                }
-                int index =  flag - clientNames.begin();
+    closeSession(session);
+}
+
+// Reactor handler for the listening socket
+// Accepts clients on the TCP port, or on the Unix socket (local) with the
+// same framing
+class Listener : public ReactorHandler {
+public:
+    explicit Listener(int socket, bool local = false) : socket(socket), local(local) {}
+
+    void onEvents(uint32_t) override {
+        while (true) {
+            // New clients wait in the backlog while the workers are behind
+            if (workerPool.overloaded()) {
+                acceptsDeferred++;
+                reactor.modify(socket, this, 0);
+                timingWheel.schedule(retryTimer, ACCEPT_RETRY_MS, [this]() { reactor.modify(socket, this, EPOLLIN); });
+                return;
+            }
 
-                //Disconnects the user 
-                auto flag2 = find(channelsNames[currentChannel].begin(), channelsNames[currentChannel].end(), connectedClients[index]);
-                if(flag2 == channelsNames[currentChannel].end()){
-                    std::string userMessage = "User not found.";
-                    sendMessage(clientSocket, userMessage);
+            // Accept a connection from a client
+            sockaddr_storage clientAddress;
+            socklen_t clientAddressLength = sizeof(clientAddress);
+            int clientSocket = accept4(socket, (struct sockaddr*)&clientAddress, &clientAddressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientSocket < 0) {
+                if (errno == EINTR) {
                     continue;
                 }
-                int index2 =  flag2 - channelsNames[currentChannel].begin();
-                channelsNames[currentChannel][index2] = -1;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    std::cerr << "Failed to accept connection: " << strerror(errno) << std::endl;
+                }
+                return;
+            }
 
+            std::cout << "Client connected. Client ID: " << clientSocket << std::endl;
 
-                std::string userMessage = "User " + userName + " was kicked.";
-                sendMessage(clientSocket, userMessage);
+            if (!local) {
+                int noDelay = 1;
+                setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+                // Keep the chat backlog in our queue, where replies can overtake it
+                int notSentLowat = SOCKET_NOTSENT_LOWAT;
+                setsockopt(clientSocket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &notSentLowat, sizeof(notSentLowat));
+            }
 
-                std::string kickedMessage = "You were kicked of the channel " + currentChannel +" by an administrator.";
-                sendMessage(connectedClients[index], kickedMessage);
-                continue;
-            }else{
-                std::string permissionMessage = "This command may only be used by the channel administrator";
-                sendMessage(clientSocket, permissionMessage);
+            auto session = std::make_shared<ClientSession>();
+            session->connection = std::make_shared<Connection>(clientSocket);
+            session->clientName = "Client " + std::to_string(clientSocket);
+            if (!reactor.add(clientSocket, session->connection, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+                std::cerr << "Failed to register connection." << std::endl;
+                ::close(clientSocket);
                 continue;
             }
+            clientSession(session);
         }
+    }
 
+private:
+    int socket;
+    bool local;
+    Timer retryTimer;
+};
 
-        //If user wants to mute another user from the channel
-        if(receivedMessage.rfind(MUTE_COMMAND, 0) == 0){
-            //Checks if he is administrator
-            if(isChannelOwner){
-                std::string userName = receivedMessage.substr(6);
-                
-                //Searches for the user in all the clients
-                auto flag = find(clientNames.begin(), clientNames.end(), userName);
-                if(flag == clientNames.end()){
-                    std::string userMessage = "User not found.";
-                    sendMessage(clientSocket, userMessage);
-                    continue;
-                }
-                int index =  flag - clientNames.begin();
+std::atomic<bool> snapshotWriting(false);
+Timer snapshotTimer;
 
-                std::string userMessage = "User " + userName + " was muted.";
-                sendMessage(clientSocket, userMessage);
+// Writes what a restart after a crash needs: the channels, every session
+// that could resume (open ones as if they had just dropped) and whatever of
+// the snapshot we started from is still unused.
+bool writeSnapshot(const std::string& path) {
+    auto started = std::chrono::steady_clock::now();
+    uint64_t steadyNowMs = steadyMilliseconds(), nowMs = systemMilliseconds();
+    auto wallClock = [steadyNowMs, nowMs](uint64_t steadyMs) {
+        return steadyMs == 0 ? 0 : nowMs + (steadyMs > steadyNowMs ? steadyMs - steadyNowMs : 0);
+    };
+    std::string strings;
+    auto addText = [&strings](std::string_view value, uint64_t& offset, uint32_t& length) {
+        offset = strings.size();
+        length = value.size();
+        strings += value;
+    };
+    std::vector<std::pair<std::string, SnapshotChannel>> channels;
+    std::vector<SnapshotSession> sessions;
+    std::unordered_map<std::string, uint64_t> ownerExpiresAtMs;
 
-                std::string mutedMessage = "You were muted on the channel " + currentChannel +" by an administrator.";
-                sendMessage(connectedClients[index], mutedMessage);
+    auto addSession = [&](const std::string& token, const std::string& name, bool chosenName, const std::string& channelName,
+                          bool owner, bool muted, uint64_t muteExpiresMs, const DedupWindow& dedup, uint64_t expiresAtMs) {
+        if (token.size() != RESUME_TOKEN_LENGTH) {
+            return;
+        }
+        SnapshotSession record{};
+        memcpy(record.token, token.data(), RESUME_TOKEN_LENGTH);
+        addText(name, record.nameOffset, record.nameLength);
+        addText(channelName, record.channelNameOffset, record.channelNameLength);
+        record.expiresAtMs = expiresAtMs;
+        record.muteExpiresAtMs = muted ? wallClock(muteExpiresMs) : 0;
+        record.dedupHighest = dedup.highest;
+        for (size_t bit = 0; bit < DEDUP_WINDOW; bit++) {
+            record.dedupSeen[bit / 64] |= (uint64_t)dedup.seen[bit] << (bit % 64);
+        }
+        record.flags = (chosenName ? (uint32_t)SNAPSHOT_CHOSEN_NAME : 0) | (owner ? (uint32_t)SNAPSHOT_CHANNEL_OWNER : 0) |
+                       (muted ? (uint32_t)SNAPSHOT_MUTED : 0);
+        sessions.push_back(record);
+        if (owner && !channelName.empty()) {
+            ownerExpiresAtMs[channelName] = std::max(ownerExpiresAtMs[channelName], expiresAtMs);
+        }
+    };
+
+    {
+        EpochGuard guard;
+        for (const ConnectedClient& client : *connectedClients.load()) {
+            const std::shared_ptr<ClientSession>& session = client.session;
+            std::string token;
+            {
+                std::lock_guard<std::mutex> lock(resumeMutex);
+                token = session->resumeToken;
+            }
+            if (token.empty() || session->takenOver) {
                 continue;
-            }else{
-                std::string permissionMessage = "This command may only be used by the channel administrator";
-                sendMessage(clientSocket, permissionMessage);
+            }
+            Channel* channel;
+            std::string channelName;
+            bool owner;
+            {
+                std::lock_guard<std::mutex> lock(session->placeMutex);
+                channel = session->placeChannel;
+                channelName = session->placeChannelName;
+                owner = session->placeOwner;
+            }
+            bool member = channel != nullptr && isChannelMember(channel, session.get());
+            DedupWindow dedup;
+            {
+                std::lock_guard<std::mutex> lock(session->dedupMutex);
+                dedup = session->dedup;
+            }
+            addSession(token, client.name, session->chosenName, member ? channelName : std::string(), owner,
+                       member && session->muted && session->mutedChannel == channel, session->muteExpiresMs, dedup,
+                       nowMs + RESUME_WINDOW_MS);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        for (const auto& [token, state] : resumeStates) {
+            if (state.live.expired() && state.expiresAtMs > steadyNowMs) {
+                addSession(token, state.clientName, state.chosenName, state.channelName, state.isChannelOwner, state.muted,
+                           state.muteExpiresMs, state.dedup, wallClock(state.expiresAtMs));
+            }
+        }
+        for (uint64_t i = 0; bootSnapshot.loaded() && i < bootSnapshot.header().sessionCount; i++) {
+            const SnapshotSession& old = bootSnapshot.sessions()[i];
+            std::string token(old.token, RESUME_TOKEN_LENGTH);
+            if (old.expiresAtMs <= nowMs || usedSnapshotTokens.count(token) > 0 || resumeStates.count(token) > 0) {
                 continue;
             }
+            SnapshotSession record = old;
+            addText(bootSnapshot.text(old.nameOffset, old.nameLength), record.nameOffset, record.nameLength);
+            addText(bootSnapshot.text(old.channelNameOffset, old.channelNameLength), record.channelNameOffset, record.channelNameLength);
+            sessions.push_back(record);
+            if (record.flags & SNAPSHOT_CHANNEL_OWNER) {
+                std::string channelName(bootSnapshot.text(old.channelNameOffset, old.channelNameLength));
+                ownerExpiresAtMs[channelName] = std::max(ownerExpiresAtMs[channelName], record.expiresAtMs);
+            }
         }
+    }
 
-        //If user wants to unmute another user from the channel
-        if(receivedMessage.rfind(UNMUTE_COMMAND, 0) == 0){
-            //Checks if he is administrator
-            if(isChannelOwner){
-                std::string userName = receivedMessage.substr(8);
-                
-                //Searches for the user in all the clients
-                auto flag = find(clientNames.begin(), clientNames.end(), userName);
-                if(flag == clientNames.end()){
-                    std::string userMessage = "User not found.";
-                    sendMessage(clientSocket, userMessage);
-                    continue;
-                }
-                int index =  flag - clientNames.begin();
+    {
+        EpochGuard guard;
+        const ChannelMap* live = channelsNames.load();
+        for (const auto& [name, channel] : *live) {
+            SnapshotChannel record{};
+            {
+                std::lock_guard<std::mutex> lock(channel->historyMutex);
+                record.nextSeq = channel->nextSeq;
+            }
+            record.loggedMessages = messageLog.enabled() ? messageLog.messageCount(name) : 0;
+            record.fanoutWeight = channel->fanoutWeight;
+            if (ChannelBatch* batch = channel->batch.load()) {
+                std::lock_guard<std::mutex> lock(batch->mutex);
+                record.batchIntervalMs = batch->intervalMs;
+                record.batchMaxBytes = batch->maxBytes;
+            }
+            std::string blocked;
+            for (const std::string& word : keywordMatcher.blockedIn(channel)) {
+                blocked += (blocked.empty() ? "" : " ") + word;
+            }
+            addText(blocked, record.blockedOffset, record.blockedLength);
+            channels.push_back({name, record});
+        }
+        // Channels from before the restart that nobody has opened yet
+        for (uint64_t i = 0; bootSnapshot.loaded() && i < bootSnapshot.header().channelCount; i++) {
+            const SnapshotChannel& old = bootSnapshot.channels()[i];
+            std::string name(bootSnapshot.text(old.nameOffset, old.nameLength));
+            if (live->count(name) > 0) {
+                continue;
+            }
+            SnapshotChannel record = old;
+            addText(bootSnapshot.text(old.blockedOffset, old.blockedLength), record.blockedOffset, record.blockedLength);
+            channels.push_back({name, record});
+        }
+    }
+    std::sort(channels.begin(), channels.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    std::sort(sessions.begin(), sessions.end(), [](const SnapshotSession& a, const SnapshotSession& b) {
+        return memcmp(a.token, b.token, RESUME_TOKEN_LENGTH) < 0;
+    });
 
-                std::string userMessage = "User " + userName + " was unmuted.";
-                sendMessage(clientSocket, userMessage);
+    std::vector<SnapshotChannel> channelTable;
+    channelTable.reserve(channels.size());
+    for (auto& [name, record] : channels) {
+        addText(name, record.nameOffset, record.nameLength);
+        auto owner = ownerExpiresAtMs.find(name);
+        if (owner != ownerExpiresAtMs.end()) {
+            record.ownerExpiresAtMs = std::max(record.ownerExpiresAtMs, owner->second);
+        }
+        channelTable.push_back(record);
+    }
 
-                std::string unmutedMessage = "You were unmuted on the channel " + currentChannel +" by an administrator.";
-                sendMessage(connectedClients[index], unmutedMessage);
-                continue;
-            }else{
-                std::string permissionMessage = "This command may only be used by the channel administrator";
-                sendMessage(clientSocket, permissionMessage);
+    SnapshotHeader header{};
+    memcpy(header.magic, StateSnapshot::magic(), sizeof(header.magic));
+    header.writtenAtMs = nowMs;
+    header.channelCount = channelTable.size();
+    header.sessionCount = sessions.size();
+    std::string body;
+    body.reserve(channelTable.size() * sizeof(SnapshotChannel) + sessions.size() * sizeof(SnapshotSession) + strings.size());
+    body.append(reinterpret_cast<const char*>(channelTable.data()), channelTable.size() * sizeof(SnapshotChannel));
+    body.append(reinterpret_cast<const char*>(sessions.data()), sessions.size() * sizeof(SnapshotSession));
+    body += strings;
+    header.fileBytes = sizeof(header) + body.size();
+    header.checksum = snapshotChecksum(body.data(), body.size());
+
+    // Written next to it and renamed, so a crash leaves the old one or the new one
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        std::cerr << "Failed to write the snapshot: " << strerror(errno) << std::endl;
+        return false;
+    }
+    iovec parts[2] = {{&header, sizeof(header)}, {body.data(), body.size()}};
+    bool written = true;
+    off_t offset = 0;
+    for (const iovec& part : parts) {
+        for (size_t done = 0; written && done < part.iov_len;) {
+            ssize_t count = pwrite(fd, static_cast<const char*>(part.iov_base) + done, part.iov_len - done, offset);
+            if (count < 0 && errno == EINTR) {
                 continue;
             }
+            written = count > 0;
+            done += written ? count : 0;
+            offset += written ? count : 0;
+        }
+    }
+    written = written && fdatasync(fd) == 0;
+    close(fd);
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write the snapshot: " << strerror(errno) << std::endl;
+        unlink(temporary.c_str());
+        return false;
+    }
+    // The rename itself must reach the disk too
+    std::string directory = std::filesystem::path(path).parent_path().string();
+    int directoryFd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (directoryFd != -1) {
+        fsync(directoryFd);
+        close(directoryFd);
+    }
+
+    snapshotsWritten++;
+    lastSnapshotBytes = header.fileBytes;
+    lastSnapshotUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+    return true;
+}
+
+// Every snapshotIntervalSeconds, on a worker; a slow disk skips a turn
+// rather than piling writes up
+void scheduleSnapshots() {
+    timingWheel.schedule(snapshotTimer, config.snapshotIntervalSeconds * 1000, []() {
+        if (!snapshotWriting.exchange(true)) {
+            workerPool.submit([]() {
+                writeSnapshot(config.snapshotPath);
+                snapshotWriting = false;
+            });
+        }
+        scheduleSnapshots();
+    });
+}
+
+// For the reactor thread on shutdown and handoff: waits for a periodic
+// snapshot still on a worker, so the two don't share the temporary file
+bool writeSnapshotNow(const std::string& path) {
+    while (snapshotWriting.exchange(true)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    bool written = writeSnapshot(path);
+    snapshotWriting = false;
+    return written;
+}
+
+// Hot restart. A server started with --takeover=path first connects to the
+// Unix socket at path; if an older server is listening there, it sends its
+// listening socket and every client socket (SCM_RIGHTS) together with the
+// sessions, channels, mailboxes and resume tokens, and the new server carries
+// on with them while the old one exits. Either way the new server then
+// listens at path itself for the next upgrade. Clients stay connected; they
+// only see a pause while the state is handed over.
+
+// Fixed-width numbers and length-prefixed strings; both ends are the same
+// machine, so native byte order is fine
+struct StateWriter {
+    std::string data;
+
+    void number(uint64_t value) { data.append(reinterpret_cast<const char*>(&value), sizeof(value)); }
+    void text(const std::string& value) {
+        number(value.size());
+        data += value;
+    }
+};
+
+struct StateReader {
+    const std::string& data;
+    size_t offset = 0;
+    bool failed = false;
+
+    uint64_t number() {
+        uint64_t value = 0;
+        if (data.size() - offset < sizeof(value)) {
+            failed = true;
+            return 0;
+        }
+        memcpy(&value, data.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return value;
+    }
+    std::string text() {
+        uint64_t length = number();
+        if (failed || data.size() - offset < length) {
+            failed = true;
+            return std::string();
+        }
+        std::string value = data.substr(offset, length);
+        offset += length;
+        return value;
+    }
+};
+
+const uint64_t NO_DESCRIPTOR = UINT64_MAX;
+
+bool writeAll(int socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t count = ::send(socket, data, length, MSG_NOSIGNAL);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+bool readAll(int socket, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t count = recv(socket, data, length, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        length -= count;
+    }
+    return true;
+}
+
+// Descriptors go in groups, each attached to a single byte
+bool sendDescriptors(int socket, const std::vector<int>& fds) {
+    for (size_t first = 0; first < fds.size(); first += HANDOFF_FDS_PER_MESSAGE) {
+        size_t count = std::min<size_t>(HANDOFF_FDS_PER_MESSAGE, fds.size() - first);
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        char byte = 0;
+        iovec iov{&byte, 1};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds.data() + first, count * sizeof(int));
+        if (sendmsg(socket, &message, MSG_NOSIGNAL) != 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool receiveDescriptors(int socket, size_t total, std::vector<int>& fds) {
+    while (fds.size() < total) {
+        size_t count = std::min<size_t>(HANDOFF_FDS_PER_MESSAGE, total - fds.size());
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        char byte;
+        iovec iov{&byte, 1};
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        if (recvmsg(socket, &message, MSG_CMSG_CLOEXEC) != 1) {
+            return false;
+        }
+        cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (header == nullptr || header->cmsg_type != SCM_RIGHTS || (message.msg_flags & MSG_CTRUNC)) {
+            return false;
+        }
+        size_t received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const int* data = reinterpret_cast<const int*>(CMSG_DATA(header));
+        fds.insert(fds.end(), data, data + received);
+    }
+    return true;
+}
+
+void writeDedup(StateWriter& out, const DedupWindow& dedup) {
+    out.number(dedup.highest);
+    out.text(dedup.seen.to_string());
+}
+
+DedupWindow readDedup(StateReader& in) {
+    DedupWindow dedup;
+    dedup.highest = in.number();
+    std::string seen = in.text();
+    if (seen.size() == DEDUP_WINDOW && seen.find_first_not_of("01") == std::string::npos) {
+        dedup.seen = std::bitset<DEDUP_WINDOW>(seen);
+    }
+    return dedup;
+}
+
+// Everything the next process needs, with descriptors as indexes into fds.
+// Runs with every session parked and the workers idle.
+std::string saveHandoffState(int listenSocket, std::vector<int>& fds, std::vector<std::shared_ptr<ClientSession>>& sessions) {
+    EpochGuard guard;
+    StateWriter out;
+    out.number(HANDOFF_VERSION);
+    fds.push_back(listenSocket);
+
+    // Clients relayed to another node stay behind; they reconnect and resume
+    // there through the new server, which gets the tokens at the end
+    const ClientList* clients = connectedClients.load();
+    std::unordered_map<const ClientSession*, uint64_t> sessionIndex;
+    out.number(std::count_if(clients->begin(), clients->end(), [](const ConnectedClient& client) { return client.session->proxy == nullptr; }));
+    for (const ConnectedClient& client : *clients) {
+        const std::shared_ptr<ClientSession>& session = client.session;
+        if (session->proxy != nullptr) {
+            continue;
+        }
+        sessionIndex[session.get()] = sessions.size();
+        sessions.push_back(session);
+        out.number(fds.size());
+        fds.push_back(session->connection->socket);
+        out.text(session->clientName);
+        out.number(session->chosenName);
+        out.number(session->channel != nullptr);
+        out.text(session->currentChannel);
+        out.number(session->isChannelOwner);
+        {
+            std::lock_guard<std::mutex> lock(resumeMutex);
+            out.text(session->resumeToken);
+        }
+        {
+            std::lock_guard<std::mutex> lock(session->dedupMutex);
+            writeDedup(out, session->dedup);
+        }
+        std::vector<std::string> watched = keywordMatcher.watchedWords(session);
+        out.number(watched.size());
+        for (const std::string& word : watched) {
+            out.text(word);
+        }
+        out.number(session->muted && session->mutedChannel == session->channel);
+        out.number(session->muteExpiresMs);
+        out.number(session->relayed);
+        out.text(session->connection->unreadBytes());
+        out.text(session->connection->unsentBytes());
+    }
+
+    const ChannelMap* channels = channelsNames.load();
+    out.number(channels->size());
+    for (const auto& [name, channel] : *channels) {
+        out.text(name);
+        {
+            std::lock_guard<std::mutex> lock(channel->historyMutex);
+            out.number(channel->nextSeq);
+            out.number(channel->historySize);
+            for (size_t i = 0; i < channel->historySize; i++) {
+                size_t slot = (channel->historyHead + i) % HISTORY_FRAMES;
+                out.number(channel->historySeqs[slot]);
+                out.text(*channel->history[slot]);
+            }
+        }
+        out.number(channel->fanoutWeight);
+        ChannelBatch* batch = channel->batch.load();
+        out.number(batch != nullptr ? batch->intervalMs : 0);
+        out.number(batch != nullptr ? batch->maxBytes : DEFAULT_BATCH_BYTES);
+        std::vector<std::string> blocked = keywordMatcher.blockedIn(channel);
+        out.number(blocked.size());
+        for (const std::string& word : blocked) {
+            out.text(word);
+        }
+
+        const ChannelRoster* roster = channel->roster.load();
+        std::vector<uint64_t> members;
+        for (const std::shared_ptr<ClientSession>& member : roster->members) {
+            auto found = sessionIndex.find(member.get());
+            if (found != sessionIndex.end()) {
+                members.push_back(found->second);
+            }
+        }
+        out.number(members.size());
+        for (uint64_t index : members) {
+            out.number(index);
+        }
+
+        out.number(roster->mailboxes.size());
+        for (const std::shared_ptr<Mailbox>& mailbox : roster->mailboxes) {
+            std::lock_guard<std::mutex> lock(mailbox->mutex);
+            if (!mailbox->spillBuffer.empty()) {
+                spillMailboxLocked(*mailbox);
+            }
+            out.text(mailbox->nickname);
+            out.number(mailbox->expiresAtMs);
+            out.number(mailbox->frames.size());
+            for (const Frame& frame : mailbox->frames) {
+                out.text(*frame);
+            }
+            if (mailbox->spillFile != nullptr) {
+                out.number(fds.size());
+                fds.push_back(mailbox->spillFile->fd);
+            } else {
+                out.number(NO_DESCRIPTOR);
+            }
+            out.number(mailbox->spilledBytes);
+            out.number(mailbox->messages);
+            out.number(mailbox->lostMessages);
+        }
+    }
+
+    // Sessions that disconnected and may still come back with /resume
+    std::lock_guard<std::mutex> lock(resumeMutex);
+    uint64_t nowMs = steadyMilliseconds();
+    std::vector<const std::pair<const std::string, ResumeState>*> waiting;
+    for (const auto& entry : resumeStates) {
+        if (entry.second.live.expired() && entry.second.expiresAtMs > nowMs) {
+            waiting.push_back(&entry);
+        }
+    }
+    out.number(waiting.size());
+    for (const auto* entry : waiting) {
+        const ResumeState& state = entry->second;
+        out.text(entry->first);
+        out.text(state.clientName);
+        out.number(state.chosenName);
+        out.text(state.channelName);
+        out.number(state.isChannelOwner);
+        out.number(state.muted);
+        out.number(state.muteExpiresMs);
+        writeDedup(out, state.dedup);
+        out.number(state.expiresAtMs);
+    }
+
+    std::vector<std::pair<std::string, std::string>> tokens = federation.rememberedTokens();
+    out.number(tokens.size());
+    for (const auto& [token, node] : tokens) {
+        out.text(token);
+        out.text(node);
+    }
+    return out.data;
+}
+
+// Rebuilds what saveHandoffState() wrote and starts the sessions. Returns
+// the listening socket, or -1 if the state makes no sense.
+int restoreHandoffState(const std::string& state, const std::vector<int>& fds) {
+    StateReader in{state};
+    auto descriptor = [&in, &fds](uint64_t index) {
+        if (index >= fds.size()) {
+            in.failed = true;
+            return -1;
+        }
+        return fds[index];
+    };
+    if (in.number() != HANDOFF_VERSION) {
+        std::cerr << "The old server sent state this version can't read." << std::endl;
+        return -1;
+    }
+    int listenSocket = descriptor(0);
+
+    struct Restored {
+        std::shared_ptr<ClientSession> session;
+        bool inChannel;
+        std::vector<std::string> watched;
+    };
+    std::vector<Restored> restored(in.number());
+    for (size_t i = 0; i < restored.size() && !in.failed; i++) {
+        int fd = descriptor(in.number());
+        auto session = std::make_shared<ClientSession>();
+        session->connection = std::make_shared<Connection>(fd);
+        session->clientName = in.text();
+        session->chosenName = in.number();
+        restored[i].inChannel = in.number();
+        session->currentChannel = in.text();
+        session->isChannelOwner = in.number();
+        session->resumeToken = in.text();
+        session->dedup = readDedup(in);
+        restored[i].watched.resize(in.number());
+        for (std::string& word : restored[i].watched) {
+            word = in.text();
+        }
+        session->muted = in.number();
+        session->muteExpiresMs = in.number();
+        session->relayed = in.number();
+        std::string unread = in.text();
+        std::string unsent = in.text();
+        session->connection->restore(unread, unsent);
+        restored[i].session = session;
+    }
+
+    size_t channelCount = in.failed ? 0 : in.number();
+    for (size_t i = 0; i < channelCount && !in.failed; i++) {
+        bool created;
+        Channel* channel = findOrCreateChannel(in.text(), created);
+        {
+            std::lock_guard<std::mutex> lock(channel->historyMutex);
+            uint64_t nextSeq = in.number();
+            size_t historySize = in.number();
+            for (size_t j = 0; j < historySize && !in.failed; j++) {
+                uint64_t seq = in.number();
+                recordHistoryLocked(channel, std::make_shared<const std::string>(in.text()), seq);
+            }
+            channel->nextSeq = nextSeq;
+        }
+        fanoutScheduler.setWeight(channel, std::clamp<int>(in.number(), 1, MAX_CHANNEL_WEIGHT));
+        int batchIntervalMs = in.number();
+        size_t batchBytes = in.number();
+        if (batchIntervalMs > 0) {
+            configureBatch(channel, batchIntervalMs, batchBytes);
+        }
+        size_t blockedCount = in.number();
+        for (size_t j = 0; j < blockedCount && !in.failed; j++) {
+            keywordMatcher.block(channel, in.text());
+        }
+
+        std::vector<std::shared_ptr<ClientSession>> members(in.number());
+        for (std::shared_ptr<ClientSession>& member : members) {
+            uint64_t index = in.number();
+            if (index >= restored.size()) {
+                in.failed = true;
+                break;
+            }
+            member = restored[index].session;
+            // Whatever it had not been sent yet is in its unsent bytes
+            member->deliveredThroughSeq = channel->nextSeq - 1;
+        }
+        if (in.failed) {
+            break;
         }
+        updateRoster(channel, [&members](ChannelRoster& roster) {
+            roster.members.insert(roster.members.end(), members.begin(), members.end());
+        });
 
-        //If user wants to get the ip address another user from the channel
-        if(receivedMessage.rfind(WHOIS_COMMAND, 0) == 0){
-            //Checks if he is administrator
-            if(isChannelOwner){
-                std::string userName = receivedMessage.substr(7);
-                
-                //Searches for the user in all the clients
-                auto flag = find(clientNames.begin(), clientNames.end(), userName);
-                if(flag == clientNames.end()){
-                    std::string userMessage = "User not found.";
-                    sendMessage(clientSocket, userMessage);
+        size_t mailboxCountHere = in.number();
+        for (size_t j = 0; j < mailboxCountHere && !in.failed; j++) {
+            auto mailbox = std::make_shared<Mailbox>();
+            mailbox->nickname = in.text();
+            mailbox->channelName = channel->name;
+            mailbox->channel = channel;
+            uint64_t expiresAtMs = in.number();
+            mailbox->frames.resize(in.number());
+            for (Frame& frame : mailbox->frames) {
+                frame = std::make_shared<const std::string>(in.text());
+                mailbox->memoryBytes += frame->size();
+            }
+            uint64_t spillIndex = in.number();
+            if (spillIndex != NO_DESCRIPTOR) {
+                mailbox->spillFile = std::make_shared<LogFile>(descriptor(spillIndex));
+            }
+            mailbox->spilledBytes = in.number();
+            mailbox->messages = in.number();
+            mailbox->lostMessages = in.number();
+            if (in.failed) {
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mailboxesMutex);
+                if (!mailboxes.try_emplace(mailbox->nickname, mailbox).second) {
                     continue;
                 }
-                int index =  flag - clientNames.begin();
+                mailboxCount++;
+            }
+            updateRoster(channel, [&mailbox](ChannelRoster& roster) {
+                roster.mailboxes.push_back(mailbox);
+            });
+            uint64_t nowMs = steadyMilliseconds();
+            scheduleMailboxExpiry(mailbox, expiresAtMs > nowMs ? expiresAtMs - nowMs : 1);
+        }
+    }
 
-                //Pegar o ip aqui, não do cliente que mandou a mensagem mas do alvo userName, que pegamos o  index no vetor com os ID's
-                std::string ip = "127.0.0.1";
-                std::string userMessage = "User " + userName + " is on IP: " + ip;
-                sendMessage(clientSocket, userMessage);
+    size_t waitingCount = in.failed ? 0 : in.number();
+    for (size_t i = 0; i < waitingCount && !in.failed; i++) {
+        std::string token = in.text();
+        ResumeState resume;
+        resume.clientName = in.text();
+        resume.chosenName = in.number();
+        resume.channelName = in.text();
+        resume.channel = resume.channelName.empty() ? nullptr : findChannel(resume.channelName);
+        resume.isChannelOwner = in.number();
+        resume.muted = in.number();
+        resume.muteExpiresMs = in.number();
+        resume.dedup = readDedup(in);
+        resume.expiresAtMs = in.number();
+        std::lock_guard<std::mutex> lock(resumeMutex);
+        resumeStates[token] = resume;
+    }
+    size_t tokenCount = in.failed ? 0 : in.number();
+    for (size_t i = 0; i < tokenCount && !in.failed; i++) {
+        std::string token = in.text();
+        federation.rememberToken(token, in.text());
+    }
+    if (in.failed) {
+        std::cerr << "The state from the old server is incomplete." << std::endl;
+        return -1;
+    }
 
-                continue;
-            }else{
-                std::string permissionMessage = "This command may only be used by the channel administrator";
-                sendMessage(clientSocket, permissionMessage);
-                continue;
+    uint64_t nowMs = steadyMilliseconds();
+    for (Restored& entry : restored) {
+        std::shared_ptr<ClientSession>& session = entry.session;
+        if (entry.inChannel) {
+            session->channel = findChannel(session->currentChannel);
+        }
+        publishPlace(*session);
+        if (!session->resumeToken.empty()) {
+            std::lock_guard<std::mutex> lock(resumeMutex);
+            resumeStates[session->resumeToken].live = session;
+        }
+        for (const std::string& word : entry.watched) {
+            keywordMatcher.watch(session, word);
+        }
+        if (session->muted) {
+            uint64_t expiresMs = session->muteExpiresMs;
+            setMuted(session, true, session->currentChannel, expiresMs == 0 ? 0 : expiresMs > nowMs ? expiresMs - nowMs : 1);
+        }
+        if (session->chosenName) {
+            directoryPublish(session.get(), session->clientName, entry.inChannel ? session->currentChannel : "");
+        }
+        if (!reactor.add(session->connection->socket, session->connection, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+            // Already in its channel, the directory and the resume table: drop it as if it had disconnected
+            std::cerr << "Failed to register connection." << std::endl;
+            closeSession(session);
+            continue;
+        }
+        clientSession(session, true);
+    }
+    std::cout << "Took over " << restored.size() << " clients and " << channelCount << " channels." << std::endl;
+    return listenSocket;
+}
+
+// Asks the server listening at path for its state. False if something went
+// wrong half way; received tells whether there was a server to take over from.
+bool receiveHandoff(const std::string& path, std::string& state, std::vector<int>& fds, bool& received) {
+    received = false;
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "The takeover path is too long." << std::endl;
+        return false;
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket == -1 || connect(socket, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        if (socket != -1) {
+            ::close(socket);
+        }
+        return true;  // nobody there: a cold start
+    }
+
+    uint64_t header[2];
+    bool ok = readAll(socket, reinterpret_cast<char*>(header), sizeof(header));
+    if (ok) {
+        state.resize(header[0]);
+        ok = readAll(socket, state.data(), state.size()) && receiveDescriptors(socket, header[1], fds);
+    }
+    // The old server finishes its log writes and closes the connection once
+    // we confirm; after that the log is ours
+    char confirm = 1;
+    if (ok && writeAll(socket, &confirm, 1)) {
+        char ignored;
+        while (recv(socket, &ignored, 1, 0) > 0) {
+        }
+        received = true;
+    } else {
+        std::cerr << "The handoff from the old server failed." << std::endl;
+        for (int fd : fds) {
+            ::close(fd);
+        }
+        fds.clear();
+        ok = false;
+    }
+    ::close(socket);
+    return ok;
+}
+
+// Listens at the takeover path for the server that will replace this one.
+// A handoff blocks the reactor thread on purpose: no timers fire and no
+// connection is woken until it is over.
+class HandoffListener : public ReactorHandler {
+public:
+    HandoffListener(int socket, int listenSocket, Listener* listener) : socket(socket), listenSocket(listenSocket), listener(listener) {}
+
+    void onEvents(uint32_t) override {
+        int connection = accept4(socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection < 0) {
+            return;
+        }
+        // Whoever connects gets every client's socket
+        ucred peer{};
+        socklen_t peerLength = sizeof(peer);
+        if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) < 0 || peer.uid != geteuid()) {
+            ::close(connection);
+            return;
+        }
+        std::cout << "A new server is taking over, pausing clients..." << std::endl;
+        auto started = std::chrono::steady_clock::now();
+        reactor.modify(listenSocket, listener, 0);
+        readsPaused = true;
+
+        // The new server starts from this snapshot for tokens it doesn't get
+        std::vector<std::shared_ptr<ClientSession>> sessions;
+        bool handedOff = drain() && (config.snapshotPath.empty() || writeSnapshotNow(config.snapshotPath)) && send(connection, sessions);
+        if (handedOff) {
+            messageLog.stop();
+            // Frees the link port before the new server is let go; peers link to it instead
+            federation.stop();
+            for (const std::shared_ptr<ClientSession>& session : sessions) {
+                session->connection->abandon();
             }
+            ::close(connection);
+            auto pausedMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+            std::cout << "Handed " << sessions.size() << " clients over after a " << pausedMs << " ms pause." << std::endl;
+            exitServer = true;
+            return;
         }
-        std::string fullMessage = clientName + ": " + receivedMessage;
 
-        // Send the message to all clients in the same channel
-        for (int i = 0; i < channelsNames[currentChannel].size(); i++) {
-            
-            int destinationSocket = channelsNames[currentChannel][i];
-            sendMessage(destinationSocket, fullMessage);
+        std::cerr << "The handoff failed, carrying on." << std::endl;
+        ::close(connection);
+        resumeParkedReaders();
+        reactor.modify(listenSocket, listener, EPOLLIN);
+    }
+
+private:
+    // Waits for the workers to finish what they were doing. Batched chat is
+    // flushed, so it ends up in the members' queues.
+    bool drain() {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(HANDOFF_DRAIN_TIMEOUT_MS);
+        while (true) {
+            while (!workerPool.idle()) {
+                if (std::chrono::steady_clock::now() > deadline) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            bool flushed = false;
+            EpochGuard guard;
+            for (const auto& [name, channel] : *channelsNames.load()) {
+                ChannelBatch* batch = channel->batch.load();
+                if (batch != nullptr) {
+                    std::lock_guard<std::mutex> lock(batch->mutex);
+                    flushed = flushed || !batch->pending.empty();
+                    flushBatchLocked(channel, *batch);
+                }
+            }
+            if (!flushed) {
+                return true;
+            }
+            fanoutScheduler.dispatch();
         }
     }
 
-    // Remove client from the connected clients vector
-    auto it = std::find(connectedClients.begin(), connectedClients.end(), clientSocket);
-    if (it != connectedClients.end()) {
-        connectedClients.erase(it);
-        clientNames.erase(clientNames.begin() + std::distance(connectedClients.begin(), it));
+    bool send(int connection, std::vector<std::shared_ptr<ClientSession>>& sessions) {
+        std::vector<int> fds;
+        std::string state = saveHandoffState(listenSocket, fds, sessions);
+        uint64_t header[2] = {state.size(), fds.size()};
+        // A new process that stops reading or replying fails the handoff instead of hanging us
+        timeval timeout{HANDOFF_REPLY_TIMEOUT_MS / 1000, (HANDOFF_REPLY_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(connection, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char confirm = 0;
+        return writeAll(connection, reinterpret_cast<const char*>(header), sizeof(header)) &&
+               writeAll(connection, state.data(), state.size()) && sendDescriptors(connection, fds) &&
+               readAll(connection, &confirm, 1) && confirm == 1;
     }
 
-    // Close the client socket
-    close(clientSocket);
+    int socket;
+    int listenSocket;
+    Listener* listener;
+};
+
+bool startHandoffListener(const std::string& path, int listenSocket, Listener* listener) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (socket == -1 || bind(socket, (struct sockaddr*)&address, sizeof(address)) < 0 || chmod(path.c_str(), 0600) < 0 ||
+        listen(socket, 1) < 0) {
+        std::cerr << "Failed to listen at " << path << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+    return reactor.add(socket, std::make_shared<HandoffListener>(socket, listenSocket, listener), EPOLLIN);
+}
+
+// Local clients skip the TCP stack. Whatever was at the path is replaced,
+// like a hot restart's new server replaces the old one there.
+int listenOnUnixSocket(const std::string& path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "The Unix socket path is too long." << std::endl;
+        return -1;
+    }
+    strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    int socket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path.c_str());
+    if (socket == -1 || bind(socket, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(socket, SOMAXCONN) < 0) {
+        std::cerr << "Failed to listen at " << path << ": " << strerror(errno) << std::endl;
+        return -1;
+    }
+    return socket;
 }
 
 void signalHandler(int signum) {
     if (signum == SIGINT) {
-        std::cout << "Server interrupted. Closing connections..." << std::endl;
         exitServer = true;
+        reactor.wake();
+    }
+}
+
+// One descriptor per session, so allow as many as the hard limit permits
+void raiseDescriptorLimit() {
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
 
-        // Close all client sockets
-        for (int clientSocket : connectedClients) {
-            close(clientSocket);
+// Reads --name=value options into config; false on anything unknown
+bool parseArguments(int argc, char* argv[]) {
+    std::map<std::string, double*> numericOptions = {
+        {"--session-rate", &config.sessionMessageRate},
+        {"--session-burst", &config.sessionMessageBurst},
+        {"--channel-rate", &config.channelMessageRate},
+        {"--channel-burst", &config.channelMessageBurst},
+        {"--log-retention-mb", &config.logRetentionMegabytes},
+        {"--log-retention-hours", &config.logRetentionHours},
+        {"--snapshot-interval", &config.snapshotIntervalSeconds},
+    };
+    // Whole numbers between the two bounds
+    struct IntegerOption {
+        int* value;
+        int min;
+        int max;
+    };
+    std::map<std::string, IntegerOption> integerOptions = {
+        {"--port", {&config.port, 1, 65535}},
+        {"--link-port", {&config.linkPort, 1, 65535}},
+        {"--workers", {&config.workers, 0, std::numeric_limits<int>::max()}},
+    };
+    std::map<std::string, std::string*> textOptions = {
+        {"--log-dir", &config.logDirectory},
+        {"--takeover", &config.takeoverPath},
+        {"--snapshot", &config.snapshotPath},
+        {"--node", &config.nodeName},
+        {"--peers", &config.peers},
+        {"--unix", &config.unixPath},
+    };
+
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        std::string name = argument.substr(0, equals);
+        auto textOption = textOptions.find(name);
+        if (equals != std::string::npos && textOption != textOptions.end()) {
+            *textOption->second = argument.substr(equals + 1);
+            continue;
+        }
+        auto integerOption = integerOptions.find(name);
+        if (equals != std::string::npos && integerOption != integerOptions.end()) {
+            const IntegerOption& bounds = integerOption->second;
+            std::string value = argument.substr(equals + 1);
+            size_t used = 0;
+            int number = 0;
+            try {
+                number = std::stoi(value, &used);
+            } catch (const std::exception&) {
+                used = 0;
+            }
+            if (used == 0 || used != value.size() || number < bounds.min || number > bounds.max) {
+                std::cerr << "Invalid value for " << name << std::endl;
+                return false;
+            }
+            *bounds.value = number;
+            continue;
+        }
+        auto option = numericOptions.find(name);
+        if (equals == std::string::npos || option == numericOptions.end()) {
+            std::cerr << "Unknown option: " << argument << std::endl;
+            return false;
+        }
+        try {
+            *option->second = std::stod(argument.substr(equals + 1));
+        } catch (const std::exception&) {
+            std::cerr << "Invalid value for " << name << std::endl;
+            return false;
         }
     }
+    return true;
 }
 
-int main() {
+// Tests build this file into their own binary, with their own main()
+#ifndef SERVER_MODULO3_NO_MAIN
+int main(int argc, char* argv[]) {
+    if (!parseArguments(argc, argv)) {
+        return 1;
+    }
     signal(SIGINT, signalHandler);
+    signal(SIGPIPE, SIG_IGN);
+    raiseDescriptorLimit();
+
+    // Before the workers are forked, so that they all accept on it
+    int unixSocket = -1;
+    if (!config.unixPath.empty() && (unixSocket = listenOnUnixSocket(config.unixPath)) == -1) {
+        return 1;
+    }
+
+    // Before any thread starts: the workers are forked from here
+    if (config.workers > 0) {
+        if (config.workers > MAX_WORKER_PROCESSES) {
+            std::cerr << "At most " << MAX_WORKER_PROCESSES << " worker processes are supported." << std::endl;
+            return 1;
+        }
+        if (!config.takeoverPath.empty() || !config.snapshotPath.empty() || !config.logDirectory.empty() ||
+            config.linkPort > 0 || !config.peers.empty()) {
+            std::cerr << "--workers cannot be combined with --takeover, --snapshot, --log-dir, --link-port or --peers." << std::endl;
+            return 1;
+        }
+        int exitCode = prefork.superviseWorkers(config.workers);
+        if (exitCode != -1) {
+            return exitCode;
+        }
+    }
 
-    int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverSocket == -1) {
-        std::cerr << "Failed to create socket." << std::endl;
+    // Before the log starts: the old server writes to it until we have everything
+    std::string handoffState;
+    std::vector<int> handoffFds;
+    bool handedOver = false;
+    if (!config.takeoverPath.empty() && !receiveHandoff(config.takeoverPath, handoffState, handoffFds, handedOver)) {
         return 1;
     }
 
-    // Set up server address
-    sockaddr_in serverAddress;
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    serverAddress.sin_port = htons(12345);  // Choose a suitable port number
+    if (!config.logDirectory.empty() &&
+        !messageLog.start(config.logDirectory, config.logRetentionMegabytes * 1024 * 1024, config.logRetentionHours * 3600 * 1000)) {
+        return 1;
+    }
+    // Only mapped here; channels and sessions come back as they are used
+    if (!config.snapshotPath.empty() && bootSnapshot.open(config.snapshotPath)) {
+        std::cout << "Loaded the snapshot with " << bootSnapshot.header().channelCount << " channels and "
+                  << bootSnapshot.header().sessionCount << " sessions, written "
+                  << (systemMilliseconds() - bootSnapshot.header().writtenAtMs) / 1000 << " s ago." << std::endl;
+    }
+    workerPool.start(WORKER_THREADS);
+    auto timerTicker = std::make_shared<TimerTicker>();
+    if (!reactor.start() || !timerTicker->start() || !reactor.add(timerTicker->timerFd, timerTicker, EPOLLIN)) {
+        std::cerr << "Failed to create the event loop." << std::endl;
+        return 1;
+    }
 
-    // Bind the socket to the server address
-    if (bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
-        std::cerr << "Failed to bind socket." << std::endl;
+    // Before restored sessions join their channels, so peers hear about them
+    if ((config.linkPort > 0 || !config.peers.empty()) && !federation.start()) {
+        return 1;
+    }
+    if (prefork.enabled() && !prefork.attach()) {
+        std::cerr << "Failed to listen to the other workers." << std::endl;
         return 1;
     }
 
-    // Start listening for incoming connections
-    listen(serverSocket, 3);
+    int serverSocket;
+    if (handedOver) {
+        serverSocket = restoreHandoffState(handoffState, handoffFds);
+        if (serverSocket == -1) {
+            return 1;
+        }
+    } else {
+        serverSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (serverSocket == -1) {
+            std::cerr << "Failed to create socket." << std::endl;
+            return 1;
+        }
+
+        // Don't wait for the old server's connections to leave TIME_WAIT
+        int reuseAddress = 1;
+        setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+        // Every worker process listens on the port; the kernel spreads the clients
+        if (prefork.enabled()) {
+            setsockopt(serverSocket, SOL_SOCKET, SO_REUSEPORT, &reuseAddress, sizeof(reuseAddress));
+        }
 
-    std::cout << "Waiting for incoming connections..." << std::endl;
+        // Set up server address
+        sockaddr_in serverAddress;
+        serverAddress.sin_family = AF_INET;
+        serverAddress.sin_addr.s_addr = INADDR_ANY;
+        serverAddress.sin_port = htons(config.port);
 
-    while (!exitServer) {
-        // Accept a connection from a client
-        int clientSocket;
-        sockaddr_in clientAddress;
-        socklen_t clientAddressLength = sizeof(clientAddress);
-        clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddress, &clientAddressLength);
-        if (clientSocket < 0) {
-            std::cerr << "Failed to accept connection." << std::endl;
+        // Bind the socket to the server address
+        if (bind(serverSocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) {
+            std::cerr << "Failed to bind socket." << std::endl;
             return 1;
         }
 
-        std::cout << "Client connected. Client ID: " << clientSocket << std::endl;
+        // Start listening for incoming connections
+        listen(serverSocket, SOMAXCONN);
+    }
+    auto listener = std::make_shared<Listener>(serverSocket);
+    reactor.add(serverSocket, listener, EPOLLIN);
+    if (unixSocket != -1) {
+        reactor.add(unixSocket, std::make_shared<Listener>(unixSocket, true), EPOLLIN);
+    }
+    if (!config.takeoverPath.empty() && !startHandoffListener(config.takeoverPath, serverSocket, listener.get())) {
+        return 1;
+    }
+
+    if (!config.snapshotPath.empty() && config.snapshotIntervalSeconds > 0) {
+        scheduleSnapshots();
+    }
+
+    std::cout << "Waiting for incoming connections..." << std::endl;
 
-        // Start a new thread for each client
-        std::thread clientThreadObj(clientThread, clientSocket);
-        clientThreadObj.detach();
+    // Runs until SIGINT or until a new server takes over
+    reactor.run();
+    std::cout << (readsPaused ? "Exiting, the new server has the connections." : "Server interrupted. Closing connections...") << std::endl;
+    if (!readsPaused && !config.snapshotPath.empty()) {
+        writeSnapshotNow(config.snapshotPath);
     }
 
     // Close the server socket
     close(serverSocket);
+    if (unixSocket != -1) {
+        close(unixSocket);
+        // A new server that took over listens at the path now
+        if (!readsPaused) {
+            unlink(config.unixPath.c_str());
+        }
+    }
+    workerPool.stop();
+    messageLog.stop();
 
     return 0;
 }
+#endif
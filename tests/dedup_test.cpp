@@ -0,0 +1,41 @@
+// Chat sent with /id is handled once however often the client retries, and a
+// message the rate limit turned away is answered with /retry, not an ack.
+#include "test_util.h"
+
+const int PORT = 12462;
+
+int main(int argc, char* argv[]) {
+    CHECK(argc > 1, "usage: dedup_test <server binary>");
+    // Two messages of burst, then one a second
+    ServerProcess server(argv[1], {"--port=" + std::to_string(PORT), "--session-rate=1", "--session-burst=2"});
+
+    TestClient sender(PORT);
+    TestClient reader(PORT);
+    CHECK(sender.connected() && reader.connected(), "could not connect");
+    sender.ask("/register sender #dedup");
+    reader.ask("/register reader #dedup");
+
+    // A retry of a message the server already has is only acked again. The
+    // second message uses up the burst and the third is turned away.
+    sender.send("/id 1 hello");
+    sender.send("/id 1 hello");
+    sender.send("/id 2 second");
+    sender.send("/id 3 third");
+    std::vector<std::string> replies = sender.receive();
+    CHECK(countContaining(replies, "/ack 1") == 2, "expected two acks for 1: " << joined(replies));
+    CHECK(countContaining(replies, "/ack 2") == 1, "expected an ack for 2: " << joined(replies));
+    CHECK(countContaining(replies, "/retry 3") == 1 && countContaining(replies, "/ack 3") == 0,
+          "expected a retry for 3: " << joined(replies));
+    std::vector<std::string> chat = reader.receive();
+    CHECK(countContaining(chat, "sender: hello") == 1, "expected the message once: " << joined(chat));
+    CHECK(countContaining(chat, "sender: third") == 0, "the refused message went out: " << joined(chat));
+
+    // Sent again once the bucket has refilled, it goes through once
+    sleepMs(1200);
+    replies = sender.ask("/id 3 third");
+    CHECK(countContaining(replies, "/ack 3") == 1, "expected an ack for the retried 3: " << joined(replies));
+    chat = reader.receive();
+    CHECK(countContaining(chat, "sender: third") == 1, "expected the retried message once: " << joined(chat));
+    std::cout << "dedup: retries handled once, refused message retried" << std::endl;
+    return 0;
+}
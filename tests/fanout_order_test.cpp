@@ -0,0 +1,66 @@
+// A channel bigger than one fanout chunk gets its messages split across
+// workers; every member must still see the sequence numbers go up.
+#include "test_util.h"
+
+#include <memory>
+
+const int PORT = 12461;
+const int MEMBERS = 120;
+const int MESSAGES = 1500;
+const int DEADLINE_MS = 30000;
+const std::string SEQUENCE_PREFIX = "/seq ";
+
+int main(int argc, char* argv[]) {
+    CHECK(argc > 1, "usage: fanout_order_test <server binary>");
+    ServerProcess server(argv[1], {"--port=" + std::to_string(PORT), "--session-rate=1000000", "--session-burst=1000000",
+                                   "--channel-rate=1000000", "--channel-burst=1000000"});
+
+    std::vector<std::unique_ptr<TestClient>> members;
+    for (int i = 0; i < MEMBERS; i++) {
+        members.push_back(std::make_unique<TestClient>(PORT));
+        CHECK(members.back()->connected(), "member " << i << " could not connect");
+        members.back()->send("/register member" + std::to_string(i) + " #order");
+    }
+    // Sessions handle their frames in order, so the pong means the last one joined
+    CHECK(countContaining(members.back()->ask("/ping"), "pong") == 1, "no pong");
+
+    TestClient& sender = *members[0];
+    for (int i = 0; i < MESSAGES; i++) {
+        sender.send("message " + std::to_string(i));
+    }
+
+    std::vector<uint64_t> lastSeq(MEMBERS, 0);
+    std::vector<int> received(MEMBERS, 0);
+    int outOfOrder = 0;
+    auto started = std::chrono::steady_clock::now();
+    while (std::chrono::steady_clock::now() - started < std::chrono::milliseconds(DEADLINE_MS)) {
+        std::vector<pollfd> sockets;
+        for (std::unique_ptr<TestClient>& member : members) {
+            sockets.push_back({member->fd(), POLLIN, 0});
+        }
+        if (poll(sockets.data(), sockets.size(), 1000) <= 0) {
+            break;  // quiet for a second: fanout is done
+        }
+        for (int i = 0; i < MEMBERS; i++) {
+            if (!(sockets[i].revents & POLLIN) || !members[i]->readAvailable()) {
+                continue;
+            }
+            for (const std::string& frame : members[i]->takeFrames()) {
+                if (frame.rfind(SEQUENCE_PREFIX, 0) != 0) {
+                    continue;
+                }
+                uint64_t seq = std::stoull(frame.substr(SEQUENCE_PREFIX.size()));
+                outOfOrder += seq <= lastSeq[i];
+                lastSeq[i] = seq;
+                received[i]++;
+            }
+        }
+    }
+
+    for (int i = 0; i < MEMBERS; i++) {
+        CHECK(received[i] > 0, "member " << i << " got no chat");
+    }
+    CHECK(outOfOrder == 0, outOfOrder << " messages arrived out of order");
+    std::cout << "fanout order: " << MEMBERS << " members, " << MESSAGES << " messages, none out of order" << std::endl;
+    return 0;
+}
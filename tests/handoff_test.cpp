@@ -0,0 +1,62 @@
+// A hot restart hands the connections and the state to the new process: the
+// clients stay connected, the channel keeps numbering, retries are still
+// recognised, a frame split across the restart arrives whole and a mailbox
+// comes along.
+#include "test_util.h"
+
+const int PORT = 12463;
+const int EXIT_TIMEOUT_MS = 10000;
+
+int main(int argc, char* argv[]) {
+    CHECK(argc > 1, "usage: handoff_test <server binary>");
+    std::string takeoverPath = "/tmp/chat-handoff-test-" + std::to_string(getpid()) + ".sock";
+    std::vector<std::string> arguments{"--port=" + std::to_string(PORT), "--takeover=" + takeoverPath};
+    ServerProcess oldServer(argv[1], arguments);
+
+    TestClient alice(PORT);
+    TestClient bob(PORT);
+    CHECK(alice.connected() && bob.connected(), "could not connect");
+    alice.ask("/register alice #handoff");
+    bob.ask("/register bob #handoff");
+    {
+        TestClient carol(PORT);
+        carol.ask("/register carol #handoff");
+    }
+    alice.receive();
+    std::vector<std::string> replies = alice.ask("/id 1 before");
+    CHECK(countContaining(replies, "/seq 1 alice: before") == 1, "no chat before the handoff: " << joined(replies));
+    bob.receive();
+
+    // Half of a frame goes to the old process, the rest to the new one
+    std::string message = "split frame";
+    int messageLength = message.size();
+    std::string frame(sizeof(messageLength), '\0');
+    memcpy(&frame[0], &messageLength, sizeof(messageLength));
+    frame += message;
+    size_t half = sizeof(messageLength) + 3;
+    CHECK(::send(alice.fd(), frame.data(), half, 0) == (ssize_t)half, "could not send half a frame");
+    sleepMs(QUIET_MS);
+
+    ServerProcess newServer(argv[1], arguments);
+    CHECK(oldServer.waitForExit(EXIT_TIMEOUT_MS), "the old server did not hand over");
+    CHECK(::send(alice.fd(), frame.data() + half, frame.size() - half, 0) == (ssize_t)(frame.size() - half),
+          "could not send the rest of the frame");
+    std::vector<std::string> chat = bob.receive();
+    CHECK(countContaining(chat, "/seq 2 alice: split frame") == 1, "the split frame did not arrive whole: " << joined(chat));
+
+    // The retry is recognised by the new process
+    replies = alice.ask("/id 1 before");
+    CHECK(countContaining(replies, "/ack 1") == 1 && countContaining(replies, "before") == 0,
+          "the retry was delivered again: " << joined(replies));
+    alice.ask("after");
+    chat = bob.receive();
+    CHECK(countContaining(chat, "/seq 3 alice: after") == 1, "no chat after the handoff: " << joined(chat));
+
+    TestClient carol(PORT);
+    replies = carol.ask("/nickname carol");
+    CHECK(countContaining(replies, "alice: after") == 1, "the mailbox did not come along: " << joined(replies));
+    newServer.stop(SIGINT);
+    unlink(takeoverPath.c_str());
+    std::cout << "handoff: connections, numbering, dedup and mailbox kept" << std::endl;
+    return 0;
+}
@@ -0,0 +1,58 @@
+// A server killed without warning comes back from its last snapshot: a
+// client resumes its session with its token, in its channel, with its mute,
+// and the channel goes on numbering where it was.
+#include "test_util.h"
+
+const int PORT = 12464;
+const int SNAPSHOT_WAIT_MS = 1500;  // longer than --snapshot-interval=1
+const std::string TOKEN_PREFIX = "/token ";
+
+std::string tokenIn(const std::vector<std::string>& frames) {
+    for (const std::string& frame : frames) {
+        if (frame.rfind(TOKEN_PREFIX, 0) == 0) {
+            return frame.substr(TOKEN_PREFIX.size());
+        }
+    }
+    return std::string();
+}
+
+int main(int argc, char* argv[]) {
+    CHECK(argc > 1, "usage: snapshot_test <server binary>");
+    std::string snapshotPath = "/tmp/chat-snapshot-test-" + std::to_string(getpid()) + ".snap";
+    std::vector<std::string> arguments{"--port=" + std::to_string(PORT), "--snapshot=" + snapshotPath, "--snapshot-interval=1"};
+    std::string aliceToken, bobToken;
+    {
+        ServerProcess server(argv[1], arguments);
+        TestClient alice(PORT);
+        TestClient bob(PORT);
+        CHECK(alice.connected() && bob.connected(), "could not connect");
+        aliceToken = tokenIn(alice.ask("/register alice #snapshot"));
+        bobToken = tokenIn(bob.ask("/register bob #snapshot"));
+        CHECK(!aliceToken.empty() && !bobToken.empty(), "no resume tokens");
+        alice.ask("/mute bob");
+        alice.ask("one");
+        alice.ask("two");
+        sleepMs(SNAPSHOT_WAIT_MS);
+        server.stop(SIGKILL);
+    }
+
+    ServerProcess server(argv[1], arguments);
+    TestClient alice(PORT);
+    TestClient bob(PORT);
+    CHECK(alice.connected() && bob.connected(), "could not reconnect");
+    std::vector<std::string> replies = alice.ask("/resume " + aliceToken + " 2");
+    CHECK(countContaining(replies, "Resumed as alice in #snapshot.") == 1, "alice did not resume: " << joined(replies));
+    replies = bob.ask("/resume " + bobToken + " 2");
+    CHECK(countContaining(replies, "Resumed as bob in #snapshot.") == 1, "bob did not resume: " << joined(replies));
+
+    replies = bob.ask("still muted?");
+    CHECK(countContaining(replies, "You are muted on this channel.") == 1, "the mute was lost: " << joined(replies));
+    alice.receive();
+    replies = alice.ask("three");
+    CHECK(countContaining(replies, "/seq 3 alice: three") == 1, "the numbering did not carry on: " << joined(replies));
+
+    server.stop(SIGINT);
+    unlink(snapshotPath.c_str());
+    std::cout << "snapshot: sessions, mute and numbering restored" << std::endl;
+    return 0;
+}
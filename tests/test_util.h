@@ -0,0 +1,195 @@
+// Helpers for the behaviour tests: each test starts server_modulo3 (its path
+// is the test's first argument) on its own port and talks to it like the
+// chat client does, with length-prefixed frames.
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <chrono>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+const int CONNECT_ATTEMPTS = 50;
+const int CONNECT_RETRY_MS = 100;
+const int QUIET_MS = 200;  // receive() stops after this long without a frame
+
+#define CHECK(condition, message)                                                                    \
+    do {                                                                                             \
+        if (!(condition)) {                                                                          \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << message << std::endl;                \
+            return 1;                                                                                \
+        }                                                                                            \
+    } while (0)
+
+void sleepMs(int ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+// A server process; stopped with SIGINT (or killed) when the test is done
+class ServerProcess {
+public:
+    ServerProcess(const std::string& binary, const std::vector<std::string>& arguments) {
+        pid = fork();
+        if (pid == 0) {
+            int devNull = open("/dev/null", O_WRONLY);
+            dup2(devNull, STDOUT_FILENO);
+            std::vector<char*> argv{const_cast<char*>(binary.c_str())};
+            for (const std::string& argument : arguments) {
+                argv.push_back(const_cast<char*>(argument.c_str()));
+            }
+            argv.push_back(nullptr);
+            execv(binary.c_str(), argv.data());
+            _exit(127);
+        }
+    }
+
+    ~ServerProcess() { stop(SIGINT); }
+
+    void stop(int signal) {
+        if (pid <= 0) {
+            return;
+        }
+        kill(pid, signal);
+        waitpid(pid, nullptr, 0);
+        pid = -1;
+    }
+
+    // For a server that exits by itself, like one that handed its clients over
+    bool waitForExit(int timeoutMs) {
+        for (int waited = 0; pid > 0 && waited < timeoutMs; waited += 10) {
+            if (waitpid(pid, nullptr, WNOHANG) == pid) {
+                pid = -1;
+                return true;
+            }
+            sleepMs(10);
+        }
+        return pid <= 0;
+    }
+
+private:
+    pid_t pid = -1;
+};
+
+class TestClient {
+public:
+    // Retries while the server is still starting
+    explicit TestClient(int port) {
+        for (int attempt = 0; attempt < CONNECT_ATTEMPTS && socket == -1; attempt++) {
+            int candidate = ::socket(AF_INET, SOCK_STREAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(port);
+            inet_pton(AF_INET, "127.0.0.1", &address.sin_addr);
+            if (connect(candidate, (sockaddr*)&address, sizeof(address)) == 0) {
+                socket = candidate;
+            } else {
+                close(candidate);
+                sleepMs(CONNECT_RETRY_MS);
+            }
+        }
+    }
+
+    ~TestClient() {
+        if (socket != -1) {
+            close(socket);
+        }
+    }
+
+    bool connected() const { return socket != -1; }
+    int fd() const { return socket; }
+
+    void send(const std::string& message) {
+        int messageLength = message.size();
+        std::string frame(sizeof(messageLength) + message.size(), '\0');
+        memcpy(&frame[0], &messageLength, sizeof(messageLength));
+        memcpy(&frame[sizeof(messageLength)], message.data(), message.size());
+        size_t sent = 0;
+        while (sent < frame.size()) {
+            ssize_t count = ::send(socket, frame.data() + sent, frame.size() - sent, MSG_NOSIGNAL);
+            if (count <= 0) {
+                return;
+            }
+            sent += count;
+        }
+    }
+
+    // Reads what is there; false once the server closed the connection
+    bool readAvailable() {
+        char chunk[65536];
+        ssize_t count = recv(socket, chunk, sizeof(chunk), MSG_DONTWAIT);
+        if (count == 0) {
+            return false;
+        }
+        if (count > 0) {
+            buffer.append(chunk, count);
+        }
+        return true;
+    }
+
+    // Frames complete in the buffer
+    std::vector<std::string> takeFrames() {
+        std::vector<std::string> frames;
+        size_t offset = 0;
+        int messageLength;
+        while (buffer.size() - offset >= sizeof(messageLength)) {
+            memcpy(&messageLength, &buffer[offset], sizeof(messageLength));
+            if (buffer.size() - offset < sizeof(messageLength) + messageLength) {
+                break;
+            }
+            frames.push_back(buffer.substr(offset + sizeof(messageLength), messageLength));
+            offset += sizeof(messageLength) + messageLength;
+        }
+        buffer.erase(0, offset);
+        return frames;
+    }
+
+    // Everything that arrives until the connection has been quiet for QUIET_MS
+    std::vector<std::string> receive() {
+        std::vector<std::string> frames;
+        while (true) {
+            pollfd ready{socket, POLLIN, 0};
+            if (poll(&ready, 1, QUIET_MS) <= 0 || !readAvailable()) {
+                break;
+            }
+            for (std::string& frame : takeFrames()) {
+                frames.push_back(std::move(frame));
+            }
+        }
+        return frames;
+    }
+
+    // Sends the message and returns what came back
+    std::vector<std::string> ask(const std::string& message) {
+        send(message);
+        return receive();
+    }
+
+private:
+    int socket = -1;
+    std::string buffer;
+};
+
+size_t countContaining(const std::vector<std::string>& frames, const std::string& text) {
+    size_t count = 0;
+    for (const std::string& frame : frames) {
+        count += frame.find(text) != std::string::npos;
+    }
+    return count;
+}
+
+std::string joined(const std::vector<std::string>& frames) {
+    std::string text;
+    for (const std::string& frame : frames) {
+        text += (text.empty() ? "" : " | ") + frame;
+    }
+    return text;
+}
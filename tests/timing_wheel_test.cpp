@@ -0,0 +1,64 @@
+// The server's timing wheel, on a clock the test moves one tick at a time:
+// timers fire on the very tick they are due, also when that tick makes a
+// higher level cascade down, and a timer cancelled or rescheduled by an
+// earlier callback of the same tick doesn't run.
+#include "../server_modulo3.cpp"
+#include "test_util.h"
+
+class ManualWheel : public TimingWheel {
+public:
+    uint64_t now = 0;
+
+    void advanceTo(uint64_t tick) {
+        while (now < tick) {
+            now++;
+            advance();
+        }
+    }
+
+protected:
+    uint64_t ticksSinceStart() override { return now; }
+};
+
+const uint64_t UNFIRED = UINT64_MAX;
+
+int main() {
+    ManualWheel wheel;
+
+    // Just before, on and after the boundaries of levels 1, 2 and 3
+    const uint64_t SLOTS = TimingWheel::SLOTS;
+    std::vector<uint64_t> delays;
+    for (uint64_t boundary : {SLOTS, SLOTS * SLOTS, SLOTS * SLOTS * SLOTS}) {
+        delays.insert(delays.end(), {boundary - 1, boundary, boundary + 1, 3 * boundary});
+    }
+    std::vector<Timer> timers(delays.size());
+    std::vector<uint64_t> firedAt(delays.size(), UNFIRED);
+    for (size_t i = 0; i < delays.size(); i++) {
+        wheel.schedule(timers[i], delays[i] * TIMER_TICK_MS, [&wheel, &firedAt, i]() { firedAt[i] = wheel.now; });
+    }
+    wheel.advanceTo(delays.back() + SLOTS);
+    for (size_t i = 0; i < delays.size(); i++) {
+        CHECK(firedAt[i] == delays[i], "a timer due at tick " << delays[i] << " fired at " << (int64_t)firedAt[i]);
+    }
+    CHECK(wheel.pendingTimers() == 0, wheel.pendingTimers() << " timers still armed");
+
+    // Due together on a cascade tick: the first cancels the second and
+    // pushes the third back
+    uint64_t start = wheel.now;
+    uint64_t due = (start / SLOTS + 2) * SLOTS;
+    Timer first, cancelled, rescheduled;
+    uint64_t cancelledAt = UNFIRED, rescheduledAt = UNFIRED;
+    wheel.schedule(first, (due - start) * TIMER_TICK_MS, [&]() {
+        wheel.cancel(cancelled);
+        wheel.schedule(rescheduled, 5 * TIMER_TICK_MS, [&]() { rescheduledAt = wheel.now; });
+    });
+    wheel.schedule(cancelled, (due - start) * TIMER_TICK_MS, [&]() { cancelledAt = wheel.now; });
+    wheel.schedule(rescheduled, (due - start) * TIMER_TICK_MS, [&]() { rescheduledAt = due; });
+    wheel.advanceTo(due + SLOTS);
+    CHECK(cancelledAt == UNFIRED, "a timer cancelled on its own tick fired at " << cancelledAt);
+    CHECK(rescheduledAt == due + 5, "a timer rescheduled on its own tick fired at " << (int64_t)rescheduledAt << ", not " << due + 5);
+    CHECK(wheel.pendingTimers() == 0, wheel.pendingTimers() << " timers still armed");
+
+    std::cout << "timing wheel: " << delays.size() << " timers on time, cancel and reschedule on the same tick held" << std::endl;
+    return 0;
+}